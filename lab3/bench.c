@@ -0,0 +1,513 @@
+// Xiaoyi Dong & Sihao Liu March 6, 2025
+/*
+Functionality:
+Goodput benchmark for the lab3 UDP file transfer on loopback.
+For every cell of the matrix file size x loss rate x RTT x fragment size it runs the transfer -n times,
+each time with a fresh server (in <workdir>/dst) and deliver -f (in <workdir>/src), verifies the received
+file byte for byte, and reports one row per cell as CSV (default) or JSON on stdout.
+Loss and RTT are emulated by the relay: loss applies client->server, half the RTT is added in each direction.
+Cells without loss or delay talk to the server directly.
+Reported per cell: runs, failures, goodput (median and mean, Mbit/s of file payload over the whole deliver run),
+retransmission ratio (retransmitted / total fragments), CPU seconds per GB for sender and receiver
+(user + system from wait4(), all threads), and completion-time percentiles (p50/p90/p99, nearest rank).
+Source files are random data generated once per size and reused across runs. With -s N they are sparse instead:
+N extents of SPARSE_EXTENT random bytes spread evenly over a file that is otherwise holes, which is how very large
+sizes fit on an ordinary disk. Goodput still counts every byte of the file, holes included.
+
+Highlights:
+Lists are comma-separated: -S 1K,1M,1G,10G (K/M/G/T are powers of 1024), -L 0,0.01, -R 0,20 (ms),
+-F 1400,0 (0 lets deliver probe the path). -a passes extra arguments to deliver, -A to the server.
+A run that exceeds -T seconds is killed and counted as a failure.
+-S large is the LARGE_SIZES preset, up to hundreds of GB. A dense run needs that much disk twice over (source
+and received copy) and time to match, so raise -T, or add -s to exercise the same sizes sparsely.
+Binaries are taken from -B (default: the current directory), so build server, deliver and relay there first.
+Build: gcc bench.c -o bench
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define MAX_LIST        32
+#define MAX_RUNS        1000
+#define MAX_ARGS        64
+#define LINE_LEN        1024
+#define GEN_CHUNK       (1 << 20)
+#define SPARSE_EXTENT   (4 << 20)   // Bytes of data in each extent of a -s source
+#define LARGE_SIZES     "10G,100G,500G"
+#define CMP_CHUNK       (1 << 20)
+#define STARTUP_US      200000   // Time given to the server and relay to bind
+#define DEFAULT_TIMEOUT 600
+
+struct bench_config {
+    long long sizes[MAX_LIST];
+    int n_sizes;
+    double losses[MAX_LIST];
+    int n_losses;
+    double rtts_ms[MAX_LIST];
+    int n_rtts;
+    int frags[MAX_LIST];
+    int n_frags;
+    int repeats;
+    int extents;                 // -s: sparse sources with this many data extents, 0 for dense ones
+    int json;
+    int port;
+    int timeout_s;
+    const char *workdir;
+    const char *bindir;
+    char *deliver_args[MAX_ARGS];
+    int n_deliver_args;
+    char *server_args[MAX_ARGS];
+    int n_server_args;
+};
+
+// Outcome of one transfer.
+struct run_result {
+    int ok;
+    double elapsed_s;
+    unsigned long long total_frag;
+    unsigned long long retransmits;
+    double sender_cpu_s;
+    double receiver_cpu_s;
+};
+
+long long current_timestamp_us() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+double cpu_seconds(const struct rusage *ru) {
+    return ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6 + ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+}
+
+// "10G" -> 10 * 2^30.
+long long parse_size(const char *s) {
+    char *end;
+    double v = strtod(s, &end);
+    switch (*end) {
+    case 'k': case 'K': v *= 1024; break;
+    case 'm': case 'M': v *= 1024 * 1024; break;
+    case 'g': case 'G': v *= 1024.0 * 1024 * 1024; break;
+    case 't': case 'T': v *= 1024.0 * 1024 * 1024 * 1024; break;
+    default: break;
+    }
+    return (long long)v;
+}
+
+// Split a comma-separated list; returns the number of items or -1 if there are too many.
+int split_list(char *s, char **items) {
+    int n = 0;
+    char *save = NULL;
+    for (char *tok = strtok_r(s, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (n == MAX_LIST) return -1;
+        items[n++] = tok;
+    }
+    return n;
+}
+
+// Split a space-separated argument string in place.
+int split_args(char *s, char **args) {
+    int n = 0;
+    char *save = NULL;
+    for (char *tok = strtok_r(s, " ", &save); tok && n < MAX_ARGS; tok = strtok_r(NULL, " ", &save)) {
+        args[n++] = tok;
+    }
+    return n;
+}
+
+// Write size bytes of xorshift noise to path unless a file of that size is already there. With extents > 0 the
+// file is sized with ftruncate() and only that many SPARSE_EXTENT runs of noise are written, evenly spaced.
+int make_source(const char *path, long long size, int extents) {
+    struct stat st;
+    if (stat(path, &st) == 0 && st.st_size == size) return 0;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("[ERROR] open (source) failed");
+        return -1;
+    }
+    uint64_t *chunk = malloc(GEN_CHUNK);
+    if (!chunk || (extents > 0 && ftruncate(fd, size) < 0)) {
+        perror("[ERROR] sizing the source failed");
+        free(chunk);
+        close(fd);
+        return -1;
+    }
+    uint64_t x = 0x9E3779B97F4A7C15ULL ^ (uint64_t)size;
+    for (int e = 0; e < (extents > 0 ? extents : 1); e++) {
+        long long start = extents > 0 ? size / extents * e : 0;
+        long long end = extents > 0 && size - start > SPARSE_EXTENT ? start + SPARSE_EXTENT : size;
+        for (long long done = start; done < end; ) {
+            for (int i = 0; i < GEN_CHUNK / 8; i++) {
+                x ^= x << 13;
+                x ^= x >> 7;
+                x ^= x << 17;
+                chunk[i] = x;
+            }
+            long long n = end - done < GEN_CHUNK ? end - done : GEN_CHUNK;
+            if (pwrite(fd, chunk, n, done) != n) {
+                perror("[ERROR] write (source) failed");
+                free(chunk);
+                close(fd);
+                return -1;
+            }
+            done += n;
+        }
+    }
+    free(chunk);
+    close(fd);
+    return 0;
+}
+
+// 1 if both files have identical contents.
+int files_equal(const char *a, const char *b) {
+    int fa = open(a, O_RDONLY);
+    int fb = open(b, O_RDONLY);
+    int equal = fa >= 0 && fb >= 0;
+    char *ba = malloc(CMP_CHUNK);
+    char *bb = malloc(CMP_CHUNK);
+    while (equal && ba && bb) {
+        ssize_t na = read(fa, ba, CMP_CHUNK);
+        ssize_t nb = read(fb, bb, CMP_CHUNK);
+        if (na != nb || na < 0 || memcmp(ba, bb, na) != 0) equal = 0;
+        if (na <= 0) break;
+    }
+    free(ba);
+    free(bb);
+    if (fa >= 0) close(fa);
+    if (fb >= 0) close(fb);
+    return equal && ba && bb;
+}
+
+// Fork and exec argv in dir with stdout/stderr sent to out_fd (or /dev/null when -1).
+pid_t spawn(const char *dir, char *const argv[], int out_fd) {
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+    if (chdir(dir) < 0) _exit(127);
+    int fd = out_fd >= 0 ? out_fd : open("/dev/null", O_WRONLY);
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    int null_in = open("/dev/null", O_RDONLY);
+    dup2(null_in, STDIN_FILENO);
+    execv(argv[0], argv);
+    _exit(127);
+}
+
+// Stop a helper process and collect its resource usage. A pid that never started (<= 0) is left alone,
+// kill() would signal a whole process group or every process we own.
+void stop_child(pid_t pid, int sig, struct rusage *ru) {
+    int status;
+    memset(ru, 0, sizeof(*ru));
+    if (pid <= 0) return;
+    kill(pid, sig);
+    wait4(pid, &status, 0, ru);
+}
+
+// One transfer of name (already in <workdir>/src) with the given loss, RTT and fragment size.
+void run_once(const struct bench_config *cfg, const char *name, double loss, double rtt_ms, int frag,
+              int run_index, struct run_result *res) {
+    char src_dir[LINE_LEN], dst_dir[LINE_LEN], src_path[2 * LINE_LEN], dst_path[2 * LINE_LEN];
+    char server_bin[LINE_LEN], deliver_bin[LINE_LEN], relay_bin[LINE_LEN];
+    char port_s[16], relay_port_s[16], frag_s[16], fwd[128], rev[128];
+    memset(res, 0, sizeof(*res));
+
+    snprintf(src_dir, sizeof(src_dir), "%s/src", cfg->workdir);
+    snprintf(dst_dir, sizeof(dst_dir), "%s/dst", cfg->workdir);
+    snprintf(src_path, sizeof(src_path), "%s/%s", src_dir, name);
+    snprintf(dst_path, sizeof(dst_path), "%s/%s", dst_dir, name);
+    snprintf(server_bin, sizeof(server_bin), "%s/server", cfg->bindir);
+    snprintf(deliver_bin, sizeof(deliver_bin), "%s/deliver", cfg->bindir);
+    snprintf(relay_bin, sizeof(relay_bin), "%s/relay", cfg->bindir);
+    snprintf(port_s, sizeof(port_s), "%d", cfg->port);
+    snprintf(relay_port_s, sizeof(relay_port_s), "%d", cfg->port + 1);
+    snprintf(frag_s, sizeof(frag_s), "%d", frag);
+    unlink(dst_path);
+
+    char *server_argv[MAX_ARGS + 4];
+    int n = 0;
+    server_argv[n++] = server_bin;
+    for (int i = 0; i < cfg->n_server_args; i++) server_argv[n++] = cfg->server_args[i];
+    server_argv[n++] = port_s;
+    server_argv[n] = NULL;
+    pid_t server = spawn(dst_dir, server_argv, -1);
+    if (server < 0) {
+        perror("[ERROR] starting the server failed");
+        return;
+    }
+
+    pid_t relay = -1;
+    int via_relay = loss > 0 || rtt_ms > 0;
+    if (via_relay) {
+        snprintf(fwd, sizeof(fwd), "loss=%g,delay=%g,seed=%d", loss, rtt_ms / 2, run_index + 1);
+        snprintf(rev, sizeof(rev), "delay=%g,seed=%d", rtt_ms / 2, run_index + 1);
+        char *relay_argv[] = { relay_bin, "-f", fwd, "-r", rev, relay_port_s, "127.0.0.1", port_s, NULL };
+        relay = spawn(".", relay_argv, -1);
+    }
+    struct rusage ru;
+    if (via_relay && relay < 0) {
+        perror("[ERROR] starting the relay failed");
+        stop_child(server, SIGTERM, &ru);
+        return;
+    }
+    usleep(STARTUP_US);
+
+    char *deliver_argv[MAX_ARGS + 10];
+    n = 0;
+    deliver_argv[n++] = deliver_bin;
+    if (frag > 0) {
+        deliver_argv[n++] = "-s";
+        deliver_argv[n++] = frag_s;
+    }
+    for (int i = 0; i < cfg->n_deliver_args; i++) deliver_argv[n++] = cfg->deliver_args[i];
+    deliver_argv[n++] = "-f";
+    deliver_argv[n++] = (char *)name;
+    deliver_argv[n++] = "127.0.0.1";
+    deliver_argv[n++] = via_relay ? relay_port_s : port_s;
+    deliver_argv[n] = NULL;
+
+    int pipefd[2];
+    if (pipe(pipefd) < 0) {
+        perror("[ERROR] pipe failed");
+        stop_child(relay, SIGINT, &ru);
+        stop_child(server, SIGTERM, &ru);
+        return;
+    }
+    long long start = current_timestamp_us();
+    pid_t deliver = spawn(src_dir, deliver_argv, pipefd[1]);
+    close(pipefd[1]);
+    if (deliver < 0) {
+        perror("[ERROR] starting deliver failed");
+        close(pipefd[0]);
+        stop_child(relay, SIGINT, &ru);
+        stop_child(server, SIGTERM, &ru);
+        return;
+    }
+
+    // Read deliver's report until it exits or the run times out.
+    char out[64 * 1024];
+    int out_len = 0;
+    long long deadline = start + (long long)cfg->timeout_s * 1000000;
+    int timed_out = 0;
+    while (1) {
+        long long left_ms = (deadline - current_timestamp_us()) / 1000;
+        if (left_ms <= 0) {
+            timed_out = 1;
+            break;
+        }
+        struct pollfd pfd = { pipefd[0], POLLIN, 0 };
+        if (poll(&pfd, 1, left_ms > 1000 ? 1000 : (int)left_ms) <= 0) continue;
+        char chunk[4096];
+        ssize_t got = read(pipefd[0], chunk, sizeof(chunk));
+        if (got <= 0) break;
+        // Keep the head (the line with total_frag) and the tail (the final report).
+        if (out_len + got > (int)sizeof(out) - 1) {
+            int keep = sizeof(out) / 2;
+            memmove(out + keep, out + out_len - (sizeof(out) / 4), sizeof(out) / 4);
+            out_len = keep + sizeof(out) / 4;
+        }
+        memcpy(out + out_len, chunk, got);
+        out_len += got;
+    }
+    close(pipefd[0]);
+
+    int status = 0;
+    if (timed_out) kill(deliver, SIGKILL);
+    memset(&ru, 0, sizeof(ru));
+    wait4(deliver, &status, 0, &ru);
+    res->elapsed_s = (current_timestamp_us() - start) / 1e6;
+    res->sender_cpu_s = cpu_seconds(&ru);
+
+    stop_child(relay, SIGINT, &ru);
+    // The server drains its write queues before exiting on SIGTERM.
+    stop_child(server, SIGTERM, &ru);
+    res->receiver_cpu_s = cpu_seconds(&ru);
+
+    out[out_len] = '\0';
+    char *p = strstr(out, "total_frag = ");
+    if (p) res->total_frag = strtoull(p + strlen("total_frag = "), NULL, 10);
+    p = strstr(out, "Retransmissions: ");
+    if (p) res->retransmits = strtoull(p + strlen("Retransmissions: "), NULL, 10);
+
+    res->ok = !timed_out && WIFEXITED(status) && WEXITSTATUS(status) == 0 && files_equal(src_path, dst_path);
+    unlink(dst_path);
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Nearest-rank percentile of a sorted array.
+double percentile(const double *sorted, int n, double pct) {
+    if (n == 0) return 0;
+    int rank = (int)(pct / 100.0 * n + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > n) rank = n;
+    return sorted[rank - 1];
+}
+
+void report_cell(const struct bench_config *cfg, int *first, long long size, double loss, double rtt_ms,
+                 int frag, const struct run_result *runs, int n) {
+    double completion[MAX_RUNS], goodput[MAX_RUNS];
+    int ok = 0;
+    double sender_cpu = 0, receiver_cpu = 0, goodput_sum = 0;
+    unsigned long long frags = 0, retrans = 0;
+    for (int i = 0; i < n; i++) {
+        if (!runs[i].ok) continue;
+        completion[ok] = runs[i].elapsed_s * 1000;
+        goodput[ok] = size * 8 / runs[i].elapsed_s / 1e6;
+        goodput_sum += goodput[ok];
+        sender_cpu += runs[i].sender_cpu_s;
+        receiver_cpu += runs[i].receiver_cpu_s;
+        frags += runs[i].total_frag;
+        retrans += runs[i].retransmits;
+        ok++;
+    }
+    qsort(completion, ok, sizeof(double), compare_double);
+    qsort(goodput, ok, sizeof(double), compare_double);
+    double gb = (double)size * ok / 1e9;
+    double retrans_ratio = frags ? (double)retrans / frags : 0;
+    double sender_per_gb = gb > 0 ? sender_cpu / gb : 0;
+    double receiver_per_gb = gb > 0 ? receiver_cpu / gb : 0;
+    double goodput_p50 = percentile(goodput, ok, 50);
+    double goodput_mean = ok ? goodput_sum / ok : 0;
+
+    if (cfg->json) {
+        printf("%s\n  {\"size_bytes\": %lld, \"loss\": %g, \"rtt_ms\": %g, \"frag_size\": %d, \"runs\": %d, "
+               "\"failures\": %d, \"goodput_mbps_p50\": %.3f, \"goodput_mbps_mean\": %.3f, "
+               "\"retrans_ratio\": %.6f, \"sender_cpu_s_per_gb\": %.4f, \"receiver_cpu_s_per_gb\": %.4f, "
+               "\"completion_ms_p50\": %.3f, \"completion_ms_p90\": %.3f, \"completion_ms_p99\": %.3f}",
+               *first ? "" : ",", size, loss, rtt_ms, frag, n, n - ok, goodput_p50, goodput_mean,
+               retrans_ratio, sender_per_gb, receiver_per_gb, percentile(completion, ok, 50),
+               percentile(completion, ok, 90), percentile(completion, ok, 99));
+    } else {
+        printf("%lld,%g,%g,%d,%d,%d,%.3f,%.3f,%.6f,%.4f,%.4f,%.3f,%.3f,%.3f\n",
+               size, loss, rtt_ms, frag, n, n - ok, goodput_p50, goodput_mean, retrans_ratio,
+               sender_per_gb, receiver_per_gb, percentile(completion, ok, 50),
+               percentile(completion, ok, 90), percentile(completion, ok, 99));
+    }
+    *first = 0;
+    fflush(stdout);
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-S sizes] [-L losses] [-R rtts_ms] [-F frag_sizes] [-n repeats] [-s extents] [-j] "
+            "[-p port] [-T timeout_s] [-d workdir] [-B bindir] [-a deliver_args] [-A server_args]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    static struct bench_config cfg;
+    char sizes[LINE_LEN] = "1K,1M,100M";
+    char losses[LINE_LEN] = "0,0.01";
+    char rtts[LINE_LEN] = "0,20";
+    char frags[LINE_LEN] = "1400";
+    static char deliver_args[LINE_LEN], server_args[LINE_LEN];
+    cfg.repeats = 3;
+    cfg.port = 40100;
+    cfg.timeout_s = DEFAULT_TIMEOUT;
+    cfg.workdir = "bench_work";
+    cfg.bindir = ".";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "S:L:R:F:n:s:jp:T:d:B:a:A:")) != -1) {
+        switch (opt) {
+        case 'S': snprintf(sizes, sizeof(sizes), "%s", optarg); break;
+        case 'L': snprintf(losses, sizeof(losses), "%s", optarg); break;
+        case 'R': snprintf(rtts, sizeof(rtts), "%s", optarg); break;
+        case 'F': snprintf(frags, sizeof(frags), "%s", optarg); break;
+        case 'n': cfg.repeats = atoi(optarg); break;
+        case 's': cfg.extents = atoi(optarg); break;
+        case 'j': cfg.json = 1; break;
+        case 'p': cfg.port = atoi(optarg); break;
+        case 'T': cfg.timeout_s = atoi(optarg); break;
+        case 'd': cfg.workdir = optarg; break;
+        case 'B': cfg.bindir = optarg; break;
+        case 'a': snprintf(deliver_args, sizeof(deliver_args), "%s", optarg); break;
+        case 'A': snprintf(server_args, sizeof(server_args), "%s", optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (cfg.repeats < 1) cfg.repeats = 1;
+    if (cfg.repeats > MAX_RUNS) cfg.repeats = MAX_RUNS;
+
+    if (strcmp(sizes, "large") == 0) snprintf(sizes, sizeof(sizes), "%s", LARGE_SIZES);
+    char *items[MAX_LIST];
+    int n = split_list(sizes, items);
+    for (int i = 0; i < n; i++) cfg.sizes[cfg.n_sizes++] = parse_size(items[i]);
+    n = split_list(losses, items);
+    for (int i = 0; i < n; i++) cfg.losses[cfg.n_losses++] = atof(items[i]);
+    n = split_list(rtts, items);
+    for (int i = 0; i < n; i++) cfg.rtts_ms[cfg.n_rtts++] = atof(items[i]);
+    n = split_list(frags, items);
+    for (int i = 0; i < n; i++) cfg.frags[cfg.n_frags++] = atoi(items[i]);
+    if (cfg.n_sizes <= 0 || cfg.n_losses <= 0 || cfg.n_rtts <= 0 || cfg.n_frags <= 0) {
+        fprintf(stderr, "[ERROR] Empty or oversized list (at most %d items each).\n", MAX_LIST);
+        return 1;
+    }
+    cfg.n_deliver_args = split_args(deliver_args, cfg.deliver_args);
+    cfg.n_server_args = split_args(server_args, cfg.server_args);
+
+    // Helpers must see absolute paths since they run in other directories.
+    static char bindir_abs[LINE_LEN], workdir_abs[LINE_LEN];
+    if (!realpath(cfg.bindir, bindir_abs)) {
+        perror("[ERROR] Binary directory");
+        return 1;
+    }
+    cfg.bindir = bindir_abs;
+    char path[LINE_LEN + 8];
+    mkdir(cfg.workdir, 0755);
+    if (!realpath(cfg.workdir, workdir_abs)) {
+        perror("[ERROR] Work directory");
+        return 1;
+    }
+    cfg.workdir = workdir_abs;
+    snprintf(path, sizeof(path), "%s/src", cfg.workdir);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/dst", cfg.workdir);
+    mkdir(path, 0755);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (cfg.json) printf("[");
+    else printf("size_bytes,loss,rtt_ms,frag_size,runs,failures,goodput_mbps_p50,goodput_mbps_mean,"
+                "retrans_ratio,sender_cpu_s_per_gb,receiver_cpu_s_per_gb,"
+                "completion_ms_p50,completion_ms_p90,completion_ms_p99\n");
+
+    static struct run_result runs[MAX_RUNS];
+    int first = 1;
+    for (int si = 0; si < cfg.n_sizes; si++) {
+        char name[64];
+        if (cfg.extents > 0) snprintf(name, sizeof(name), "bench_%lld_s%d.bin", cfg.sizes[si], cfg.extents);
+        else snprintf(name, sizeof(name), "bench_%lld.bin", cfg.sizes[si]);
+        snprintf(path, sizeof(path), "%s/src/%s", cfg.workdir, name);
+        if (make_source(path, cfg.sizes[si], cfg.extents) < 0) return 1;
+
+        for (int li = 0; li < cfg.n_losses; li++)
+        for (int ri = 0; ri < cfg.n_rtts; ri++)
+        for (int fi = 0; fi < cfg.n_frags; fi++) {
+            for (int r = 0; r < cfg.repeats; r++) {
+                run_once(&cfg, name, cfg.losses[li], cfg.rtts_ms[ri], cfg.frags[fi], r, &runs[r]);
+                fprintf(stderr, "[DEBUG] size %lld loss %g rtt %g frag %d run %d: %s, %.3f s\n",
+                        cfg.sizes[si], cfg.losses[li], cfg.rtts_ms[ri], cfg.frags[fi], r + 1,
+                        runs[r].ok ? "ok" : "FAILED", runs[r].elapsed_s);
+            }
+            report_cell(&cfg, &first, cfg.sizes[si], cfg.losses[li], cfg.rtts_ms[ri], cfg.frags[fi],
+                        runs, cfg.repeats);
+        }
+    }
+    if (cfg.json) printf("\n]\n");
+    return 0;
+}
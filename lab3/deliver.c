@@ -2,18 +2,76 @@
 /*
 Functionality:
 Sends a file to the server over UDP.
-Splits the file into fragments (max 1000 bytes per fragment).
-Initiates a handshake by sending "ftp" and expects "yes" to proceed.
-Implements timeout handling and retransmission using select().
-Supports configurable maximum retry attempts (MAX_RETRIES) with a placeholder for infinite retry toggle (if (0)).
+Splits the file into fragments whose size is negotiated at handshake: by default the largest datagram that
+crosses the path is found by DPLPMTUD-style probing (padded PROBE packets with DF set, up to ~64KB),
+or -s fixes the fragment size. The server may clamp it in SETUP_ACK.
+Initiates a handshake by sending a SETUP packet (file name, size, fragment size) and expects SETUP_ACK to proceed;
+the SETUP is retried on timeout and a SETUP_ACK carrying FLAG_REJECT ends the run.
+Implements a selective-repeat sliding window: up to <window> fragments are in flight at once,
+each with its own retransmission timer, and ACKs are accepted in any order.
+Fragments are retransmitted until they are acknowledged; only SETUP and FIN have a retry limit (SETUP_RETRIES).
 
 Highlights:
-Custom packet format: <total_frag>:<frag_no>:<size>:<filename>: + binary file data.
-Measures RTT using gettimeofday().
+Binary packet format: fixed 24-byte struct pkt_header (version, type, flags, transfer ID, 64-bit offset, length)
+followed by the payload; the filename travels only once, in the SETUP body.
+Measures RTT using gettimeofday(); the handshake RTT seeds an SRTT/RTTVAR estimator (RFC 6298)
+that is refined from ACK samples (Karn's rule) and backs off exponentially on timeout.
 Designed for extensibility with clearly marked sections for timeout strategy adjustment.
+The file name is read from an interactive "ftp <filename>" prompt, or given with -f for scripted runs.
+Window size is set with -w (default DEFAULT_WINDOW, capped at MAX_WINDOW); -v prints per-fragment debug.
+Pluggable congestion control (-c reno|cubic|bbr) through a table of on_ack/on_loss/on_timeout/pacing
+hooks; the effective window is min(cwnd, -w) and new fragments are paced at the controller's rate.
+A fragment is declared lost once DUP_THRESH later transmissions are ACKed, and resent without waiting for the RTO.
+Zero-copy send path: the file is mmap()ed and each fragment goes out through sendmsg() as an iovec
+pair (header + pointer into the mapping); -z adds MSG_ZEROCOPY for payloads of ZEROCOPY_MIN bytes or more, and a
+slot's header is not rewritten until the kernel reports that send complete.
+Datagrams move in batches: fragments go out with sendmmsg() and ACKs are drained with recvmmsg(), -b sets the depth.
+-g turns on UDP GSO: runs of full-size fragments leave as one super-buffer that the kernel segments (UDP_SEGMENT).
+Forward error correction (-e xor:K or -e rs:K:M): after every K data fragments the sender emits parity fragments
+(one XOR parity, or M Reed-Solomon parities over GF(2^8) from a Cauchy matrix) and the server rebuilds up to that
+many lost fragments of the group locally. While a group's parity is outstanding its fragments are not declared
+lost, so light loss costs no retransmission round trip. GF multiply-add runs on AVX2/SSSE3 or NEON when present.
+Parity counts against the congestion window until the group's last fragment is ACKed, and a group with fragments
+skipped (resumed, copied or holes) gets none, since the server could not rebuild it.
+Resumable transfers: SETUP carries a file identity (size, inode, mtime and the first and last FILE_ID_SAMPLE bytes
+hashed with FNV-1a), under which the server journals what it has on disk. If SETUP_ACK comes back with FLAG_RESUME
+the sender pulls the server's received bitmap with pipelined BITMAP requests and skips the fragments it already
+holds, so a restart after either side died only costs the part that is still missing.
+-d sends a delta against the copy of the file the server already has: the sender fetches its block signature,
+finds matching blocks at any byte offset with a rolling checksum confirmed by a strong hash, sends them as COPY
+records and then only the fragments that are not wholly inside a copied stretch, so the bytes on the wire scale
+with the change rather than with the file.
+Integrity: every DATA fragment carries a CRC32C of its header and payload (SSE4.2 or ARMv8 CRC instructions when
+present), so the server drops damaged ones and they are resent like lost ones. A helper thread hashes the whole
+file (MurmurHash3 x64_128) while it is being sent; once everything is ACKed FIN hands that digest to the server,
+which compares it with the output it read back, and the run only succeeds if they match.
+-C offers per-fragment LZ4 compression (block format, hash-table matcher with skip acceleration). A fragment is
+first sampled for byte entropy and sent raw if it looks incompressible; one that still saves under 1/MIN_SAVING is
+sent raw too, and each such miss doubles how many fragments are skipped before trying again. Compressed fragments
+carry FLAG_LZ and keep their file offset, so windows, ACKs, pacing and FEC all still count file bytes.
+-P N splits the file into N contiguous ranges of whole fragments, each sent by its own thread from its own socket
+(so its own source port, RSS queue and server shard) under the same transfer ID. Every stream is a complete
+transfer of its range (SETUP with FLAG_RANGE, window, congestion control, FEC, digest and FIN), and the server
+writes them all into the one output file. Ranges are not journaled, and -d always sends a single stream.
+Many files in one session: naming a directory (or listing paths, files or directories, in a -M manifest and naming
+the destination) sends them as a single bundle over one handshake. The bundle is laid out in memory as a manifest
+(path, mode, size and offset of every entry) followed by the files, read in back to back so that small ones
+share fragments, and then goes out like any one file; the server unpacks it once its digest is verified.
+-f can be repeated to multiplex several files over one socket and one congestion controller. Each file is a flow:
+a transfer of its own at the server (consecutive transfer IDs) with its own window, loss recovery, FEC groups,
+digest and FIN, so a loss in one never stalls another and each completes as soon as its own fragments are in.
+-S picks which flow the next new fragment comes from: rr (in turn, the default), shortest (fewest bytes left, so
+small files are not stuck behind bulk ones) or weighted:W1,W2,... (bytes shared in proportion, in -f order).
+Sizes, offsets and fragment counts are 64-bit throughout (with _FILE_OFFSET_BITS=64 on 32-bit builds), so a
+file may exceed 2^32 fragments. Holes of a sparse file (SEEK_HOLE/SEEK_DATA, at least a fragment long) are not
+sent: SETUP carries FLAG_SPARSE and the holes follow as COPY records with no basis, which the server zero-fills.
 Robust but minimalistic logic focusing on core file transfer functionality.
+Build: gcc deliver.c -o deliver -lm -pthread
 */
 
+#define _GNU_SOURCE     // sendmmsg/recvmmsg
+#define _FILE_OFFSET_BITS 64    // Files past 2GB on 32-bit builds too
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,192 +79,2959 @@ Robust but minimalistic logic focusing on core file transfer functionality.
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <linux/errqueue.h>
+#include <netinet/udp.h>
+#include <stdint.h>
+#include <endian.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <dirent.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
 
 #define BUFFER_SIZE     1024
-#define MAX_PACKET_LEN  1100
+#define MAX_NAME_LEN    1024
+#define MAX_PACKET_LEN  2048
+#define FRAG_SIZE       1000     // Fallback fragment size when probing finds nothing better
+#define MAX_DATAGRAM    65507    // Largest UDP payload
+#define MAX_FRAG_SIZE   (MAX_DATAGRAM - HEADER_LEN)
+#define PROBE_TIMEOUT_US 300000
+#define PROBE_ROUNDS    2
+#define SOCKET_BUF_BYTES (8 * 1024 * 1024)
+#define ZEROCOPY_MIN    8192     // MSG_ZEROCOPY only pays off for large payloads
+#define DEFAULT_BATCH   32
+#define MAX_BATCH       256
+#define ACK_BUF_LEN     64       // Room for one pkt_header
+#define GSO_MAX_SEGS    64       // Kernel limit on segments per GSO datagram
+#define GSO_MAX_BYTES   MAX_DATAGRAM
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY     60
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT     103
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY    0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+
+#define DEFAULT_WINDOW  64
+#define MAX_WINDOW      4096
+#define MAX_STREAMS     64
+#define MAX_FLOWS       64       // Files multiplexed over one stream
+
+#define PROTO_VERSION   1
+
+#define PKT_SETUP       1
+#define PKT_SETUP_ACK   2
+#define PKT_DATA        3
+#define PKT_ACK         4
+#define PKT_PROBE       5
+#define PKT_PROBE_ACK   6
+
+#define PKT_PARITY      7        // FEC parity of the group starting at offset; reserved = parity index
+#define PKT_BITMAP      8        // Received bitmap bytes from offset; reserved = bytes wanted in the request
+#define PKT_SIGNATURE   9        // Delta signature bytes from offset, requested like BITMAP
+#define PKT_COPY        10       // Delta copy records numbered from offset; ACKed with an empty COPY
+#define PKT_FIN         11       // Sender's whole-file digest, 16 bytes, once every fragment is ACKed
+#define PKT_FIN_ACK     12       // Verdict on FIN: FLAG_REJECT for a mismatch, FLAG_PENDING while still hashing
+
+#define FLAG_REJECT     0x0001
+#define FLAG_FEC_RS     0x0002   // SETUP, PARITY: Reed-Solomon rather than XOR parity
+#define FLAG_FEC_REBUILT 0x0004  // ACK: the server rebuilt this fragment from parity
+#define FLAG_RESUME     0x0008   // SETUP_ACK: part of the file is already on disk, fetch the bitmap
+#define FLAG_DELTA      0x0010   // SETUP: diff against the server's copy; SETUP_ACK: its signature is ready
+#define FLAG_CRC        0x0020   // DATA: reserved holds the fragment's CRC32C
+#define FLAG_PENDING    0x0040   // FIN_ACK: the output is still being read back and hashed, ask again;
+                                 // SETUP_ACK: the delta signature is still being built
+#define FLAG_LZ         0x0080   // SETUP, SETUP_ACK: LZ4 fragments offered/accepted; DATA: payload is one LZ4 block
+#define FLAG_RANGE      0x0100   // SETUP: one stream of a parallel transfer, sending only range_length bytes
+#define FLAG_BUNDLE     0x0200   // SETUP: the file is a bundle of many, unpack it into a directory of this name
+#define FLAG_SPARSE     0x0400   // SETUP: the file has holes, sent as COPY_HOLE records, so it is not preallocated
+
+// Fixed-size header at the start of every datagram. All fields are big-endian on the wire.
+struct pkt_header {
+    uint8_t  version;
+    uint8_t  type;
+    uint16_t flags;
+    uint32_t transfer_id;
+    uint64_t offset;             // Byte offset of the payload within the file
+    uint32_t length;             // Payload bytes following the header
+    uint32_t reserved;
+};
+
+// Body of a SETUP packet; the filename (name_len bytes, no NUL) follows it.
+struct setup_body {
+    uint64_t file_size;
+    uint32_t frag_size;
+    uint16_t name_len;
+    uint16_t fec;                // FEC group size K << 8 | parity count M, 0 for none
+    uint64_t file_id;            // Identity of the sender's file for resuming, 0 for no journal
+    uint64_t range_offset;       // With FLAG_RANGE: the part of the file this stream sends, offsets are relative
+    uint64_t range_length;
+};
+
+// Start of a bundle: a manifest of entries records, each followed by its path, then the files' bytes.
+struct bundle_header {
+    char magic[8];
+    uint32_t entries;
+    uint32_t manifest_len;       // Bytes of entry records and paths after this header
+};
+
+// One file or directory of a bundle; path_len bytes of relative path (no NUL) follow it.
+struct bundle_entry {
+    uint64_t offset;             // Where the file's bytes start in the bundle
+    uint64_t size;
+    uint32_t mode;               // st_mode: S_IFREG or S_IFDIR and permission bits
+    uint16_t path_len;
+    uint16_t reserved;
+};
+
+// Body of SETUP_ACK: the fragment size the server accepted.
+struct setup_ack_body {
+    uint32_t frag_size;
+    uint32_t delta_block;        // Signature block size (with FLAG_DELTA)
+    uint64_t resumed;            // Fragments already on disk (with FLAG_RESUME)
+    uint64_t delta_blocks;       // Signature entries (with FLAG_DELTA)
+};
+
+#define HEADER_LEN      ((int)sizeof(struct pkt_header))
 
 /////////////////////////////////////////////
-#define MAX_RETRIES     300      // Max retry
+#define SETUP_RETRIES   8        // SETUP attempts before giving up on the server
+#define RTO_INITIAL_US  1000000  // RTO used before any RTT sample
+#define RTO_MIN_US      1000     // Lower clamp, keeps LAN recovery in milliseconds
+#define RTO_MAX_US      60000000 // Upper clamp for exponential backoff
+#define DUP_THRESH      3        // Later transmissions ACKed before a fragment counts as lost
+
+#define FEC_MAX_K       64
+#define FEC_MAX_M       16
+
+#define FILE_ID_SAMPLE  65536    // Bytes hashed from each end of the file into its identity
+#define TABLE_CHUNK     1024     // Bytes asked for per BITMAP/SIGNATURE request
+#define TABLE_BURST     64       // Table requests, or COPY packets, in flight per round trip
+#define SIG_ENTRY_LEN   20       // Weak checksum (4 bytes) and 128-bit strong hash per block
+#define MURMUR_C1       0x87C37B91114253D5ULL
+#define MURMUR_C2       0x4CF5AD432745937FULL
+#define COPY_RECORD_LEN 24       // New offset, old offset and length, 8 bytes each
+#define COPY_RECORDS    40       // Records per COPY packet
+#define COPY_HOLE       UINT64_MAX    // Source offset of a COPY record for a hole, which the server zeroes
+#define DELTA_MAX_BLOCKS (1 << 30)    // Largest signature compute_delta() indexes
+#define BUNDLE_MAGIC    "UDPBNDL1"
+#define BUNDLE_MAX_PATH 4096
+#define FIN_PENDING_US  2000     // Shortest wait before asking again after FLAG_PENDING
+#define CRC_LANE        4096     // Bytes per interleaved CRC32C stream
+#define LZ_HASH_BITS    12       // LZ4 match finder table of 4096 positions
+#define LZ_MFLIMIT      12       // LZ4 format: no match starts within the last 12 bytes...
+#define LZ_LAST_LITERALS 5       // ...and the last 5 are always literals
+#define LZ_SKIP_TRIGGER 6        // Misses before the match finder starts stepping further
+#define LZ_MIN_INPUT    256      // Smaller fragments always go raw
+#define LZ_SAMPLE_RUNS  64       // 8-byte runs sampled for the entropy estimate
+#define LZ_MAX_ENTROPY  7.0      // Bits per byte above which a fragment is sent raw untried
+#define LZ_MIN_SAVING   8        // Compress only if it saves at least 1/8
+#define LZ_MAX_BACKOFF  64       // Longest stretch sent raw after compression did not pay
 /////////////////////////////////////////////
 
-long long current_timestamp_ms() {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#define CC_INIT_CWND    10
+#define CC_MIN_CWND     2
+#define CUBIC_C         0.4
+#define CUBIC_BETA      0.7
+#define BBR_BW_ROUNDS   10
+#define BBR_MIN_RTT_WIN 10000000 // Min-RTT filter window (us)
+#define BBR_PROBE_RTT_US 200000
+#define BBR_HIGH_GAIN   2.885
+
+// Retransmission timeout estimator, all values in microseconds.
+struct rtt_estimator {
+    long long srtt_us;
+    long long rttvar_us;
+    long long rto_us;
+    int has_sample;
+};
+
+// Everything a congestion controller learns from one ACK.
+struct cc_ack {
+    long long now_us;
+    long long rtt_us;            // -1 for retransmitted fragments (Karn's rule)
+    long long srtt_us;
+    int acked_bytes;
+    unsigned int inflight;       // Fragments still unacknowledged after this ACK
+    long long delivered;         // Bytes delivered so far, including this ACK
+    long long prior_delivered;   // Bytes delivered when this fragment was sent
+    double delivery_rate;        // Bytes/s sample, 0 if unavailable
+};
+
+enum bbr_mode { BBR_STARTUP, BBR_DRAIN, BBR_PROBE_BW, BBR_PROBE_RTT };
+
+struct cc_state {
+    int mss;
+    double cwnd;                 // In fragments
+    double ssthresh;
+    long long srtt_us;
+
+    // CUBIC
+    double w_max;
+    double k;
+    double w_est;                // Reno-friendly estimate
+    long long epoch_start_us;
+
+    // BBR
+    enum bbr_mode mode;
+    double bw_round[BBR_BW_ROUNDS];
+    double btl_bw;               // Bytes/s
+    long long min_rtt_us;
+    long long min_rtt_stamp_us;
+    long long next_round_delivered;
+    unsigned long long round_count;
+    double full_bw;
+    int full_bw_count;
+    int full_bw_reached;
+    double pacing_gain;
+    double cwnd_gain;
+    int cycle_index;
+    long long cycle_stamp_us;
+    long long probe_rtt_done_us;
+};
+
+struct cc_ops {
+    const char *name;
+    void (*init)(struct cc_state *cc, int mss);
+    void (*on_ack)(struct cc_state *cc, const struct cc_ack *ack);
+    void (*on_loss)(struct cc_state *cc, long long now_us);
+    void (*on_timeout)(struct cc_state *cc, long long now_us);
+    double (*pacing_rate)(const struct cc_state *cc);     // Bytes/s, 0 for unpaced
+};
+
+// A stretch of the new file the server copies from its old version, or zeroes, instead of receiving it.
+struct copy_run {
+    uint64_t offset;             // In the new file
+    uint64_t src_offset;         // In the server's copy, COPY_HOLE for a hole
+    uint64_t length;
+};
+
+// One in-flight fragment. Slots live in a ring indexed by frag_no % window.
+struct frag_slot {
+    uint64_t frag_no;
+    int acked;
+    int attempts;
+    int lost;                    // Declared lost and awaiting fast retransmit
+    unsigned long long tx_seq;   // Transmission order, used for loss detection
+    int fec_pending;             // Group parity not sent yet, so not declared lost
+    unsigned long long fec_seq;  // tx_seq of the group's last parity
+    int parity_held;             // Parity sent behind this group-ending fragment, counted in flight until its ACK
+    long long delivered;         // cc delivered bytes when this copy was sent
+    long long delivered_us;
+    long long sent_us;
+    long long deadline_us;
+    struct pkt_header header;
+    const char *payload;         // Points into the mmap()ed file, never copied, or at zbuf
+    int payload_len;
+    char *zbuf;                  // This slot's compressed payload buffer with -C
+    int zc_busy;                 // Last sent with MSG_ZEROCOPY: the kernel may still read the header
+    uint32_t zc_id;              // Zerocopy notification id of that send
+};
+
+// GF(2^8) arithmetic (polynomial 0x11D) for Reed-Solomon parity.
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static void (*gf_mul_add_region)(uint8_t *dst, const uint8_t *src, uint8_t c, int len);
+
+uint8_t gf_mul(uint8_t a, uint8_t b) {
+    if (a == 0 || b == 0) return 0;
+    return gf_exp[gf_log[a] + gf_log[b]];
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <server IP> <server port>\n", argv[0]);
-        return 1;
+uint8_t gf_inv(uint8_t a) {
+    return gf_exp[255 - gf_log[a]];
+}
+
+// Cauchy coefficient of data fragment i in parity fragment j: 1 / (x_j + y_i) with x_j = FEC_MAX_K + j, y_i = i.
+// Any k rows of [identity; Cauchy] are invertible, so any k of the k + m fragments rebuild the group.
+uint8_t fec_coef(int j, int i) {
+    return gf_inv((uint8_t)((FEC_MAX_K + j) ^ i));
+}
+
+void xor_region(uint8_t *dst, const uint8_t *src, int len) {
+    int i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a ^= b;
+        memcpy(dst + i, &a, 8);
     }
+    for (; i < len; i++) dst[i] ^= src[i];
+}
 
-    const char *server_ip = argv[1];
-    int port = atoi(argv[2]);
+// Split-nibble product tables: c * x = lo[x & 15] ^ hi[x >> 4].
+void gf_nibble_tables(uint8_t c, uint8_t *lo, uint8_t *hi) {
+    for (int x = 0; x < 16; x++) {
+        lo[x] = gf_mul(c, x);
+        hi[x] = gf_mul(c, x << 4);
+    }
+}
 
-    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0) {
-        perror("[ERROR] socket creation failed");
-        return 1;
+// dst ^= c * src, one byte at a time.
+void gf_mul_add_scalar(uint8_t *dst, const uint8_t *src, uint8_t c, int len) {
+    uint8_t lo[16], hi[16];
+    gf_nibble_tables(c, lo, hi);
+    for (int i = 0; i < len; i++) dst[i] ^= lo[src[i] & 15] ^ hi[src[i] >> 4];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// 16 (SSSE3) or 32 (AVX2) bytes per step, the nibble tables looked up with pshufb.
+__attribute__((target("ssse3")))
+void gf_mul_add_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c, int len) {
+    uint8_t lo[16], hi[16];
+    gf_nibble_tables(c, lo, hi);
+    __m128i tlo = _mm_loadu_si128((const __m128i *)lo);
+    __m128i thi = _mm_loadu_si128((const __m128i *)hi);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    int i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i p = _mm_xor_si128(_mm_shuffle_epi8(tlo, _mm_and_si128(s, mask)),
+                                  _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, p));
     }
-    printf("[DEBUG] Socket created successfully. sockfd=%d\n", sockfd);
+    for (; i < len; i++) dst[i] ^= lo[src[i] & 15] ^ hi[src[i] >> 4];
+}
 
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
+__attribute__((target("avx2")))
+void gf_mul_add_avx2(uint8_t *dst, const uint8_t *src, uint8_t c, int len) {
+    uint8_t lo[16], hi[16];
+    gf_nibble_tables(c, lo, hi);
+    __m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+    __m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+    int i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i p = _mm256_xor_si256(_mm256_shuffle_epi8(tlo, _mm256_and_si256(s, mask)),
+                                     _mm256_shuffle_epi8(thi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, p));
+    }
+    for (; i < len; i++) dst[i] ^= lo[src[i] & 15] ^ hi[src[i] >> 4];
+}
+#elif defined(__aarch64__)
+void gf_mul_add_neon(uint8_t *dst, const uint8_t *src, uint8_t c, int len) {
+    uint8_t lo[16], hi[16];
+    gf_nibble_tables(c, lo, hi);
+    uint8x16_t tlo = vld1q_u8(lo), thi = vld1q_u8(hi), mask = vdupq_n_u8(0x0f);
+    int i = 0;
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t s = vld1q_u8(src + i);
+        uint8x16_t p = veorq_u8(vqtbl1q_u8(tlo, vandq_u8(s, mask)), vqtbl1q_u8(thi, vshrq_n_u8(s, 4)));
+        vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), p));
+    }
+    for (; i < len; i++) dst[i] ^= lo[src[i] & 15] ^ hi[src[i] >> 4];
+}
+#endif
 
-    if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0) {
-        perror("[ERROR] inet_pton failed");
-        close(sockfd);
-        return 1;
+// Build the log/exp tables and pick the widest multiply-add kernel this CPU runs.
+void gf_init() {
+    int x = 1;
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & 0x100) x ^= 0x11D;
     }
+    for (int i = 255; i < 512; i++) gf_exp[i] = gf_exp[i - 255];
 
-    printf("[DEBUG] Ready to send to server: %s:%d\n", server_ip, port);
+    gf_mul_add_region = gf_mul_add_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) gf_mul_add_region = gf_mul_add_avx2;
+    else if (__builtin_cpu_supports("ssse3")) gf_mul_add_region = gf_mul_add_ssse3;
+#elif defined(__aarch64__)
+    gf_mul_add_region = gf_mul_add_neon;
+#endif
+}
 
-    char buffer[BUFFER_SIZE];
-    printf("Enter a command (ftp <filename>): ");
-    if (!fgets(buffer, BUFFER_SIZE, stdin)) {
-        fprintf(stderr, "[ERROR] Reading user input failed\n");
-        close(sockfd);
-        return 1;
+// CRC32C (Castagnoli), the per-fragment checksum: SSE4.2 or ARMv8 CRC instructions when the CPU has them,
+// otherwise slicing-by-8 tables. The instructions have a few cycles of latency, so large buffers run as three
+// interleaved CRC_LANE streams whose results are joined with precomputed "append zeros" tables.
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_shift_table[2][4][256];   // Register after CRC_LANE, or 2 * CRC_LANE, zero bytes
+static uint32_t (*crc32c)(uint32_t crc, const void *data, size_t len);
+
+uint32_t crc32c_sw(uint32_t crc, const void *data, size_t len) {
+    const uint8_t *p = data;
+    crc = ~crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        v = le64toh(v) ^ crc;
+        crc = crc32c_table[7][v & 0xff] ^ crc32c_table[6][(v >> 8) & 0xff] ^
+              crc32c_table[5][(v >> 16) & 0xff] ^ crc32c_table[4][(v >> 24) & 0xff] ^
+              crc32c_table[3][(v >> 32) & 0xff] ^ crc32c_table[2][(v >> 40) & 0xff] ^
+              crc32c_table[1][(v >> 48) & 0xff] ^ crc32c_table[0][v >> 56];
     }
+    while (len--) crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
 
-    buffer[strcspn(buffer, "\n")] = '\0';
+// The CRC register after (which + 1) * CRC_LANE more zero bytes; linear, so four byte lookups.
+uint32_t crc32c_shift(int which, uint32_t crc) {
+    const uint32_t (*t)[256] = crc32c_shift_table[which];
+    return t[0][crc & 0xff] ^ t[1][(crc >> 8) & 0xff] ^ t[2][(crc >> 16) & 0xff] ^ t[3][crc >> 24];
+}
 
-    if (strncmp(buffer, "ftp ", 4) != 0) {
-        fprintf(stderr, "[ERROR] Invalid command. Must be 'ftp <filename>'.\n");
-        close(sockfd);
-        return 1;
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const void *data, size_t len) {
+    const uint8_t *p = data;
+    uint64_t c0 = ~crc;
+    for (; len >= 3 * CRC_LANE; p += 3 * CRC_LANE, len -= 3 * CRC_LANE) {
+        uint64_t c1 = 0, c2 = 0;
+        for (int i = 0; i < CRC_LANE; i += 8) {
+            uint64_t v0, v1, v2;
+            memcpy(&v0, p + i, 8);
+            memcpy(&v1, p + CRC_LANE + i, 8);
+            memcpy(&v2, p + 2 * CRC_LANE + i, 8);
+            c0 = _mm_crc32_u64(c0, v0);
+            c1 = _mm_crc32_u64(c1, v1);
+            c2 = _mm_crc32_u64(c2, v2);
+        }
+        c0 = crc32c_shift(1, c0) ^ crc32c_shift(0, c1) ^ c2;
+    }
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c0 = _mm_crc32_u64(c0, v);
+    }
+    while (len--) c0 = _mm_crc32_u8((uint32_t)c0, *p++);
+    return ~(uint32_t)c0;
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+uint32_t crc32c_armv8(uint32_t crc, const void *data, size_t len) {
+    const uint8_t *p = data;
+    uint32_t c0 = ~crc;
+    for (; len >= 3 * CRC_LANE; p += 3 * CRC_LANE, len -= 3 * CRC_LANE) {
+        uint32_t c1 = 0, c2 = 0;
+        for (int i = 0; i < CRC_LANE; i += 8) {
+            uint64_t v0, v1, v2;
+            memcpy(&v0, p + i, 8);
+            memcpy(&v1, p + CRC_LANE + i, 8);
+            memcpy(&v2, p + 2 * CRC_LANE + i, 8);
+            c0 = __crc32cd(c0, v0);
+            c1 = __crc32cd(c1, v1);
+            c2 = __crc32cd(c2, v2);
+        }
+        c0 = crc32c_shift(1, c0) ^ crc32c_shift(0, c1) ^ c2;
     }
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c0 = __crc32cd(c0, v);
+    }
+    while (len--) c0 = __crc32cb(c0, *p++);
+    return ~c0;
+}
+#endif
 
-    char file_name[BUFFER_SIZE];
-    strcpy(file_name, buffer + 4);
+void crc32c_init() {
+    for (int i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c >> 1) ^ (c & 1 ? 0x82F63B78 : 0);
+        crc32c_table[0][i] = c;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            crc32c_table[t][i] = (crc32c_table[t - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[t - 1][i] & 0xff];
+        }
+    }
+    // Shift tables from the 32 single-bit registers run through CRC_LANE and 2 * CRC_LANE zero bytes.
+    for (int w = 0; w < 2; w++) {
+        uint32_t bit[32];
+        for (int b = 0; b < 32; b++) {
+            uint32_t c = (uint32_t)1 << b;
+            for (int n = 0; n < (w + 1) * CRC_LANE; n++) c = crc32c_table[0][c & 0xff] ^ (c >> 8);
+            bit[b] = c;
+        }
+        for (int k = 0; k < 4; k++) {
+            for (int v = 0; v < 256; v++) {
+                uint32_t c = 0;
+                for (int j = 0; j < 8; j++) {
+                    if (v >> j & 1) c ^= bit[8 * k + j];
+                }
+                crc32c_shift_table[w][k][v] = c;
+            }
+        }
+    }
+    crc32c = crc32c_sw;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) crc32c = crc32c_sse42;
+#elif defined(__aarch64__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) crc32c = crc32c_armv8;
+#endif
+}
 
-    struct stat file_stat;
-    if (stat(file_name, &file_stat) != 0) {
-        fprintf(stderr, "[ERROR] File '%s' does not exist.\n", file_name);
-        close(sockfd);
-        return 1;
+long long current_timestamp_us() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+void rtt_update_rto(struct rtt_estimator *est) {
+    long long var4 = 4 * est->rttvar_us;
+    est->rto_us = est->srtt_us + (var4 > RTO_MIN_US ? var4 : RTO_MIN_US);
+    if (est->rto_us < RTO_MIN_US) est->rto_us = RTO_MIN_US;
+    if (est->rto_us > RTO_MAX_US) est->rto_us = RTO_MAX_US;
+}
+
+void rtt_init(struct rtt_estimator *est) {
+    memset(est, 0, sizeof(*est));
+    est->rto_us = RTO_INITIAL_US;
+}
+
+// Feed one RTT measurement. Callers must skip retransmitted fragments (Karn's rule).
+void rtt_sample(struct rtt_estimator *est, long long sample_us) {
+    if (sample_us < 1) sample_us = 1;
+    if (!est->has_sample) {
+        est->srtt_us = sample_us;
+        est->rttvar_us = sample_us / 2;
+        est->has_sample = 1;
+    } else {
+        long long err = est->srtt_us - sample_us;
+        if (err < 0) err = -err;
+        est->rttvar_us += (err - est->rttvar_us) / 4;      // beta = 1/4
+        est->srtt_us += (sample_us - est->srtt_us) / 8;    // alpha = 1/8
     }
-    printf("[DEBUG] File '%s' found, size=%ld bytes.\n", file_name, file_stat.st_size);
+    rtt_update_rto(est);
+}
 
-    strcpy(buffer, "ftp");
+void rtt_backoff(struct rtt_estimator *est) {
+    est->rto_us *= 2;
+    if (est->rto_us > RTO_MAX_US) est->rto_us = RTO_MAX_US;
+}
 
-    long long t_send = current_timestamp_ms();
-    socklen_t addr_len = sizeof(server_addr);
+void build_header(struct pkt_header *hdr, uint8_t type, uint16_t flags, uint32_t transfer_id,
+                  uint64_t offset, uint32_t length) {
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->version = PROTO_VERSION;
+    hdr->type = type;
+    hdr->flags = htons(flags);
+    hdr->transfer_id = htonl(transfer_id);
+    hdr->offset = htobe64(offset);
+    hdr->length = htonl(length);
+}
 
-    int sent = sendto(sockfd, buffer, strlen(buffer), 0,
-                      (struct sockaddr*)&server_addr, addr_len);
-    if (sent < 0) {
-        perror("[ERROR] sendto (handshake) failed");
-        close(sockfd);
-        return 1;
+// Validate and convert a received header to host byte order.
+int parse_header(const char *buf, int len, struct pkt_header *hdr) {
+    if (len < HEADER_LEN) return -1;
+    memcpy(hdr, buf, HEADER_LEN);
+    if (hdr->version != PROTO_VERSION) return -1;
+    hdr->flags = ntohs(hdr->flags);
+    hdr->transfer_id = ntohl(hdr->transfer_id);
+    hdr->offset = be64toh(hdr->offset);
+    hdr->length = ntohl(hdr->length);
+    return 0;
+}
+
+// Packetization-layer path MTU discovery (in the spirit of RFC 8899): send padded PROBE datagrams
+// of typical link sizes with DF set, all at once, and keep the largest one the server echoes.
+// Returns the fragment payload size to propose, or FRAG_SIZE if no probe got through.
+int probe_frag_size(int sockfd, const struct sockaddr_in *addr, uint32_t transfer_id) {
+    // Candidate UDP payloads: loopback, 16K, jumbo frames, FDDI, Ethernet, IPv6 minimum (minus IP/UDP headers).
+    static const int candidates[] = { MAX_DATAGRAM, 16384 - 28, 9000 - 28, 4352 - 28, 1500 - 28, 1280 - 48 };
+    static char probe[MAX_DATAGRAM];
+    int ncand = sizeof(candidates) / sizeof(candidates[0]);
+    int best = 0;
+
+    int pmtu = IP_PMTUDISC_PROBE;     // DF set, and never fragment locally
+    setsockopt(sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu, sizeof(pmtu));
+
+    for (int round = 0; round < PROBE_ROUNDS && best == 0; round++) {
+        for (int i = 0; i < ncand; i++) {
+            int payload = candidates[i] - HEADER_LEN;
+            build_header((struct pkt_header *)probe, PKT_PROBE, 0, transfer_id, 0, payload);
+            // EMSGSIZE just means the local interface is smaller than this candidate.
+            sendto(sockfd, probe, candidates[i], 0, (const struct sockaddr *)addr, sizeof(*addr));
+        }
+
+        long long deadline = current_timestamp_us() + PROBE_TIMEOUT_US;
+        long long now;
+        while (best < candidates[0] && (now = current_timestamp_us()) < deadline) {
+            fd_set fds;
+            FD_ZERO(&fds);
+            FD_SET(sockfd, &fds);
+            struct timeval tv;
+            tv.tv_sec = (deadline - now) / 1000000;
+            tv.tv_usec = (deadline - now) % 1000000;
+            if (select(sockfd + 1, &fds, NULL, NULL, &tv) <= 0) continue;
+
+            char buf[MAX_PACKET_LEN];
+            int n = recv(sockfd, buf, sizeof(buf), 0);
+            struct pkt_header hdr;
+            if (n < 0 || parse_header(buf, n, &hdr) < 0) continue;
+            if (hdr.type != PKT_PROBE_ACK || hdr.transfer_id != transfer_id) continue;
+            // The echoed size is in offset, since a PROBE_ACK carries no payload.
+            if ((int)hdr.offset > best) best = hdr.offset;
+        }
     }
-    printf("[DEBUG] Sent handshake 'ftp' to server.\n");
 
-    int n = recvfrom(sockfd, buffer, BUFFER_SIZE - 1, 0,
-                     (struct sockaddr*)&server_addr, &addr_len);
-    if (n < 0) {
-        perror("[ERROR] recvfrom (handshake) failed");
-        close(sockfd);
-        return 1;
+    pmtu = IP_PMTUDISC_DONT;          // Let the kernel fragment if the path shrinks later
+    setsockopt(sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu, sizeof(pmtu));
+    return best > 0 ? best - HEADER_LEN : FRAG_SIZE;
+}
+
+uint64_t fnv1a64(uint64_t h, const void *data, size_t len) {
+    const uint8_t *p = data;
+    for (size_t i = 0; i < len; i++) h = (h ^ p[i]) * 0x100000001B3ULL;
+    return h;
+}
+
+// Identity under which the server journals this file. Cheap even for huge files, yet a file rewritten
+// in place (new mtime or different ends) never resumes from fragments of its previous version.
+uint64_t file_identity(int fd, const struct stat *st) {
+    uint64_t h = 0xCBF29CE484222325ULL;
+    uint64_t meta[5] = { st->st_size, st->st_ino, st->st_dev, st->st_mtim.tv_sec, st->st_mtim.tv_nsec };
+    h = fnv1a64(h, meta, sizeof(meta));
+    static char sample[FILE_ID_SAMPLE];
+    off_t tail = st->st_size > FILE_ID_SAMPLE ? st->st_size - FILE_ID_SAMPLE : 0;
+    ssize_t n = pread(fd, sample, sizeof(sample), 0);
+    if (n > 0) h = fnv1a64(h, sample, n);
+    n = pread(fd, sample, sizeof(sample), tail);
+    if (n > 0) h = fnv1a64(h, sample, n);
+    return h ? h : 1;     // 0 means no journal
+}
+
+// Send SETUP until the server answers. Returns 1 if accepted, 0 if rejected, -1 on no answer.
+// *frag_size is replaced by the size the server accepted; *ack gets the rest of SETUP_ACK in host order,
+// with resumed and the delta fields zeroed unless their flags are set.
+// *rtt_us is only set when the first attempt was answered (Karn's rule), and never for a delta transfer, whose
+// server builds the signature before it accepts. A FLAG_PENDING answer means just that: SETUP is sent again
+// after a wait that starts at FIN_PENDING_US and doubles, without counting it as an attempt.
+int handshake(int sockfd, const struct sockaddr_in *addr, const char *setup, int setup_len,
+              uint32_t transfer_id, long long *rtt_us, int *frag_size, struct setup_ack_body *ack_out,
+              uint16_t *ack_flags) {
+    long long timeout_us = RTO_INITIAL_US;
+    int delta = ntohs(((const struct pkt_header *)setup)->flags) & FLAG_DELTA;
+    int pending = 0;
+    long long pending_us = FIN_PENDING_US;
+    *rtt_us = -1;
+    memset(ack_out, 0, sizeof(*ack_out));
+    *ack_flags = 0;
+    for (int attempt = 0; attempt < SETUP_RETRIES; attempt++) {
+        long long t_send = current_timestamp_us();
+        if (sendto(sockfd, setup, setup_len, 0, (const struct sockaddr *)addr, sizeof(*addr)) < 0) {
+            perror("[ERROR] sendto (handshake) failed");
+            return -1;
+        }
+        printf("[DEBUG] Sent SETUP to server (attempt %d).\n", attempt + 1);
+
+        long long deadline = t_send + timeout_us;
+        long long now;
+        while ((now = current_timestamp_us()) < deadline) {
+            fd_set fds;
+            FD_ZERO(&fds);
+            FD_SET(sockfd, &fds);
+            struct timeval tv;
+            tv.tv_sec = (deadline - now) / 1000000;
+            tv.tv_usec = (deadline - now) % 1000000;
+            if (select(sockfd + 1, &fds, NULL, NULL, &tv) <= 0) continue;
+
+            char buf[MAX_PACKET_LEN];
+            int n = recv(sockfd, buf, sizeof(buf), 0);
+            struct pkt_header hdr;
+            if (n < 0 || parse_header(buf, n, &hdr) < 0) continue;
+            if (hdr.type != PKT_SETUP_ACK || hdr.transfer_id != transfer_id) continue;
+            if (hdr.flags & FLAG_PENDING) {
+                if (!pending && now + pending_us < deadline) deadline = now + pending_us;
+                pending = 1;
+                continue;
+            }
+
+            if (attempt == 0 && !delta) *rtt_us = current_timestamp_us() - t_send;
+            if (hdr.flags & FLAG_REJECT) return 0;
+            *ack_flags = hdr.flags;
+            struct setup_ack_body ack;
+            if (hdr.length >= sizeof(ack) && n >= HEADER_LEN + (int)sizeof(ack)) {
+                memcpy(&ack, buf + HEADER_LEN, sizeof(ack));
+                uint32_t accepted = ntohl(ack.frag_size);
+                if (accepted > 0 && accepted < (uint32_t)*frag_size) *frag_size = accepted;
+                ack_out->frag_size = *frag_size;
+                if (hdr.flags & FLAG_RESUME) ack_out->resumed = be64toh(ack.resumed);
+                if (hdr.flags & FLAG_DELTA) {
+                    ack_out->delta_block = ntohl(ack.delta_block);
+                    ack_out->delta_blocks = be64toh(ack.delta_blocks);
+                }
+            }
+            return 1;
+        }
+        if (pending) {
+            pending = 0;
+            attempt--;
+            if (pending_us < timeout_us) pending_us *= 2;
+            continue;
+        }
+        timeout_us *= 2;
+    }
+    return -1;
+}
+
+// Fetch bytes bytes of one of the server's tables for this transfer (BITMAP or SIGNATURE), TABLE_BURST requests
+// of TABLE_CHUNK bytes per round trip. Returns them malloc()ed, or NULL if the server stops answering.
+uint8_t *fetch_table(int sockfd, const struct sockaddr_in *addr, uint32_t transfer_id, uint8_t type,
+                     uint64_t bytes, long long timeout_us) {
+    uint64_t chunks = (bytes + TABLE_CHUNK - 1) / TABLE_CHUNK;
+    uint8_t *table = calloc(bytes, 1);
+    uint8_t *got = calloc(chunks, 1);
+    if (!table || !got) {
+        free(table);
+        free(got);
+        return NULL;
     }
-    buffer[n] = '\0';
 
-    long long t_recv = current_timestamp_ms();
-    long long rtt = t_recv - t_send;
-    printf("[DEBUG] Server handshake response: '%s'\n", buffer);
-    printf("[DEBUG] RTT = %lld ms\n", rtt);
+    uint64_t have = 0;
+    int idle_rounds = 0;
+    while (have < chunks && idle_rounds < SETUP_RETRIES) {
+        uint64_t asked = 0, before = have;
+        for (uint64_t c = 0; c < chunks && asked < TABLE_BURST; c++) {
+            if (got[c]) continue;
+            struct pkt_header req;
+            build_header(&req, type, 0, transfer_id, c * TABLE_CHUNK, 0);
+            req.reserved = htonl(TABLE_CHUNK);
+            if (sendto(sockfd, &req, HEADER_LEN, 0, (const struct sockaddr *)addr, sizeof(*addr)) < 0) {
+                perror("[ERROR] sendto (table request) failed");
+            }
+            asked++;
+        }
 
-    if (strcmp(buffer, "yes") != 0) {
-        fprintf(stderr, "[DEBUG] Server did not respond 'yes'. Exiting.\n");
-        close(sockfd);
-        return 1;
+        long long deadline = current_timestamp_us() + timeout_us;
+        long long now;
+        while (have - before < asked && (now = current_timestamp_us()) < deadline) {
+            fd_set fds;
+            FD_ZERO(&fds);
+            FD_SET(sockfd, &fds);
+            struct timeval tv;
+            tv.tv_sec = (deadline - now) / 1000000;
+            tv.tv_usec = (deadline - now) % 1000000;
+            if (select(sockfd + 1, &fds, NULL, NULL, &tv) <= 0) continue;
+
+            char buf[MAX_PACKET_LEN];
+            int n = recv(sockfd, buf, sizeof(buf), 0);
+            struct pkt_header hdr;
+            if (n < 0 || parse_header(buf, n, &hdr) < 0) continue;
+            if (hdr.type != type || hdr.transfer_id != transfer_id) continue;
+            uint64_t c = hdr.offset / TABLE_CHUNK;
+            if (hdr.offset % TABLE_CHUNK != 0 || c >= chunks || got[c]) continue;
+            // Every chunk but the last is full, and the payload must be all there.
+            uint32_t len = bytes - hdr.offset < TABLE_CHUNK ? bytes - hdr.offset : TABLE_CHUNK;
+            if (hdr.length != len || n - HEADER_LEN != (int)len) continue;
+            memcpy(table + hdr.offset, buf + HEADER_LEN, len);
+            got[c] = 1;
+            have++;
+        }
+        if (have == before) {
+            idle_rounds++;
+            timeout_us *= 2;
+        } else {
+            idle_rounds = 0;
+        }
     }
-    printf("A file transfer can start.\n");
+    free(got);
+    if (have < chunks) {
+        free(table);
+        return NULL;
+    }
+    return table;
+}
 
-    FILE *fp = fopen(file_name, "rb");
-    if (!fp) {
-        perror("[ERROR] fopen failed");
-        close(sockfd);
-        return 1;
+uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xFF51AFD7ED558CCDULL;
+    k ^= k >> 33;
+    k *= 0xC4CEB9FE1A85EC53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+// MurmurHash3 x64_128 (seed 0), fed incrementally: the strong hash of delta signature blocks and the
+// whole-file digest. Any split of the input gives the same result as hashing it in one piece.
+struct murmur3 {
+    uint64_t h1, h2;
+    uint64_t len;
+    uint8_t tail[16];
+    int tail_len;
+};
+
+void murmur3_mix(uint64_t *h1, uint64_t *h2, const uint8_t *block, int last) {
+    uint64_t k[2];
+    memcpy(k, block, 16);
+    *h1 ^= rotl64(le64toh(k[0]) * MURMUR_C1, 31) * MURMUR_C2;
+    if (!last) *h1 = (rotl64(*h1, 27) + *h2) * 5 + 0x52DCE729;
+    *h2 ^= rotl64(le64toh(k[1]) * MURMUR_C2, 33) * MURMUR_C1;
+    if (!last) *h2 = (rotl64(*h2, 31) + *h1) * 5 + 0x38495AB5;
+}
+
+void murmur3_init(struct murmur3 *m) {
+    memset(m, 0, sizeof(*m));
+}
+
+void murmur3_update(struct murmur3 *m, const uint8_t *data, size_t len) {
+    m->len += len;
+    if (m->tail_len) {
+        size_t take = 16 - (size_t)m->tail_len;
+        if (take > len) take = len;
+        memcpy(m->tail + m->tail_len, data, take);
+        m->tail_len += take;
+        data += take;
+        len -= take;
+        if (m->tail_len < 16) return;
+        murmur3_mix(&m->h1, &m->h2, m->tail, 0);
+        m->tail_len = 0;
     }
+    for (; len >= 16; data += 16, len -= 16) murmur3_mix(&m->h1, &m->h2, data, 0);
+    memcpy(m->tail, data, len);
+    m->tail_len = len;
+}
+
+void murmur3_final(struct murmur3 *m, uint64_t out[2]) {
+    uint64_t h1 = m->h1, h2 = m->h2;
+    if (m->tail_len) {
+        // The reference tail switch is the same as mixing a zero-padded block without the rotations.
+        memset(m->tail + m->tail_len, 0, 16 - m->tail_len);
+        murmur3_mix(&h1, &h2, m->tail, 1);
+    }
+    h1 ^= m->len;
+    h2 ^= m->len;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    out[0] = h1;
+    out[1] = h2;
+}
 
-    long file_size = file_stat.st_size;
-    unsigned int total_frag = (file_size + 999) / 1000;
-    printf("[DEBUG] total_frag = %u\n", total_frag);
+void murmur3_128(const uint8_t *data, size_t len, uint64_t out[2]) {
+    struct murmur3 m;
+    murmur3_init(&m);
+    murmur3_update(&m, data, len);
+    murmur3_final(&m, out);
+}
 
-    for (unsigned int frag_no = 1; frag_no <= total_frag; frag_no++) {
-        char data_buf[1000];
-        int read_size = fread(data_buf, 1, 1000, fp);
+// rsync's rolling checksum: sums a and b of the bytes, 16 bits each.
+uint32_t weak_checksum(const uint8_t *data, uint32_t len) {
+    uint32_t a = 0, b = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        a += data[i];
+        b += (len - i) * data[i];
+    }
+    return (a & 0xffff) | b << 16;
+}
 
-        char header[256];
-        sprintf(header, "%u:%u:%u:%s:", total_frag, frag_no, read_size, file_name);
+// Match the new file against the server's signature, rsync style: roll the weak checksum along one byte at a
+// time, confirm hits with the strong hash and jump a whole block on a match. Matches that are contiguous in both
+// files merge into one run. Returns the number of runs stored in *runs (malloc()ed), -1 if out of memory or
+// the signature has more than DELTA_MAX_BLOCKS blocks.
+long compute_delta(const uint8_t *file, uint64_t size, const uint8_t *sig, uint64_t blocks, uint32_t block,
+                   struct copy_run **runs) {
+    *runs = NULL;
+    if (blocks > DELTA_MAX_BLOCKS) return -1;
+    // Chained hash table of the signature's weak checksums.
+    unsigned int buckets = 1;
+    while (buckets < 2 * blocks) buckets <<= 1;
+    int *head = malloc(buckets * sizeof(int));
+    int *next = malloc(blocks * sizeof(int));
+    uint32_t *weak_of = malloc(blocks * sizeof(uint32_t));
+    long count = 0, cap = 64;
+    *runs = malloc(cap * sizeof(struct copy_run));
+    if (!head || !next || !weak_of || !*runs) {
+        free(head);
+        free(next);
+        free(weak_of);
+        free(*runs);
+        return -1;
+    }
+    memset(head, -1, buckets * sizeof(int));
+    for (uint32_t i = 0; i < blocks; i++) {
+        uint32_t w;
+        memcpy(&w, sig + (size_t)i * SIG_ENTRY_LEN, 4);
+        weak_of[i] = ntohl(w);
+        unsigned int h = (weak_of[i] * 0x9E3779B1u) & (buckets - 1);
+        next[i] = head[h];
+        head[h] = i;
+    }
 
-        char send_buf[MAX_PACKET_LEN];
-        int header_len = strlen(header);
+    uint64_t p = 0;
+    uint32_t a = 0, b = 0;
+    int fresh = 1;
+    while (p + block <= size) {
+        if (fresh) {
+            uint32_t w = weak_checksum(file + p, block);
+            a = w & 0xffff;
+            b = w >> 16;
+            fresh = 0;
+        }
+        uint32_t weak = (a & 0xffff) | b << 16;
+        uint64_t strong[2];
+        int hashed = 0, match = -1;
+        // The block after the previous match comes first, so runs stay contiguous in the old file too.
+        long expect = count ? (long)(((*runs)[count - 1].src_offset + (*runs)[count - 1].length) / block) : -1;
+        unsigned int h = (weak * 0x9E3779B1u) & (buckets - 1);
+        for (int i = head[h]; i >= 0; i = next[i]) {
+            if (weak_of[i] != weak) continue;
+            if (!hashed) {
+                murmur3_128(file + p, block, strong);
+                hashed = 1;
+            }
+            uint64_t want[2];
+            memcpy(want, sig + (size_t)i * SIG_ENTRY_LEN + 4, 16);
+            if (be64toh(want[0]) != strong[0] || be64toh(want[1]) != strong[1]) continue;
+            if (match < 0 || i == expect) match = i;
+            if (i == expect) break;
+        }
+        if (match < 0) {
+            // Slide the window one byte: drop file[p], take in file[p + block].
+            if (p + block < size) {
+                a += file[p + block] - file[p];
+                b += a - block * file[p];
+            }
+            p++;
+            continue;
+        }
 
-        memcpy(send_buf, header, header_len);
-        memcpy(send_buf + header_len, data_buf, read_size);
+        uint64_t src = (uint64_t)match * block;
+        struct copy_run *last = count ? &(*runs)[count - 1] : NULL;
+        if (last && last->offset + last->length == p && last->src_offset + last->length == src) {
+            last->length += block;
+        } else {
+            if (count == cap) {
+                struct copy_run *grown = realloc(*runs, 2 * cap * sizeof(struct copy_run));
+                if (!grown) {
+                    count = -1;
+                    break;
+                }
+                *runs = grown;
+                cap *= 2;
+            }
+            (*runs)[count].offset = p;
+            (*runs)[count].src_offset = src;
+            (*runs)[count].length = block;
+            count++;
+        }
+        p += block;
+        fresh = 1;
+    }
+    free(head);
+    free(next);
+    free(weak_of);
+    if (count < 0) free(*runs);
+    return count;
+}
 
-        int packet_len = header_len + read_size;
+// Mark in skip (bit (n - 1) % 8 of byte (n - 1) / 8 for fragment n) every fragment lying wholly inside one
+// copy run; the server applies the same rule and never expects those as DATA. Returns how many were new.
+uint64_t mark_copied(uint8_t *skip, const struct copy_run *runs, long count, uint64_t file_size,
+                     int frag_size, uint64_t total_frag) {
+    uint64_t marked = 0;
+    for (long r = 0; r < count; r++) {
+        uint64_t end_of_run = runs[r].offset + runs[r].length;
+        for (uint64_t f = (runs[r].offset + frag_size - 1) / frag_size; f < total_frag; f++) {
+            uint64_t end = (f + 1) * frag_size < file_size ? (f + 1) * frag_size : file_size;
+            if (end > end_of_run) break;
+            if (!(skip[f / 8] >> (f % 8) & 1)) marked++;
+            skip[f / 8] |= 1 << (f % 8);
+        }
+    }
+    return marked;
+}
 
-//////////////////////////////////////////////////////////////////////////////////////////
-        int attempts = 0;
-        while (attempts < MAX_RETRIES) {
-            int bytes_sent = sendto(sockfd, send_buf, packet_len, 0,
-                                    (struct sockaddr*)&server_addr, addr_len);
-            if (bytes_sent < 0) {
-                perror("[ERROR] sendto (fragment) failed");
+// Send the copy runs as COPY packets of COPY_RECORDS records, TABLE_BURST packets per round trip, until the
+// server has ACKed them all. Returns -1 if it stops answering.
+int send_copies(int sockfd, const struct sockaddr_in *addr, uint32_t transfer_id, const struct copy_run *runs,
+                long count, long long timeout_us) {
+    uint64_t packets = (count + COPY_RECORDS - 1) / COPY_RECORDS;
+    uint8_t *acked = calloc(packets, 1);
+    if (!acked) return -1;
+    uint64_t have = 0;
+    int idle_rounds = 0;
+    while (have < packets && idle_rounds < SETUP_RETRIES) {
+        uint64_t sent = 0, before = have;
+        for (uint64_t k = 0; k < packets && sent < TABLE_BURST; k++) {
+            if (acked[k]) continue;
+            char pkt[HEADER_LEN + COPY_RECORDS * COPY_RECORD_LEN];
+            int n = count - (long)k * COPY_RECORDS < COPY_RECORDS ? count - (long)k * COPY_RECORDS : COPY_RECORDS;
+            build_header((struct pkt_header *)pkt, PKT_COPY, 0, transfer_id, k, n * COPY_RECORD_LEN);
+            for (int r = 0; r < n; r++) {
+                const struct copy_run *run = &runs[(long)k * COPY_RECORDS + r];
+                uint64_t rec[3] = { htobe64(run->offset), htobe64(run->src_offset), htobe64(run->length) };
+                memcpy(pkt + HEADER_LEN + r * COPY_RECORD_LEN, rec, COPY_RECORD_LEN);
+            }
+            if (sendto(sockfd, pkt, HEADER_LEN + n * COPY_RECORD_LEN, 0, (const struct sockaddr *)addr,
+                       sizeof(*addr)) < 0) {
+                perror("[ERROR] sendto (COPY) failed");
             }
+            sent++;
+        }
 
+        long long deadline = current_timestamp_us() + timeout_us;
+        long long now;
+        while (have - before < sent && (now = current_timestamp_us()) < deadline) {
             fd_set fds;
             FD_ZERO(&fds);
             FD_SET(sockfd, &fds);
-
             struct timeval tv;
-            tv.tv_sec = 2;      // Waitting time
-            tv.tv_usec = 0;
-
-            int rv = select(sockfd + 1, &fds, NULL, NULL, &tv);
-            if (rv == 0) {
-                printf("Timeout waiting for ACK of frag #%u, retransmit\n", frag_no);
-                attempts++;
-                if (0) {      // attempts >= MAX_RETRIES for set a max retry time, 0 for infinity retry
-                    printf("[DEBUG] Max retries reached for frag #%u. Exiting file transfer.\n", frag_no);
-                    fclose(fp);
-                    close(sockfd);
-                    return 1;
-                }
+            tv.tv_sec = (deadline - now) / 1000000;
+            tv.tv_usec = (deadline - now) % 1000000;
+            if (select(sockfd + 1, &fds, NULL, NULL, &tv) <= 0) continue;
+
+            char buf[MAX_PACKET_LEN];
+            int n = recv(sockfd, buf, sizeof(buf), 0);
+            struct pkt_header hdr;
+            if (n < 0 || parse_header(buf, n, &hdr) < 0) continue;
+            if (hdr.type != PKT_COPY || hdr.transfer_id != transfer_id) continue;
+            if (hdr.offset >= packets || acked[hdr.offset]) continue;
+            acked[hdr.offset] = 1;
+            have++;
+        }
+        if (have == before) {
+            idle_rounds++;
+            timeout_us *= 2;
+        } else {
+            idle_rounds = 0;
+        }
+    }
+    free(acked);
+    return have < packets ? -1 : 0;
+}
+
+// The holes in length bytes of fd from offset (SEEK_HOLE/SEEK_DATA), as COPY_HOLE runs counted from offset,
+// leaving out those too short to hold a whole fragment. Returns how many are stored in *runs (malloc()ed);
+// a file system that does not track holes reports none.
+long find_holes(int fd, uint64_t offset, uint64_t length, int frag_size, struct copy_run **runs) {
+    long count = 0, cap = 0;
+    *runs = NULL;
+    uint64_t end = offset + length;
+    uint64_t pos = offset;
+    while (pos < end) {
+        off_t hole = lseek(fd, pos, SEEK_HOLE);
+        if (hole < 0 || (uint64_t)hole >= end) break;
+        off_t data = lseek(fd, hole, SEEK_DATA);    // ENXIO: the hole runs to the end of the file
+        uint64_t stop = data < 0 || (uint64_t)data > end ? end : (uint64_t)data;
+        if (stop - hole >= (uint64_t)frag_size) {
+            if (count == cap) {
+                struct copy_run *grown = realloc(*runs, (cap ? 2 * cap : 64) * sizeof(struct copy_run));
+                if (!grown) break;
+                *runs = grown;
+                cap = cap ? 2 * cap : 64;
+            }
+            (*runs)[count].offset = hole - offset;
+            (*runs)[count].src_offset = COPY_HOLE;
+            (*runs)[count].length = stop - hole;
+            count++;
+        }
+        pos = stop;
+    }
+    return count;
+}
+
+// Whole-file digest, computed on its own thread while the file is sent.
+struct file_hash {
+    const uint8_t *data;
+    size_t len;
+    uint64_t digest[2];
+};
+
+void *hash_file(void *arg) {
+    struct file_hash *fh = arg;
+    murmur3_128(fh->data, fh->len, fh->digest);
+    return NULL;
+}
+
+// CRC32C of a DATA fragment for its reserved field (FLAG_CRC): the header as sent, reserved still zero,
+// then the payload.
+uint32_t fragment_crc(const struct pkt_header *hdr, const char *payload, int length) {
+    return crc32c(crc32c(0, hdr, HEADER_LEN), payload, length);
+}
+
+// LZ4 block compression (the reference library's block format, so any LZ4 decoder reads it): greedy
+// matching through a hash table of 4-byte sequences, skipping ahead faster the longer nothing matches.
+int lz4_compress(const uint8_t *src, int len, uint8_t *dst, int cap) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    const uint8_t *ip = src, *anchor = src, *end = src + len;
+    const uint8_t *match_limit = end - LZ_LAST_LITERALS;
+    uint8_t *op = dst, *oend = dst + cap;
+    if (len > LZ_MFLIMIT) {
+        const uint8_t *mflimit = end - LZ_MFLIMIT;
+        unsigned int misses = 0;
+        ip++;
+        while (ip < mflimit) {
+            uint32_t seq, ref_seq;
+            memcpy(&seq, ip, 4);
+            uint32_t h = (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+            const uint8_t *ref = src + table[h];
+            table[h] = ip - src;
+            memcpy(&ref_seq, ref, 4);
+            if (ref >= ip || ip - ref > 65535 || ref_seq != seq) {
+                ip += 1 + (misses++ >> LZ_SKIP_TRIGGER);
                 continue;
             }
+            misses = 0;
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *m = ip + 4, *r = ref + 4;
+            while (m + 8 <= match_limit) {
+                uint64_t a, b;
+                memcpy(&a, m, 8);
+                memcpy(&b, r, 8);
+                if (a != b) break;
+                m += 8;
+                r += 8;
+            }
+            while (m < match_limit && *m == *r) {
+                m++;
+                r++;
+            }
 
-            char ack_buf[64];
-            int ack_len = recvfrom(sockfd, ack_buf, sizeof(ack_buf)-1, 0,
-                                   (struct sockaddr*)&server_addr, &addr_len);
-            if (ack_len > 0) {
-                ack_buf[ack_len] = '\0';
-                if (strncmp(ack_buf, "ACK:", 4) == 0) {
-                    unsigned int ack_no = atoi(ack_buf + 4);
-                    if (ack_no == frag_no) {
-                        printf("[DEBUG] Received ACK for frag #%u\n", frag_no);
-                        break;
-                    }
-                }
+            size_t lit = ip - anchor, match = m - ip - 4;
+            if (op + 1 + lit + lit / 255 + 1 + 2 + match / 255 + 1 > oend) return 0;
+            uint8_t *token = op++;
+            *token = (lit < 15 ? lit : 15) << 4 | (match < 15 ? match : 15);
+            if (lit >= 15) {
+                size_t l = lit - 15;
+                for (; l >= 255; l -= 255) *op++ = 255;
+                *op++ = l;
+            }
+            memcpy(op, anchor, lit);
+            op += lit;
+            *op++ = (ip - ref) & 0xff;
+            *op++ = (ip - ref) >> 8;
+            if (match >= 15) {
+                size_t l = match - 15;
+                for (; l >= 255; l -= 255) *op++ = 255;
+                *op++ = l;
             }
+            ip = anchor = m;
         }
-//////////////////////////////////////////////////////////////////////////////////////////
+    }
+    // The block ends with literals only.
+    size_t lit = end - anchor;
+    if (op + 1 + lit + lit / 255 + 1 > oend) return 0;
+    *op++ = (lit < 15 ? lit : 15) << 4;
+    if (lit >= 15) {
+        size_t l = lit - 15;
+        for (; l >= 255; l -= 255) *op++ = 255;
+        *op++ = l;
+    }
+    memcpy(op, anchor, lit);
+    op += lit;
+    return op - dst;
+}
 
+// Shannon entropy, in bits per byte, of LZ_SAMPLE_RUNS runs of 8 bytes spread over the fragment. Compressed,
+// encrypted and media data sit near 8, so a sample this small is enough to skip them without trying.
+double sample_entropy(const uint8_t *p, int len) {
+    unsigned int hist[256] = { 0 };
+    int stride = (len - 8) / LZ_SAMPLE_RUNS;
+    int n = 0;
+    for (int r = 0; r < LZ_SAMPLE_RUNS; r++) {
+        for (int i = 0; i < 8; i++) hist[p[r * stride + i]]++;
+        n += 8;
     }
+    double bits = 0;
+    for (int i = 0; i < 256; i++) {
+        if (hist[i]) bits -= (double)hist[i] / n * log2((double)hist[i] / n);
+    }
+    return bits;
+}
 
-    fclose(fp);
-    printf("[DEBUG] File transfer completed: sent %u fragments.\n", total_frag);
+// Per-transfer state of the compress-or-not decision.
+struct lz_state {
+    unsigned int backoff;        // Fragments left to send raw after compression did not pay
+    unsigned int penalty;        // Next backoff, doubled each time it fails again
+    unsigned int compressed;
+    unsigned int sampled_out;    // Skipped by the entropy sample
+    uint64_t raw_bytes;          // Of the compressed fragments, before and after
+    uint64_t wire_bytes;
+};
 
-    close(sockfd);
+// Compress one fragment into dst unless the sample says it is not worth it. Fragments that do not shrink by
+// at least 1/LZ_MIN_SAVING go raw and the following ones skip compression for a doubling stretch, so data
+// that defeats LZ4 without looking random costs little CPU. Returns the compressed size, 0 to send it raw.
+int compress_fragment(struct lz_state *lz, const char *src, int len, char *dst) {
+    if (len < LZ_MIN_INPUT) return 0;
+    if (lz->backoff) {
+        lz->backoff--;
+        return 0;
+    }
+    if (sample_entropy((const uint8_t *)src, len) > LZ_MAX_ENTROPY) {
+        lz->sampled_out++;
+        return 0;
+    }
+    int n = lz4_compress((const uint8_t *)src, len, (uint8_t *)dst, len - len / LZ_MIN_SAVING);
+    if (n == 0) {
+        lz->backoff = lz->penalty;
+        lz->penalty = lz->penalty ? (lz->penalty * 2 < LZ_MAX_BACKOFF ? lz->penalty * 2 : LZ_MAX_BACKOFF) : 1;
+        return 0;
+    }
+    lz->penalty = 0;
+    lz->compressed++;
+    lz->raw_bytes += len;
+    lz->wire_bytes += n;
+    return n;
+}
+
+// Fragments queued for one sendmmsg() call. Each fragment is a header/payload iovec pair;
+// in GSO mode one datagram carries up to GSO_MAX_SEGS equal-sized fragments and the kernel
+// (or NIC) splits it on the way out.
+struct send_batch {
+    int depth;
+    int count;
+    int gso_size;                // 0 when GSO is off
+    int open;                    // Last datagram can take more GSO segments
+    int iov_per_msg;
+    struct mmsghdr msgs[MAX_BATCH];
+    struct iovec *iov;           // iov_per_msg entries per datagram
+    struct frag_slot **owner;    // Slot of each header/payload pair in iov
+    uint32_t zc_next;            // Next MSG_ZEROCOPY notification id the kernel hands out
+    uint32_t zc_done;            // Every id before this one has completed
+    char cmsg[MAX_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+};
+
+int batch_init(struct send_batch *batch, int depth, int gso_size) {
+    memset(batch, 0, sizeof(*batch));
+    batch->depth = depth;
+    batch->gso_size = gso_size;
+    batch->iov_per_msg = gso_size ? 2 * GSO_MAX_SEGS : 2;
+    batch->iov = calloc((size_t)depth * batch->iov_per_msg, sizeof(struct iovec));
+    batch->owner = calloc((size_t)depth * batch->iov_per_msg / 2, sizeof(struct frag_slot *));
+    if (!batch->iov || !batch->owner) {
+        free(batch->iov);
+        free(batch->owner);
+        return -1;
+    }
     return 0;
 }
 
+void batch_free(struct send_batch *batch) {
+    free(batch->iov);
+    free(batch->owner);
+}
+
+// Send everything queued. Datagrams the kernel refuses are left to the retransmission timer.
+void batch_flush(int sockfd, struct send_batch *batch, int zerocopy) {
+    int flags = 0;
+    if (zerocopy) {
+        flags = MSG_ZEROCOPY;
+        for (int m = 0; m < batch->count; m++) {
+            size_t bytes = 0;
+            for (size_t i = 0; i < batch->msgs[m].msg_hdr.msg_iovlen; i++) {
+                bytes += batch->msgs[m].msg_hdr.msg_iov[i].iov_len;
+            }
+            if (bytes < ZEROCOPY_MIN) flags = 0;
+        }
+    }
+    int done = 0;
+    while (done < batch->count) {
+        int n = sendmmsg(sockfd, batch->msgs + done, batch->count - done, flags);
+        if (n < 0) {
+            // Out of zerocopy budget, or more pages than an skb can pin: fall back to a copy.
+            if ((errno == ENOBUFS || errno == EMSGSIZE) && flags) {
+                flags = 0;
+                continue;
+            }
+            perror("[ERROR] sendmmsg (fragment) failed");
+            break;
+        }
+        // Each zerocopy datagram gets the next notification id; its slots stay pinned until it completes.
+        for (int m = done; m < done + n; m++) {
+            struct frag_slot **owner = batch->owner + (size_t)m * batch->iov_per_msg / 2;
+            for (size_t i = 0; i < batch->msgs[m].msg_hdr.msg_iovlen / 2; i++) {
+                owner[i]->zc_busy = flags != 0;
+                owner[i]->zc_id = batch->zc_next;
+            }
+            if (flags) batch->zc_next++;
+        }
+        done += n;
+    }
+    batch->count = 0;
+    batch->open = 0;
+}
+
+// Queue header and payload straight from their own buffers.
+void batch_add(int sockfd, struct send_batch *batch, const struct sockaddr_in *addr,
+               struct frag_slot *slot, int zerocopy) {
+    int seg_len = HEADER_LEN + slot->payload_len;
+
+    // GSO: append to the open datagram. Only its last segment may be shorter than gso_size.
+    if (batch->open) {
+        struct msghdr *msg = &batch->msgs[batch->count - 1].msg_hdr;
+        size_t segs = msg->msg_iovlen / 2;
+        if (seg_len <= batch->gso_size && (segs + 1) * batch->gso_size <= GSO_MAX_BYTES) {
+            msg->msg_iov[msg->msg_iovlen].iov_base = (void *)&slot->header;
+            msg->msg_iov[msg->msg_iovlen].iov_len = HEADER_LEN;
+            msg->msg_iov[msg->msg_iovlen + 1].iov_base = (void *)slot->payload;
+            msg->msg_iov[msg->msg_iovlen + 1].iov_len = slot->payload_len;
+            batch->owner[(msg->msg_iov - batch->iov + msg->msg_iovlen) / 2] = slot;
+            msg->msg_iovlen += 2;
+            if (seg_len < batch->gso_size || segs + 1 == GSO_MAX_SEGS) batch->open = 0;
+            return;
+        }
+        batch->open = 0;
+    }
+
+    if (batch->count == batch->depth) batch_flush(sockfd, batch, zerocopy);
+
+    struct iovec *iov = batch->iov + (size_t)batch->count * batch->iov_per_msg;
+    iov[0].iov_base = (void *)&slot->header;
+    iov[0].iov_len = HEADER_LEN;
+    iov[1].iov_base = (void *)slot->payload;
+    iov[1].iov_len = slot->payload_len;
+    batch->owner[(iov - batch->iov) / 2] = slot;
+
+    struct msghdr *msg = &batch->msgs[batch->count].msg_hdr;
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_name = (void *)addr;
+    msg->msg_namelen = sizeof(*addr);
+    msg->msg_iov = iov;
+    msg->msg_iovlen = 2;
 
+    if (batch->gso_size) {
+        msg->msg_control = batch->cmsg[batch->count];
+        msg->msg_controllen = sizeof(batch->cmsg[batch->count]);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(msg);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t gso = batch->gso_size;
+        memcpy(CMSG_DATA(cm), &gso, sizeof(gso));
+        batch->open = seg_len == batch->gso_size;
+    }
+
+    batch->count++;
+    if (!batch->gso_size && batch->count == batch->depth) batch_flush(sockfd, batch, zerocopy);
+}
+
+// Read MSG_ZEROCOPY completions off the error queue. Each one covers the id range [ee_info, ee_data],
+// and UDP completes them in order.
+void drain_zerocopy_completions(int sockfd, struct send_batch *batch) {
+    char control[128];
+    struct msghdr msg;
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) break;
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR) continue;
+            struct sock_extended_err ee;
+            memcpy(&ee, CMSG_DATA(cm), sizeof(ee));
+            if (ee.ee_errno == 0 && ee.ee_origin == SO_EE_ORIGIN_ZEROCOPY &&
+                (int32_t)(ee.ee_data + 1 - batch->zc_done) > 0) {
+                batch->zc_done = ee.ee_data + 1;
+            }
+        }
+    }
+}
+
+// The payload lives in the mapping, but the header lives in the slot: it may only be rewritten once
+// the kernel is done with the slot's last zerocopy send.
+void zerocopy_wait(int sockfd, struct send_batch *batch, struct frag_slot *slot) {
+    while (slot->zc_busy && (int32_t)(slot->zc_id - batch->zc_done) >= 0) {
+        struct pollfd pfd = {.fd = sockfd, .events = 0};
+        poll(&pfd, 1, 100);    // POLLERR is reported once a completion is queued
+        drain_zerocopy_completions(sockfd, batch);
+    }
+    slot->zc_busy = 0;
+}
+
+/////////////////////////////// Congestion control ///////////////////////////////
+
+// Shared by Reno and CUBIC: Linux-style pacing at 2x (slow start) or 1.2x (avoidance) cwnd/SRTT.
+double cc_window_pacing_rate(const struct cc_state *cc) {
+    if (cc->srtt_us <= 0) return 0;
+    double gain = cc->cwnd < cc->ssthresh ? 2.0 : 1.2;
+    return gain * cc->cwnd * cc->mss * 1e6 / cc->srtt_us;
+}
+
+void reno_init(struct cc_state *cc, int mss) {
+    memset(cc, 0, sizeof(*cc));
+    cc->mss = mss;
+    cc->cwnd = CC_INIT_CWND;
+    cc->ssthresh = 1e9;
+}
+
+void reno_on_ack(struct cc_state *cc, const struct cc_ack *ack) {
+    double pkts = (double)ack->acked_bytes / cc->mss;
+    cc->srtt_us = ack->srtt_us;
+    if (cc->cwnd < cc->ssthresh) {
+        cc->cwnd += pkts;
+    } else {
+        cc->cwnd += pkts / cc->cwnd;
+    }
+}
+
+void reno_on_loss(struct cc_state *cc, long long now_us) {
+    (void)now_us;
+    cc->ssthresh = cc->cwnd / 2;
+    if (cc->ssthresh < CC_MIN_CWND) cc->ssthresh = CC_MIN_CWND;
+    cc->cwnd = cc->ssthresh;
+}
+
+void reno_on_timeout(struct cc_state *cc, long long now_us) {
+    (void)now_us;
+    cc->ssthresh = cc->cwnd / 2;
+    if (cc->ssthresh < CC_MIN_CWND) cc->ssthresh = CC_MIN_CWND;
+    cc->cwnd = 1;
+}
+
+void cubic_on_ack(struct cc_state *cc, const struct cc_ack *ack) {
+    double pkts = (double)ack->acked_bytes / cc->mss;
+    cc->srtt_us = ack->srtt_us;
+    if (cc->cwnd < cc->ssthresh) {
+        cc->cwnd += pkts;
+        return;
+    }
+    if (cc->epoch_start_us == 0) {
+        cc->epoch_start_us = ack->now_us;
+        if (cc->cwnd < cc->w_max) {
+            cc->k = cbrt((cc->w_max - cc->cwnd) / CUBIC_C);
+        } else {
+            cc->k = 0;
+            cc->w_max = cc->cwnd;
+        }
+        cc->w_est = cc->cwnd;
+    }
+    double t = (ack->now_us - cc->epoch_start_us + ack->srtt_us) / 1e6;
+    double target = CUBIC_C * (t - cc->k) * (t - cc->k) * (t - cc->k) + cc->w_max;
+
+    // Never grow slower than Reno would in the same period.
+    cc->w_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * pkts / cc->cwnd;
+    if (cc->w_est > target) target = cc->w_est;
+
+    if (target > cc->cwnd) {
+        double inc = (target - cc->cwnd) / cc->cwnd * pkts;
+        if (inc > pkts / 2) inc = pkts / 2;     // At most 1.5x per RTT
+        cc->cwnd += inc;
+    } else {
+        cc->cwnd += pkts / (100 * cc->cwnd);
+    }
+}
+
+void cubic_on_loss(struct cc_state *cc, long long now_us) {
+    (void)now_us;
+    cc->w_max = cc->cwnd;
+    cc->cwnd *= CUBIC_BETA;
+    if (cc->cwnd < CC_MIN_CWND) cc->cwnd = CC_MIN_CWND;
+    cc->ssthresh = cc->cwnd;
+    cc->epoch_start_us = 0;
+}
+
+void cubic_on_timeout(struct cc_state *cc, long long now_us) {
+    cubic_on_loss(cc, now_us);
+    cc->cwnd = 1;
+}
+
+void bbr_init(struct cc_state *cc, int mss) {
+    memset(cc, 0, sizeof(*cc));
+    cc->mss = mss;
+    cc->cwnd = CC_INIT_CWND;
+    cc->ssthresh = 1e9;
+    cc->mode = BBR_STARTUP;
+    cc->pacing_gain = BBR_HIGH_GAIN;
+    cc->cwnd_gain = BBR_HIGH_GAIN;
+    cc->min_rtt_us = -1;
+}
+
+void bbr_enter_probe_bw(struct cc_state *cc, long long now_us) {
+    cc->mode = BBR_PROBE_BW;
+    cc->cwnd_gain = 2.0;
+    cc->cycle_index = 2;        // Start in a cruising phase
+    cc->cycle_stamp_us = now_us;
+    cc->pacing_gain = 1.0;
+}
+
+void bbr_on_ack(struct cc_state *cc, const struct cc_ack *ack) {
+    static const double cycle_gains[8] = { 1.25, 0.75, 1, 1, 1, 1, 1, 1 };
+    cc->srtt_us = ack->srtt_us;
+
+    // Round-trip counting: a round ends when a fragment sent after the previous round's end is ACKed.
+    int round_start = 0;
+    if (ack->prior_delivered >= cc->next_round_delivered) {
+        cc->next_round_delivered = ack->delivered;
+        cc->round_count++;
+        cc->bw_round[cc->round_count % BBR_BW_ROUNDS] = 0;
+        round_start = 1;
+    }
+
+    // Windowed max filter over the last BBR_BW_ROUNDS rounds.
+    double *slot = &cc->bw_round[cc->round_count % BBR_BW_ROUNDS];
+    if (ack->delivery_rate > *slot) *slot = ack->delivery_rate;
+    cc->btl_bw = 0;
+    for (int i = 0; i < BBR_BW_ROUNDS; i++) {
+        if (cc->bw_round[i] > cc->btl_bw) cc->btl_bw = cc->bw_round[i];
+    }
+
+    int min_rtt_expired = cc->min_rtt_us > 0 &&
+                          ack->now_us - cc->min_rtt_stamp_us > BBR_MIN_RTT_WIN;
+    if (ack->rtt_us > 0 && (cc->min_rtt_us < 0 || ack->rtt_us <= cc->min_rtt_us || min_rtt_expired)) {
+        cc->min_rtt_us = ack->rtt_us;
+        cc->min_rtt_stamp_us = ack->now_us;
+    }
+
+    // Startup ends once bandwidth stops growing by 25% for three rounds.
+    if (!cc->full_bw_reached && round_start) {
+        if (cc->btl_bw >= cc->full_bw * 1.25) {
+            cc->full_bw = cc->btl_bw;
+            cc->full_bw_count = 0;
+        } else if (++cc->full_bw_count >= 3) {
+            cc->full_bw_reached = 1;
+        }
+    }
+
+    double bdp_pkts = cc->min_rtt_us > 0 ? cc->btl_bw * cc->min_rtt_us / 1e6 / cc->mss : CC_INIT_CWND;
+
+    switch (cc->mode) {
+    case BBR_STARTUP:
+        if (cc->full_bw_reached) {
+            cc->mode = BBR_DRAIN;
+            cc->pacing_gain = 1 / BBR_HIGH_GAIN;
+            cc->cwnd_gain = BBR_HIGH_GAIN;
+        }
+        break;
+    case BBR_DRAIN:
+        if (ack->inflight <= bdp_pkts) bbr_enter_probe_bw(cc, ack->now_us);
+        break;
+    case BBR_PROBE_BW:
+        if (cc->min_rtt_us > 0 && ack->now_us - cc->cycle_stamp_us > cc->min_rtt_us) {
+            cc->cycle_index = (cc->cycle_index + 1) % 8;
+            cc->cycle_stamp_us = ack->now_us;
+            cc->pacing_gain = cycle_gains[cc->cycle_index];
+        }
+        break;
+    case BBR_PROBE_RTT:
+        if (cc->probe_rtt_done_us == 0 && ack->inflight <= 4) {
+            cc->probe_rtt_done_us = ack->now_us + BBR_PROBE_RTT_US;
+        } else if (cc->probe_rtt_done_us && ack->now_us >= cc->probe_rtt_done_us) {
+            cc->min_rtt_stamp_us = ack->now_us;
+            if (cc->full_bw_reached) {
+                bbr_enter_probe_bw(cc, ack->now_us);
+            } else {
+                cc->mode = BBR_STARTUP;
+                cc->pacing_gain = BBR_HIGH_GAIN;
+                cc->cwnd_gain = BBR_HIGH_GAIN;
+            }
+        }
+        break;
+    }
+
+    if (min_rtt_expired && cc->mode != BBR_PROBE_RTT) {
+        cc->mode = BBR_PROBE_RTT;
+        cc->pacing_gain = 1.0;
+        cc->probe_rtt_done_us = 0;
+    }
+
+    if (cc->mode == BBR_PROBE_RTT) {
+        cc->cwnd = 4;
+    } else {
+        double target = cc->cwnd_gain * bdp_pkts;
+        if (target < 4) target = 4;
+        // Grow gradually towards the target so an early low estimate cannot starve the pipe.
+        if (cc->full_bw_reached) {
+            cc->cwnd = cc->cwnd + (double)ack->acked_bytes / cc->mss;
+            if (cc->cwnd > target) cc->cwnd = target;
+        } else if (cc->cwnd < target || cc->cwnd < CC_INIT_CWND) {
+            cc->cwnd += (double)ack->acked_bytes / cc->mss;
+        }
+    }
+}
+
+void bbr_on_loss(struct cc_state *cc, long long now_us) {
+    // BBR treats isolated loss as noise; the model, not loss, sets the rate.
+    (void)cc;
+    (void)now_us;
+}
+
+void bbr_on_timeout(struct cc_state *cc, long long now_us) {
+    (void)now_us;
+    cc->cwnd = 1;
+}
+
+double bbr_pacing_rate(const struct cc_state *cc) {
+    if (cc->btl_bw > 0) return cc->pacing_gain * cc->btl_bw;
+    if (cc->srtt_us > 0) return cc->pacing_gain * cc->cwnd * cc->mss * 1e6 / cc->srtt_us;
+    return 0;
+}
+
+const struct cc_ops cc_algorithms[] = {
+    { "reno",  reno_init, reno_on_ack,  reno_on_loss,  reno_on_timeout,  cc_window_pacing_rate },
+    { "cubic", reno_init, cubic_on_ack, cubic_on_loss, cubic_on_timeout, cc_window_pacing_rate },
+    { "bbr",   bbr_init,  bbr_on_ack,   bbr_on_loss,   bbr_on_timeout,   bbr_pacing_rate },
+};
+
+const struct cc_ops *cc_find(const char *name) {
+    for (size_t i = 0; i < sizeof(cc_algorithms) / sizeof(cc_algorithms[0]); i++) {
+        if (strcmp(cc_algorithms[i].name, name) == 0) return &cc_algorithms[i];
+    }
+    return NULL;
+}
+//////////////////////////////////////////////////////////////////////////////////
+
+// Compute the m parity fragments of data fragments first..last (1-based) into parity[].
+// Fragments are zero-padded to frag_size; XOR mode has a single parity.
+void fec_encode(const char *file_map, uint64_t file_size, int frag_size, uint64_t first, uint64_t last,
+                int m, int rs, uint8_t **parity) {
+    for (int j = 0; j < m; j++) memset(parity[j], 0, frag_size);
+    for (uint64_t f = first; f <= last; f++) {
+        uint64_t offset = (f - 1) * frag_size;
+        int len = file_size - offset < (uint64_t)frag_size ? (int)(file_size - offset) : frag_size;
+        const uint8_t *data = (const uint8_t *)file_map + offset;
+        if (!rs) {
+            xor_region(parity[0], data, len);
+            continue;
+        }
+        for (int j = 0; j < m; j++) gf_mul_add_region(parity[j], data, fec_coef(j, f - first), len);
+    }
+}
+
+// A file or directory on its way into a bundle.
+struct bundle_item {
+    char *path;                  // Where it is read from here
+    char *rel;                   // Its path under the destination directory
+    uint64_t size;
+    uint32_t mode;
+    uint64_t offset;             // Where its bytes go in the bundle
+};
+
+struct bundle {
+    struct bundle_item *items;
+    size_t count;
+    size_t capacity;
+    size_t files;
+};
+
+// A bundle path must stay inside its directory: relative, without empty, "." or ".." components.
+int bundle_path_ok(const char *path, int len) {
+    if (len == 0 || len > BUNDLE_MAX_PATH || path[0] == '/') return 0;
+    for (int start = 0; start <= len;) {
+        int end = start;
+        while (end < len && path[end] != '/') end++;
+        int n = end - start;
+        if (n == 0 || (n == 1 && path[start] == '.') || (n == 2 && path[start] == '.' && path[start + 1] == '.')) {
+            return 0;
+        }
+        start = end + 1;
+    }
+    return 1;
+}
+
+// Add path to b as rel, and a directory with everything below it (the top one, rel "", is the destination
+// itself). Returns -1 on error.
+int bundle_add(struct bundle *b, const char *path, const char *rel) {
+    struct stat st;
+    if (lstat(path, &st) != 0) {
+        fprintf(stderr, "[ERROR] Cannot bundle '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+        printf("[DEBUG] Skipping '%s', only regular files and directories are bundled.\n", path);
+        return 0;
+    }
+    if (*rel) {
+        if (!bundle_path_ok(rel, strlen(rel))) {
+            fprintf(stderr, "[ERROR] '%s' must be a relative path inside the directory to bundle it.\n", rel);
+            return -1;
+        }
+        if (b->count == b->capacity) {
+            size_t capacity = b->capacity ? b->capacity * 2 : 1024;
+            struct bundle_item *items = realloc(b->items, capacity * sizeof(*items));
+            if (!items) return -1;
+            b->items = items;
+            b->capacity = capacity;
+        }
+        struct bundle_item *item = &b->items[b->count++];
+        item->path = strdup(path);
+        item->rel = strdup(rel);
+        item->size = S_ISREG(st.st_mode) ? st.st_size : 0;
+        item->mode = st.st_mode;
+        item->offset = 0;
+        if (!item->path || !item->rel) return -1;
+        if (S_ISREG(st.st_mode)) b->files++;
+    }
+    if (!S_ISDIR(st.st_mode)) return 0;
+
+    DIR *dir = opendir(path);
+    if (!dir) {
+        fprintf(stderr, "[ERROR] Cannot bundle '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    char child[2 * BUNDLE_MAX_PATH], child_rel[BUNDLE_MAX_PATH + 2];
+    struct dirent *de;
+    int rc = 0;
+    while (rc == 0 && (de = readdir(dir))) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+        snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
+        snprintf(child_rel, sizeof(child_rel), "%s%s%s", rel, *rel ? "/" : "", de->d_name);
+        rc = bundle_add(b, child, child_rel);
+    }
+    closedir(dir);
+    return rc;
+}
+
+// Add every path listed in the manifest file list, one per line, relative to the current directory.
+int bundle_add_list(struct bundle *b, const char *list) {
+    FILE *fp = fopen(list, "r");
+    if (!fp) {
+        fprintf(stderr, "[ERROR] Cannot open manifest '%s': %s\n", list, strerror(errno));
+        return -1;
+    }
+    char line[BUNDLE_MAX_PATH + 2];
+    int rc = 0;
+    while (rc == 0 && fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        int len = strlen(line);
+        while (len > 1 && line[len - 1] == '/') line[--len] = '\0';
+        char *rel = line;
+        while (rel[0] == '.' && rel[1] == '/') rel += 2;
+        if (*rel) rc = bundle_add(b, line, rel);
+    }
+    fclose(fp);
+    return rc;
+}
+
+void bundle_free(struct bundle *b) {
+    for (size_t i = 0; i < b->count; i++) {
+        free(b->items[i].path);
+        free(b->items[i].rel);
+    }
+    free(b->items);
+}
+
+// Lay the bundle out in memory, which then goes out like any mapped file: header and manifest first, then the
+// files, read in back to back so that many small ones share a fragment. Large ones are read too rather than
+// mapped: one truncated while the bundle is out would raise SIGBUS in the send path. Returns the image
+// (munmap() *size bytes) or NULL.
+char *bundle_build(struct bundle *b, uint64_t *size) {
+    uint64_t manifest_len = 0;
+    for (size_t i = 0; i < b->count; i++) manifest_len += sizeof(struct bundle_entry) + strlen(b->items[i].rel);
+    if (manifest_len > UINT32_MAX || b->count > UINT32_MAX) {
+        fprintf(stderr, "[ERROR] Too many files for one bundle.\n");
+        return NULL;
+    }
+    uint64_t end = sizeof(struct bundle_header) + manifest_len;
+    for (size_t i = 0; i < b->count; i++) {
+        b->items[i].offset = end;
+        end += b->items[i].size;
+    }
+    char *image = mmap(NULL, end, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (image == MAP_FAILED) {
+        perror("[ERROR] mmap (bundle) failed");
+        return NULL;
+    }
+
+    struct bundle_header bh;
+    memcpy(bh.magic, BUNDLE_MAGIC, sizeof(bh.magic));
+    bh.entries = htonl(b->count);
+    bh.manifest_len = htonl(manifest_len);
+    memcpy(image, &bh, sizeof(bh));
+    char *p = image + sizeof(bh);
+    for (size_t i = 0; i < b->count; i++) {
+        struct bundle_entry e;
+        int len = strlen(b->items[i].rel);
+        e.offset = htobe64(b->items[i].offset);
+        e.size = htobe64(b->items[i].size);
+        e.mode = htonl(b->items[i].mode);
+        e.path_len = htons(len);
+        e.reserved = 0;
+        memcpy(p, &e, sizeof(e));
+        memcpy(p + sizeof(e), b->items[i].rel, len);
+        p += sizeof(e) + len;
+    }
+
+    for (size_t i = 0; i < b->count; i++) {
+        struct bundle_item *item = &b->items[i];
+        if (!S_ISREG(item->mode) || item->size == 0) continue;
+        errno = 0;
+        int fd = open(item->path, O_RDONLY);
+        int ok = fd >= 0;
+        for (uint64_t done = 0; ok && done < item->size;) {
+            ssize_t n = pread(fd, image + item->offset + done, item->size - done, done);
+            if (n < 0 && errno == EINTR) continue;
+            ok = n > 0;
+            done += ok ? n : 0;
+        }
+        if (fd >= 0) close(fd);
+        if (!ok) {
+            fprintf(stderr, "[ERROR] Cannot bundle '%s': %s\n", item->path,
+                    errno ? strerror(errno) : "it shrank while being read");
+            munmap(image, end);
+            return NULL;
+        }
+    }
+    *size = end;
+    return image;
+}
+
+// A UDP socket for one stream, or -1.
+int open_socket() {
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) return -1;
+    // Large fragments need deep socket buffers or a single burst overflows them.
+    int sock_buf = SOCKET_BUF_BYTES;
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &sock_buf, sizeof(sock_buf));
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &sock_buf, sizeof(sock_buf));
+    return sockfd;
+}
+
+// One file in flight: a transfer of its own at the server, with its own window of fragments, FEC groups,
+// digest and FIN, so a loss in one flow never holds up another. A stream multiplexes one flow per file it
+// sends, or with -P carries a single flow for its range of the file.
+struct flow {
+    char file_name[BUFFER_SIZE];
+    int file_fd;                 // -1 for a bundle
+    uint32_t transfer_id;
+    uint64_t file_id;
+    const char *file_map;        // This flow's bytes of the mmap()ed file or bundle
+    uint64_t file_size;
+    uint64_t range_offset;       // With -P, where those bytes start in the whole file of whole_size bytes
+    uint64_t whole_size;
+    int ranged;
+    int bundle;                  // The file is a bundle for the server to unpack
+    int delta;                   // -d, for a file
+    double weight;               // Share of the bytes under the weighted scheduler
+    // Negotiated at SETUP
+    int frag_size;
+    int compress;
+    uint64_t total_frag;
+    uint8_t *skip_map;           // Fragments the server already has or fills in itself, see flow_open()
+    uint64_t skipped;
+    // Window
+    struct frag_slot *slots;
+    char *zbufs;
+    uint64_t base;               // Lowest unacknowledged fragment
+    uint64_t next_frag;          // Next fragment to read and send
+    unsigned int inflight;
+    uint64_t recovery_end;       // No new loss events until base passes this fragment
+    uint64_t retransmits;
+    uint64_t sent_bytes;         // File bytes sent so far, for the weighted scheduler
+    struct lz_state lz;
+    // FEC: parity buffers are rewritten per group, after the previous group's parity has been sent
+    uint8_t *parity[FEC_MAX_M];
+    struct frag_slot parity_slots[FEC_MAX_M];
+    uint64_t parity_sent;
+    unsigned int group_sent;     // Fragments of the current group actually sent, not skipped by a resume
+    unsigned int group_skipped;  // and those skipped, which the server cannot use to rebuild the group
+    uint64_t fec_rebuilt;
+    // Digest and FIN
+    struct file_hash file_hash;
+    pthread_t hasher;
+    int hashing;
+    int fin_sent;
+    int fin_pending;             // The server answered FLAG_PENDING, so this round does not count
+    int fin_attempts;
+    long long fin_timeout_us;
+    long long fin_deadline_us;
+    int finished;
+    int verified;                // Once finished: 1 the server's copy matches, 0 it does not, -1 no answer
+    long long started_us;
+};
+
+enum flow_scheduler { FLOW_RR, FLOW_WEIGHTED, FLOW_SHORTEST };
+
+// Everything one stream needs: the shared options and its own socket, congestion controller and flows.
+// With -P every stream carries one range of the file, under the same transfer ID.
+struct stream {
+    int index;
+    int count;                   // Streams in this run
+    int sockfd;
+    const struct sockaddr_in *server_addr;
+    struct flow *flows;
+    int flow_count;
+    int rr_next;                 // Round-robin scheduler position
+    // Options
+    int window;
+    int verbose;
+    int zerocopy;
+    int batch_depth;
+    int gso;
+    int fec_k;
+    int fec_m;
+    int fec_rs;
+    int compress;
+    enum flow_scheduler scheduler;
+    const struct cc_ops *cc_ops;
+    // ACK receive buffers
+    struct mmsghdr ack_msgs[MAX_BATCH];
+    struct iovec ack_iov[MAX_BATCH];
+    char ack_bufs[MAX_BATCH][ACK_BUF_LEN];
+    // Outcome
+    uint64_t sent;
+    uint64_t retransmits;
+};
+
+// Open what is sent under name: a file, which is mapped, or a directory (or the files a manifest lists)
+// packed into a bundle that the server unpacks into that name. Returns -1 on error.
+int flow_load(struct flow *fl, const char *name, const char *manifest, int delta) {
+    memset(fl, 0, sizeof(*fl));
+    fl->file_fd = -1;
+    fl->weight = 1;
+    snprintf(fl->file_name, sizeof(fl->file_name), "%s", name);
+    struct stat file_stat;
+    memset(&file_stat, 0, sizeof(file_stat));
+    if (!manifest && stat(name, &file_stat) != 0) {
+        fprintf(stderr, "[ERROR] File '%s' does not exist.\n", name);
+        return -1;
+    }
+    fl->bundle = manifest || S_ISDIR(file_stat.st_mode);
+    int name_len = strlen(fl->file_name);
+    while (fl->bundle && name_len > 1 && fl->file_name[name_len - 1] == '/') fl->file_name[--name_len] = '\0';
+    if (name_len > MAX_NAME_LEN) {
+        fprintf(stderr, "[ERROR] File name longer than %d bytes.\n", MAX_NAME_LEN);
+        return -1;
+    }
+
+    if (fl->bundle) {
+        long long started = current_timestamp_us();
+        struct bundle bundle;
+        memset(&bundle, 0, sizeof(bundle));
+        int rc = manifest ? bundle_add_list(&bundle, manifest) : bundle_add(&bundle, fl->file_name, "");
+        if (rc == 0) fl->file_map = bundle_build(&bundle, &fl->file_size);
+        if (fl->file_map) {
+            printf("[DEBUG] Bundle of %zu files and %zu directories for '%s', %llu bytes (%.1f ms to pack).\n",
+                   bundle.files, bundle.count - bundle.files, fl->file_name, (unsigned long long)fl->file_size,
+                   (current_timestamp_us() - started) / 1000.0);
+        }
+        bundle_free(&bundle);
+        if (!fl->file_map) return -1;
+        if (delta) printf("[DEBUG] -d does not apply to a bundle.\n");
+        fl->whole_size = fl->file_size;
+        return 0;
+    }
+
+    printf("[DEBUG] File '%s' found, size=%llu bytes.\n", name, (unsigned long long)file_stat.st_size);
+    fl->file_fd = open(name, O_RDONLY);
+    if (fl->file_fd < 0) {
+        perror("[ERROR] open failed");
+        return -1;
+    }
+    fl->file_size = fl->whole_size = file_stat.st_size;
+    fl->delta = delta;
+    fl->file_id = file_identity(fl->file_fd, &file_stat);
+    if (fl->file_size > SIZE_MAX) {
+        fprintf(stderr, "[ERROR] File '%s' is too large to map on this build.\n", name);
+        close(fl->file_fd);
+        return -1;
+    }
+    if (fl->file_size > 0) {
+        fl->file_map = mmap(NULL, fl->file_size, PROT_READ, MAP_SHARED, fl->file_fd, 0);
+        if (fl->file_map == MAP_FAILED) {
+            perror("[ERROR] mmap failed");
+            fl->file_map = NULL;
+            close(fl->file_fd);
+            return -1;
+        }
+        madvise((void *)fl->file_map, fl->file_size, MADV_SEQUENTIAL);
+    }
+    return 0;
+}
+
+// Undo flow_load().
+void flow_unload(struct flow *fl) {
+    if (fl->file_map) munmap((void *)fl->file_map, fl->file_size);
+    if (fl->file_fd >= 0) close(fl->file_fd);
+}
+
+// Start a flow: SETUP, then whatever the server asks for first (its bitmap to resume, its signature for a
+// delta) and our COPY records for delta copies and the file's holes, the window and the digest thread. The
+// first handshake RTT seeds rtt_est. Returns -1 if the server rejects it or stops answering.
+int flow_open(struct stream *st, struct flow *fl, int frag_size, struct rtt_estimator *rtt_est) {
+    int sockfd = st->sockfd;
+    const struct sockaddr_in *server_addr = st->server_addr;
+    uint32_t transfer_id = fl->transfer_id;
+    int name_len = strlen(fl->file_name);
+    int window = st->window;
+    int fec_k = st->fec_k, fec_m = st->fec_m, fec_rs = st->fec_rs;
+    uint64_t file_size = fl->file_size;
+
+    // Holes are not sent: the server zeroes them and leaves them unallocated.
+    struct copy_run *holes = NULL;
+    long hole_count = fl->file_fd >= 0 ? find_holes(fl->file_fd, fl->range_offset, file_size, frag_size, &holes) : 0;
+
+    char setup_pkt[MAX_PACKET_LEN];
+    struct setup_body setup;
+    memset(&setup, 0, sizeof(setup));
+    setup.file_size = htobe64(file_size);
+    setup.frag_size = htonl(frag_size);
+    setup.name_len = htons(name_len);
+    setup.fec = htons(fec_k << 8 | fec_m);
+    setup.file_id = htobe64(fl->ranged || fl->bundle ? 0 : fl->file_id);
+    if (fl->ranged) {
+        setup.file_size = htobe64(fl->whole_size);
+        setup.range_offset = htobe64(fl->range_offset);
+        setup.range_length = htobe64(file_size);
+    }
+    int setup_len = sizeof(setup) + name_len;
+    build_header((struct pkt_header *)setup_pkt, PKT_SETUP,
+                 (fec_rs ? FLAG_FEC_RS : 0) | (fl->delta ? FLAG_DELTA : 0) | (st->compress ? FLAG_LZ : 0) |
+                 (fl->ranged ? FLAG_RANGE : 0) | (fl->bundle ? FLAG_BUNDLE : 0) | (hole_count ? FLAG_SPARSE : 0),
+                 transfer_id, 0, setup_len);
+    memcpy(setup_pkt + HEADER_LEN, &setup, sizeof(setup));
+    memcpy(setup_pkt + HEADER_LEN + sizeof(setup), fl->file_name, name_len);
+
+    long long rtt;
+    struct setup_ack_body setup_ack;
+    uint16_t ack_flags;
+    int accepted = handshake(sockfd, server_addr, setup_pkt, HEADER_LEN + setup_len, transfer_id,
+                             &rtt, &frag_size, &setup_ack, &ack_flags);
+    if (accepted < 0) {
+        fprintf(stderr, "[ERROR] No answer to SETUP for '%s' from server.\n", fl->file_name);
+        free(holes);
+        return -1;
+    }
+    if (!accepted) {
+        fprintf(stderr, "[DEBUG] Server rejected the transfer of '%s'.\n", fl->file_name);
+        free(holes);
+        return -1;
+    }
+    printf("[DEBUG] Transfer %08x accepted by server, fragment size %d.\n", transfer_id, frag_size);
+    fl->frag_size = frag_size;
+    fl->compress = st->compress && (ack_flags & FLAG_LZ);
+    if (st->compress && !fl->compress) printf("[DEBUG] Server does not take compressed fragments, sending them raw.\n");
+    if (rtt >= 0 && !rtt_est->has_sample) {
+        printf("[DEBUG] RTT = %.3f ms\n", rtt / 1000.0);
+        rtt_sample(rtt_est, rtt);
+    }
+
+    fl->total_frag = (file_size + frag_size - 1) / frag_size;
+    uint64_t total_frag = fl->total_frag;
+    printf("[DEBUG] total_frag = %llu, window = %d\n", (unsigned long long)total_frag, window);
+
+    // Fragments the server already has (kept from an interrupted run) or fills in itself (delta copies and
+    // holes) are skipped: skip_map has bit (n - 1) % 8 of byte (n - 1) / 8 set for each such fragment n.
+    if (setup_ack.resumed > 0) {
+        fl->skip_map = fetch_table(sockfd, server_addr, transfer_id, PKT_BITMAP, (total_frag + 7) / 8,
+                                   rtt_est->rto_us);
+        if (fl->skip_map) {
+            printf("[DEBUG] Resuming: server already has %llu of %llu fragments.\n",
+                   (unsigned long long)setup_ack.resumed, (unsigned long long)total_frag);
+        } else {
+            fprintf(stderr, "[DEBUG] Fetching the server's bitmap failed, sending the whole file.\n");
+        }
+    }
+    if (fl->delta && !setup_ack.delta_blocks) printf("[DEBUG] Server has no copy to diff against, sending it all.\n");
+    long long started = current_timestamp_us();
+    struct copy_run *runs = NULL;
+    long run_count = 0, delta_runs = -1;
+    uint64_t copied = 0;
+    if (setup_ack.delta_blocks > 0) {
+        uint64_t sig_bytes = setup_ack.delta_blocks * SIG_ENTRY_LEN;
+        uint8_t *sig = fetch_table(sockfd, server_addr, transfer_id, PKT_SIGNATURE, sig_bytes, rtt_est->rto_us);
+        delta_runs = sig ? compute_delta((const uint8_t *)fl->file_map, file_size, sig, setup_ack.delta_blocks,
+                                         setup_ack.delta_block, &runs) : -1;
+        free(sig);
+        if (delta_runs < 0) {
+            fprintf(stderr, "[DEBUG] Delta against the server's copy failed, sending the whole file.\n");
+        }
+        run_count = delta_runs > 0 ? delta_runs : 0;
+        for (long r = 0; r < run_count; r++) copied += runs[r].length;
+    }
+    // Holes go in the same COPY records, after the delta copies.
+    struct copy_run *all = hole_count ? realloc(runs, (run_count + hole_count) * sizeof(struct copy_run)) : runs;
+    if (all) {
+        memcpy(all + run_count, holes, hole_count * sizeof(struct copy_run));
+        runs = all;
+        run_count += hole_count;
+    } else {
+        hole_count = 0;
+    }
+    free(holes);
+    // The server counts these fragments as received, so they must all be known to it before any DATA.
+    if (run_count > 0 && send_copies(sockfd, server_addr, transfer_id, runs, run_count, rtt_est->rto_us) < 0) {
+        fprintf(stderr, "[ERROR] Server stopped answering COPY records.\n");
+        free(runs);
+        return -1;
+    }
+    uint64_t marked = 0;
+    if (run_count > 0 && !fl->skip_map) fl->skip_map = calloc((total_frag + 7) / 8, 1);
+    if (run_count > 0 && fl->skip_map) marked = mark_copied(fl->skip_map, runs, run_count, file_size, frag_size,
+                                                            total_frag);
+    if (delta_runs >= 0) {
+        printf("[DEBUG] Delta: %llu of %llu bytes match the server's copy in %ld runs, %llu of %llu fragments "
+               "left to send (%.1f ms to diff).\n", (unsigned long long)copied, (unsigned long long)file_size,
+               delta_runs, (unsigned long long)(total_frag - marked), (unsigned long long)total_frag,
+               (current_timestamp_us() - started) / 1000.0);
+    }
+    if (hole_count > 0) {
+        uint64_t hole_bytes = 0;
+        for (long r = run_count - hole_count; r < run_count; r++) hole_bytes += runs[r].length;
+        printf("[DEBUG] Sparse: %llu of %llu bytes are in %ld holes, %llu of %llu fragments left to send.\n",
+               (unsigned long long)hole_bytes, (unsigned long long)file_size, hole_count,
+               (unsigned long long)(total_frag - marked), (unsigned long long)total_frag);
+    }
+    free(runs);
+
+    fl->slots = calloc(window, sizeof(struct frag_slot));
+    if (!fl->slots) {
+        perror("[ERROR] calloc (window) failed");
+        return -1;
+    }
+    // A compressed fragment stays in its slot's buffer until ACKed, retransmissions are sent from there.
+    if (fl->compress) {
+        fl->zbufs = malloc((size_t)window * frag_size);
+        if (!fl->zbufs) {
+            perror("[DEBUG] malloc (compression buffers) failed, sending raw");
+            fl->compress = 0;
+        }
+        for (int i = 0; fl->compress && i < window; i++) fl->slots[i].zbuf = fl->zbufs + (size_t)i * frag_size;
+    }
+    for (int j = 0; fec_k && j < fec_m; j++) {
+        fl->parity[j] = malloc(frag_size);
+        if (!fl->parity[j]) {
+            perror("[ERROR] malloc (parity) failed");
+            return -1;
+        }
+    }
+    fl->base = 1;
+    fl->next_frag = 1;
+
+    // Hash the file beside the send loop; without a thread, before it.
+    fl->file_hash.data = (const uint8_t *)fl->file_map;
+    fl->file_hash.len = file_size;
+    fl->hashing = pthread_create(&fl->hasher, NULL, hash_file, &fl->file_hash) == 0;
+    if (!fl->hashing) hash_file(&fl->file_hash);
+    fl->started_us = current_timestamp_us();
+    return 0;
+}
+
+// Free what flow_open() allocated.
+void flow_close(struct flow *fl) {
+    if (fl->hashing) pthread_join(fl->hasher, NULL);
+    fl->hashing = 0;
+    free(fl->slots);
+    free(fl->zbufs);
+    free(fl->skip_map);
+    for (int j = 0; j < FEC_MAX_M; j++) free(fl->parity[j]);
+}
+
+// Send (or resend) FIN with the flow's digest; the answer comes back through the send loop.
+void flow_send_fin(struct stream *st, struct flow *fl) {
+    char pkt[HEADER_LEN + 2 * sizeof(uint64_t)];
+    uint64_t body[2] = { htobe64(fl->file_hash.digest[0]), htobe64(fl->file_hash.digest[1]) };
+    build_header((struct pkt_header *)pkt, PKT_FIN, 0, fl->transfer_id, 0, sizeof(body));
+    memcpy(pkt + HEADER_LEN, body, sizeof(body));
+    if (sendto(st->sockfd, pkt, sizeof(pkt), 0, (const struct sockaddr *)st->server_addr,
+               sizeof(*st->server_addr)) < 0) {
+        perror("[ERROR] sendto (FIN) failed");
+    }
+    fl->fin_deadline_us = current_timestamp_us() + fl->fin_timeout_us;
+}
+
+// A flow is over: report it the way a single-file run always has.
+void flow_finish(struct stream *st, struct flow *fl, int verified) {
+    fl->finished = 1;
+    fl->verified = verified;
+    unsigned long long sent = fl->total_frag - fl->skipped;
+    const uint64_t *digest = fl->file_hash.digest;
+    if (fl->skip_map) {
+        printf("[DEBUG] Skipped: %llu fragments the server already had or filled in itself.\n",
+               (unsigned long long)fl->skipped);
+    }
+    if (fl->compress) {
+        printf("[DEBUG] LZ4: %u fragments compressed, %llu bytes sent as %llu (%.2fx), %u skipped as "
+               "incompressible by sampling\n", fl->lz.compressed, (unsigned long long)fl->lz.raw_bytes,
+               (unsigned long long)fl->lz.wire_bytes, fl->lz.wire_bytes ? (double)fl->lz.raw_bytes / fl->lz.wire_bytes
+               : 1.0, fl->lz.sampled_out);
+    }
+    if (st->fec_k) {
+        printf("[DEBUG] FEC: %llu parity fragments sent, %llu fragments rebuilt by the server\n",
+               (unsigned long long)fl->parity_sent, (unsigned long long)fl->fec_rebuilt);
+    }
+    if (verified < 0) {
+        fprintf(stderr, "[ERROR] No answer to FIN for '%s', the server's copy is unverified.\n", fl->file_name);
+    } else if (!verified) {
+        fprintf(stderr, "[ERROR] The server's copy of '%s' does not match digest %016llx%016llx.\n", fl->file_name,
+                (unsigned long long)digest[0], (unsigned long long)digest[1]);
+    } else if (fl->ranged) {
+        printf("[DEBUG] Stream %d completed: bytes %llu-%llu, sent %llu fragments, digest %016llx%016llx verified "
+               "by the server.\n", st->index, (unsigned long long)fl->range_offset,
+               (unsigned long long)(fl->range_offset + fl->file_size), sent, (unsigned long long)digest[0],
+               (unsigned long long)digest[1]);
+    } else if (st->flow_count > 1) {
+        printf("[DEBUG] File '%s' completed in %.1f ms: sent %llu fragments (%llu resent), digest %016llx%016llx "
+               "verified by the server.\n", fl->file_name, (current_timestamp_us() - fl->started_us) / 1000.0,
+               sent, (unsigned long long)fl->retransmits, (unsigned long long)digest[0],
+               (unsigned long long)digest[1]);
+    } else {
+        printf("[DEBUG] File transfer completed: sent %llu fragments, digest %016llx%016llx verified by the "
+               "server.\n", sent, (unsigned long long)digest[0], (unsigned long long)digest[1]);
+    }
+    st->sent += sent;
+    st->retransmits += fl->retransmits;
+    flow_close(fl);
+}
+
+// Pick the flow whose new fragment goes next, among those with room in their window: each in turn (rr), the
+// one furthest below its weighted share of the bytes sent (weighted), or the one with the fewest bytes left to
+// send (shortest, so a small file is never stuck behind a bulk one). Returns NULL if none has room.
+struct flow *schedule_flow(struct stream *st) {
+    struct flow *best = NULL;
+    uint64_t best_left = 0;
+    for (int n = 0; n < st->flow_count; n++) {
+        int i = (st->rr_next + n) % st->flow_count;
+        struct flow *fl = &st->flows[i];
+        if (fl->finished || fl->next_frag > fl->total_frag || fl->next_frag >= fl->base + (unsigned int)st->window) {
+            continue;
+        }
+        uint64_t left = fl->file_size - (fl->next_frag - 1) * fl->frag_size;
+        if (st->scheduler == FLOW_RR) {
+            st->rr_next = i + 1;
+            return fl;
+        }
+        if (!best || (st->scheduler == FLOW_WEIGHTED ? fl->sent_bytes / fl->weight < best->sent_bytes / best->weight
+                                                      : left < best_left)) {
+            best = fl;
+            best_left = left;
+        }
+    }
+    return best;
+}
+
+// The flow a reply is for, by transfer ID.
+struct flow *flow_find(struct stream *st, uint32_t transfer_id) {
+    for (int i = 0; i < st->flow_count; i++) {
+        if (st->flows[i].transfer_id == transfer_id) return &st->flows[i];
+    }
+    return NULL;
+}
+
+// Run one stream: open its flows, then send them all over its socket under one congestion controller,
+// finishing each flow (FIN and its verdict) as soon as its last fragment is ACKed. Returns how many flows
+// failed.
+int send_stream(struct stream *st) {
+    int sockfd = st->sockfd;
+    const struct sockaddr_in *server_addr = st->server_addr;
+    int window = st->window;
+    int verbose = st->verbose;
+    int zerocopy = st->zerocopy;
+    int batch_depth = st->batch_depth;
+    int fec_k = st->fec_k;
+    int fec_m = st->fec_m;
+    int fec_rs = st->fec_rs;
+    const struct cc_ops *cc_ops = st->cc_ops;
+
+    struct rtt_estimator rtt_est;
+    rtt_init(&rtt_est);
+    int failed = 0;
+    int frag_size = 0;
+    for (int i = 0; i < st->flow_count; i++) {
+        struct flow *fl = &st->flows[i];
+        if (flow_open(st, fl, fl->frag_size, &rtt_est) < 0) {
+            flow_close(fl);
+            fl->finished = 1;
+            fl->verified = -1;
+            failed++;
+            continue;
+        }
+        if (fl->frag_size > frag_size) frag_size = fl->frag_size;
+        // Compressed payloads live in buffers that are rewritten while the kernel might still hold them.
+        if (fl->compress && zerocopy) {
+            printf("[DEBUG] -z is off with -C.\n");
+            zerocopy = 0;
+        }
+    }
+    if (failed == st->flow_count) return failed;
+    printf("A file transfer can start.\n");
+    if (st->flow_count > 1) {
+        printf("[DEBUG] Multiplexing %d files, %s scheduler\n", st->flow_count,
+               st->scheduler == FLOW_RR ? "round-robin" : st->scheduler == FLOW_WEIGHTED ? "weighted"
+                                                                                     : "shortest-first");
+    }
+
+    if (zerocopy) {
+        int one = 1;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+            perror("[DEBUG] SO_ZEROCOPY unavailable, using copying sends");
+            zerocopy = 0;
+        }
+    }
+
+    struct cc_state cc;
+    cc_ops->init(&cc, frag_size);
+    cc.srtt_us = rtt_est.srtt_us;
+    printf("[DEBUG] Congestion control: %s\n", cc_ops->name);
+    if (fec_k) printf("[DEBUG] FEC: %s, %d parity per %d fragments\n", fec_rs ? "Reed-Solomon" : "XOR", fec_m, fec_k);
+
+    unsigned int inflight = 0;      // All flows together, against cwnd
+    unsigned long long tx_seq = 0;
+    unsigned long long max_acked_seq = 0;
+    long long delivered = 0;
+    long long delivered_us = current_timestamp_us();
+    long long next_send_us = 0;     // Pacing gate for new fragments
+
+    // Headers are fixed-size, so every full fragment is exactly gso_size bytes.
+    int gso_size = 0;
+    if (st->gso) {
+        gso_size = HEADER_LEN + frag_size;
+        int seg = gso_size;
+        if (setsockopt(sockfd, SOL_UDP, UDP_SEGMENT, &seg, sizeof(seg)) < 0) {
+            perror("[DEBUG] UDP_SEGMENT unavailable, sending one fragment per datagram");
+            gso_size = 0;
+        } else {
+            seg = 0;
+            setsockopt(sockfd, SOL_UDP, UDP_SEGMENT, &seg, sizeof(seg));    // Per-datagram cmsg only
+            printf("[DEBUG] GSO enabled, segment size %d\n", gso_size);
+        }
+    }
+
+    struct send_batch batch;
+    if (batch_init(&batch, batch_depth, gso_size) < 0) {
+        perror("[ERROR] calloc (batch) failed");
+        for (int i = 0; i < st->flow_count; i++) {
+            if (!st->flows[i].finished) flow_close(&st->flows[i]);
+        }
+        return st->flow_count;
+    }
+
+    // Per stream, and too big for a thread's stack.
+    struct mmsghdr *ack_msgs = st->ack_msgs;
+    struct iovec *ack_iov = st->ack_iov;
+    char (*ack_bufs)[ACK_BUF_LEN] = st->ack_bufs;
+    for (int i = 0; i < batch_depth; i++) {
+        ack_iov[i].iov_base = ack_bufs[i];
+        ack_iov[i].iov_len = ACK_BUF_LEN;
+        ack_msgs[i].msg_hdr.msg_iov = &ack_iov[i];
+        ack_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int unfinished = st->flow_count - failed;
+//////////////////////////////////////////////////////////////////////////////////////////
+    while (unfinished > 0) {
+        // Fill the windows with new fragments, limited by cwnd and paced at the controller's rate;
+        // the scheduler decides which flow each one comes from.
+        long long now = current_timestamp_us();
+        struct flow *fl;
+        while (inflight < (unsigned int)cc.cwnd && (fl = schedule_flow(st))) {
+            double rate = cc_ops->pacing_rate(&cc);
+            uint64_t next_frag = fl->next_frag;
+            struct frag_slot *slot = &fl->slots[next_frag % window];
+            if (fl->skip_map && (fl->skip_map[(next_frag - 1) / 8] >> ((next_frag - 1) % 8) & 1)) {
+                // Already on the server: acknowledged without being sent.
+                slot->frag_no = next_frag;
+                slot->acked = 1;
+                slot->lost = 0;
+                slot->fec_pending = 0;
+                fl->skipped++;
+                fl->group_skipped++;
+                fl->next_frag++;
+                while (fl->base < fl->next_frag && fl->slots[fl->base % window].acked) fl->base++;
+            } else {
+                if (rate > 0) {
+                    if (next_send_us > now + 1000) break;
+                    if (next_send_us < now - 1000) next_send_us = now - 1000;    // Bounded burst credit
+                }
+
+                uint64_t offset = (next_frag - 1) * fl->frag_size;
+                int read_size = fl->file_size - offset < (uint64_t)fl->frag_size ? (int)(fl->file_size - offset)
+                                                                                 : fl->frag_size;
+
+                uint16_t flags = FLAG_CRC;
+                if (zerocopy) zerocopy_wait(sockfd, &batch, slot);
+                slot->payload = fl->file_map + offset;
+                slot->payload_len = read_size;
+                int packed = fl->compress ? compress_fragment(&fl->lz, slot->payload, read_size, slot->zbuf) : 0;
+                if (packed > 0) {
+                    flags |= FLAG_LZ;
+                    slot->payload = slot->zbuf;
+                    slot->payload_len = packed;
+                }
+                build_header(&slot->header, PKT_DATA, flags, fl->transfer_id, offset, slot->payload_len);
+                slot->header.reserved = htonl(fragment_crc(&slot->header, slot->payload, slot->payload_len));
+                slot->frag_no = next_frag;
+                slot->acked = 0;
+                slot->lost = 0;
+                slot->attempts = 0;
+                slot->parity_held = 0;
+
+                batch_add(sockfd, &batch, server_addr, slot, zerocopy);
+                slot->tx_seq = ++tx_seq;
+                slot->fec_pending = fec_k > 0;
+                slot->fec_seq = 0;
+                slot->delivered = delivered;
+                slot->delivered_us = delivered_us;
+                slot->sent_us = now;
+                slot->deadline_us = now + rtt_est.rto_us;
+                // Paced in file bytes, as delivery is measured, so compression raises the rate it allows.
+                if (rate > 0) next_send_us += (long long)((HEADER_LEN + read_size) * 1e6 / rate);
+                inflight++;
+                fl->inflight++;
+                fl->next_frag++;
+                fl->group_sent++;
+                fl->sent_bytes += read_size;
+            }
+
+            // The group is complete: send its parity right behind it, unless the server had some of it. Parity
+            // covers all K fragments but the server only groups those that arrive as DATA, so a partly skipped
+            // group could not be rebuilt; its fragments are recovered by retransmission alone.
+            uint64_t sent = fl->next_frag - 1;
+            int group_end = fec_k && (sent % fec_k == 0 || sent == fl->total_frag);
+            if (group_end && fl->group_sent && fl->group_skipped) {
+                for (uint64_t f = (sent - 1) / fec_k * fec_k + 1; f <= sent; f++) fl->slots[f % window].fec_pending = 0;
+            } else if (group_end && fl->group_sent) {
+                uint64_t first = (sent - 1) / fec_k * fec_k + 1;
+                fec_encode(fl->file_map, fl->file_size, fl->frag_size, first, sent, fec_m, fec_rs, fl->parity);
+                batch_flush(sockfd, &batch, zerocopy);
+                for (int j = 0; j < fec_m; j++) {
+                    build_header(&fl->parity_slots[j].header, PKT_PARITY, fec_rs ? FLAG_FEC_RS : 0, fl->transfer_id,
+                                 (first - 1) * fl->frag_size, fl->frag_size);
+                    fl->parity_slots[j].header.reserved = htonl(j);
+                    fl->parity_slots[j].payload = (const char *)fl->parity[j];
+                    fl->parity_slots[j].payload_len = fl->frag_size;
+                    batch_add(sockfd, &batch, server_addr, &fl->parity_slots[j], 0);
+                    ++tx_seq;
+                    fl->parity_sent++;
+                    if (rate > 0) next_send_us += (long long)((HEADER_LEN + fl->frag_size) * 1e6 / rate);
+                }
+                batch_flush(sockfd, &batch, 0);    // The buffers are reused by the next group
+                for (uint64_t f = first; f <= sent; f++) {
+                    fl->slots[f % window].fec_pending = 0;
+                    fl->slots[f % window].fec_seq = tx_seq;
+                }
+                // Parity is never ACKed; it takes congestion window room until the group's last fragment is.
+                fl->slots[sent % window].parity_held = fec_m;
+                inflight += fec_m;
+            }
+            if (group_end) fl->group_sent = fl->group_skipped = 0;
+        }
+        batch_flush(sockfd, &batch, zerocopy);
+
+        // Retransmit lost or expired fragments, resend unanswered FINs and find the earliest pending deadline.
+        now = current_timestamp_us();
+        long long earliest = now + rtt_est.rto_us;
+        int more = 0;                   // Some flow still has new fragments, held back by pacing
+        int timed_out = 0;
+        int new_loss = 0;
+        for (int i = 0; i < st->flow_count; i++) {
+            fl = &st->flows[i];
+            if (fl->finished) continue;
+            if (fl->fin_sent) {
+                if (fl->fin_deadline_us <= now) {
+                    if (!fl->fin_pending) {
+                        fl->fin_attempts++;
+                        fl->fin_timeout_us *= 2;
+                    }
+                    fl->fin_pending = 0;
+                    if (fl->fin_attempts >= SETUP_RETRIES) {
+                        flow_finish(st, fl, -1);
+                        failed++;
+                        unfinished--;
+                        continue;
+                    }
+                    flow_send_fin(st, fl);
+                }
+                if (fl->fin_deadline_us < earliest) earliest = fl->fin_deadline_us;
+                continue;
+            }
+            if (fl->next_frag <= fl->total_frag) more = 1;
+            for (uint64_t f = fl->base; f < fl->next_frag; f++) {
+                struct frag_slot *slot = &fl->slots[f % window];
+                if (slot->acked) continue;
+                int expired = slot->deadline_us <= now;
+                if (expired || slot->lost) {
+                    if (verbose) {
+                        printf("%s for frag #%llu of '%s', retransmit\n",
+                               expired ? "Timeout waiting for ACK" : "Loss detected", (unsigned long long)f,
+                               fl->file_name);
+                    }
+                    if (expired) {
+                        // Back off once per timeout event, not once per expired fragment.
+                        if (!timed_out) {
+                            rtt_backoff(&rtt_est);
+                            cc_ops->on_timeout(&cc, now);
+                            timed_out = 1;
+                        }
+                    } else if (f >= fl->recovery_end) {
+                        new_loss = 1;
+                    }
+                    slot->attempts++;
+                    batch_add(sockfd, &batch, server_addr, slot, zerocopy);
+                    fl->retransmits++;
+                    slot->lost = 0;
+                    slot->fec_pending = 0;
+                    slot->fec_seq = 0;
+                    slot->tx_seq = ++tx_seq;
+                    slot->delivered = delivered;
+                    slot->delivered_us = delivered_us;
+                    slot->sent_us = now;
+                    slot->deadline_us = now + rtt_est.rto_us;
+                }
+                if (slot->deadline_us < earliest) earliest = slot->deadline_us;
+            }
+        }
+        batch_flush(sockfd, &batch, zerocopy);
+        if (more && next_send_us > now && next_send_us < earliest) earliest = next_send_us;
+        // One multiplicative decrease per window of data.
+        if (new_loss || timed_out) {
+            if (new_loss && !timed_out) cc_ops->on_loss(&cc, now);
+            for (int i = 0; i < st->flow_count; i++) st->flows[i].recovery_end = st->flows[i].next_frag;
+        }
+
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(sockfd, &fds);
+
+        struct timeval tv;
+        long long wait_us = earliest - now;
+        if (wait_us < 0) wait_us = 0;
+        tv.tv_sec = wait_us / 1000000;
+        tv.tv_usec = wait_us % 1000000;
+
+        int rv = select(sockfd + 1, &fds, NULL, NULL, &tv);
+        if (zerocopy) drain_zerocopy_completions(sockfd, &batch);
+
+        // Drain every queued ACK (and FIN_ACK), a batch at a time; they may arrive in any order.
+        int got = rv > 0 ? batch_depth : 0;
+        while (got == batch_depth) {
+            got = recvmmsg(sockfd, ack_msgs, batch_depth, MSG_DONTWAIT, NULL);
+            if (got <= 0) break;
+            long long ack_now = current_timestamp_us();
+            for (int m = 0; m < got; m++) {
+                struct pkt_header ack_hdr;
+                if (parse_header(ack_bufs[m], ack_msgs[m].msg_len, &ack_hdr) < 0) continue;
+                fl = flow_find(st, ack_hdr.transfer_id);
+                if (!fl || fl->finished) continue;
+                if (ack_hdr.type == PKT_FIN_ACK && fl->fin_sent) {
+                    if (!(ack_hdr.flags & FLAG_PENDING)) {
+                        flow_finish(st, fl, (ack_hdr.flags & FLAG_REJECT) ? 0 : 1);
+                        failed += !fl->verified;
+                        unfinished--;
+                    } else if (!fl->fin_pending) {
+                        // Still hashing: ask again once this round is over, without counting it.
+                        long long again_us = ack_now + FIN_PENDING_US;
+                        if (fl->fin_deadline_us < again_us) fl->fin_deadline_us = again_us;
+                        fl->fin_pending = 1;
+                    }
+                    continue;
+                }
+                if (ack_hdr.type != PKT_ACK) continue;
+
+                uint64_t ack_no = ack_hdr.offset / fl->frag_size + 1;
+                if (ack_no < fl->base || ack_no >= fl->next_frag) continue;
+
+                struct frag_slot *slot = &fl->slots[ack_no % window];
+                if (slot->frag_no != ack_no || slot->acked) continue;
+                slot->acked = 1;
+                inflight -= 1 + slot->parity_held;
+                slot->parity_held = 0;
+                fl->inflight--;
+                if (slot->tx_seq > max_acked_seq) max_acked_seq = slot->tx_seq;
+
+                struct cc_ack ack;
+                ack.now_us = ack_now;
+                ack.rtt_us = -1;
+                if (ack_hdr.flags & FLAG_FEC_REBUILT) {
+                    fl->fec_rebuilt++;      // Acknowledged late, after the parity, so no RTT sample
+                } else if (slot->attempts == 0) {
+                    ack.rtt_us = ack_now - slot->sent_us;
+                    rtt_sample(&rtt_est, ack.rtt_us);
+                }
+                int payload = fl->frag_size;
+                if (ack_no == fl->total_frag) payload = fl->file_size - (fl->total_frag - 1) * fl->frag_size;
+                delivered += payload;
+                ack.srtt_us = rtt_est.srtt_us;
+                ack.acked_bytes = payload;
+                ack.inflight = inflight;
+                ack.delivered = delivered;
+                ack.prior_delivered = slot->delivered;
+                ack.delivery_rate = 0;
+                if (ack_now > slot->delivered_us) {
+                    ack.delivery_rate = (double)(delivered - slot->delivered) * 1e6 /
+                                        (ack_now - slot->delivered_us);
+                }
+                delivered_us = ack_now;
+                cc_ops->on_ack(&cc, &ack);
+
+                if (verbose) {
+                    printf("[DEBUG] Received ACK for frag #%llu of '%s' (cwnd %.1f)\n", (unsigned long long)ack_no,
+                           fl->file_name,
+                           cc.cwnd);
+                }
+            }
+        }
+
+        // Anything sent DUP_THRESH transmissions before the newest ACKed one is presumed lost.
+        // With FEC the same must hold for its group's parity, which the server may still use to rebuild it.
+        // A flow whose every fragment is ACKed hands its digest to the server.
+        for (int i = 0; i < st->flow_count; i++) {
+            fl = &st->flows[i];
+            if (fl->finished || fl->fin_sent) continue;
+            for (uint64_t f = fl->base; f < fl->next_frag; f++) {
+                struct frag_slot *slot = &fl->slots[f % window];
+                if (!slot->acked && !slot->lost && slot->tx_seq + DUP_THRESH <= max_acked_seq &&
+                    !slot->fec_pending && slot->fec_seq + DUP_THRESH <= max_acked_seq) {
+                    slot->lost = 1;
+                }
+            }
+            while (fl->base < fl->next_frag && fl->slots[fl->base % window].acked) fl->base++;
+            if (fl->base > fl->total_frag) {
+                if (fl->hashing) pthread_join(fl->hasher, NULL);
+                fl->hashing = 0;
+                fl->fin_sent = 1;
+                fl->fin_timeout_us = rtt_est.rto_us;
+                flow_send_fin(st, fl);
+            }
+        }
+    }
+//////////////////////////////////////////////////////////////////////////////////////////
+
+    batch_free(&batch);
+    printf("[DEBUG] Retransmissions: %llu, final SRTT = %.3f ms, RTO = %.3f ms\n",
+           (unsigned long long)st->retransmits, rtt_est.srtt_us / 1000.0, rtt_est.rto_us / 1000.0);
+    return failed;
+}
+
+void *stream_thread(void *arg) {
+    struct stream *st = arg;
+    send_stream(st);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int window = DEFAULT_WINDOW;
+    int verbose = 0;
+    int zerocopy = 0;
+    int batch_depth = DEFAULT_BATCH;
+    int gso = 0;
+    int frag_size = 0;                // 0 = discover by probing
+    const char *file_args[MAX_FLOWS]; // -f skips the prompt; repeated, the files are multiplexed
+    int file_count = 0;
+    int fec_k = 0;                    // -e: data fragments per FEC group, 0 for no FEC
+    int fec_m = 0;
+    int fec_rs = 0;
+    int delta = 0;                    // -d: send only what differs from the server's copy of the file
+    int compress = 0;                 // -C: offer LZ4-compressed fragments
+    int streams = 1;                  // -P: parallel streams, each with its own socket and range of the file
+    const char *manifest = NULL;      // -M: send the files it lists as a bundle
+    enum flow_scheduler scheduler = FLOW_RR;    // -S: which of several files the next fragment comes from
+    double weights[MAX_FLOWS];
+    int weight_count = 0;
+    const struct cc_ops *cc_ops = cc_find("cubic");
+    int opt;
+    while ((opt = getopt(argc, argv, "w:c:zb:gs:f:e:dCP:M:S:v")) != -1) {
+        switch (opt) {
+        case 'w':
+            window = atoi(optarg);
+            break;
+        case 'c':
+            cc_ops = cc_find(optarg);
+            if (!cc_ops) {
+                fprintf(stderr, "[ERROR] Unknown congestion control '%s' (reno, cubic, bbr).\n", optarg);
+                return 1;
+            }
+            break;
+        case 'z':
+            zerocopy = 1;
+            break;
+        case 'b':
+            batch_depth = atoi(optarg);
+            break;
+        case 'g':
+            gso = 1;
+            break;
+        case 's':
+            frag_size = atoi(optarg);
+            if (frag_size < 1 || frag_size > MAX_FRAG_SIZE) {
+                fprintf(stderr, "[ERROR] Fragment size must be 1..%d bytes.\n", MAX_FRAG_SIZE);
+                return 1;
+            }
+            break;
+        case 'f':
+            if (file_count == MAX_FLOWS) {
+                fprintf(stderr, "[ERROR] At most %d files per run.\n", MAX_FLOWS);
+                return 1;
+            }
+            file_args[file_count++] = optarg;
+            break;
+        case 'e':
+            if (sscanf(optarg, "xor:%d", &fec_k) == 1) {
+                fec_m = 1;
+            } else if (sscanf(optarg, "rs:%d:%d", &fec_k, &fec_m) == 2) {
+                fec_rs = 1;
+            }
+            if (fec_k < 2 || fec_k > FEC_MAX_K || fec_m < 1 || fec_m > FEC_MAX_M) {
+                fprintf(stderr, "[ERROR] FEC must be xor:K or rs:K:M with K 2..%d and M 1..%d.\n",
+                        FEC_MAX_K, FEC_MAX_M);
+                return 1;
+            }
+            break;
+        case 'd':
+            delta = 1;
+            break;
+        case 'C':
+            compress = 1;
+            break;
+        case 'P':
+            streams = atoi(optarg);
+            if (streams < 1 || streams > MAX_STREAMS) {
+                fprintf(stderr, "[ERROR] Streams must be 1..%d.\n", MAX_STREAMS);
+                return 1;
+            }
+            break;
+        case 'M':
+            manifest = optarg;
+            break;
+        case 'S':
+            if (strcmp(optarg, "rr") == 0) {
+                scheduler = FLOW_RR;
+            } else if (strcmp(optarg, "shortest") == 0) {
+                scheduler = FLOW_SHORTEST;
+            } else if (strncmp(optarg, "weighted", 8) == 0 && (optarg[8] == '\0' || optarg[8] == ':')) {
+                // Weights go to the -f files in order; files past the last weight get 1.
+                scheduler = FLOW_WEIGHTED;
+                char *p = optarg + 8;
+                while (*p == ':' || *p == ',') {
+                    char *end;
+                    double w = strtod(p + 1, &end);
+                    if (end == p + 1 || w <= 0 || weight_count == MAX_FLOWS) {
+                        fprintf(stderr, "[ERROR] Weights must be positive numbers, at most %d.\n", MAX_FLOWS);
+                        return 1;
+                    }
+                    weights[weight_count++] = w;
+                    p = end;
+                }
+                if (*p != '\0') {
+                    fprintf(stderr, "[ERROR] Scheduler must be rr, shortest or weighted:W1,W2,...\n");
+                    return 1;
+                }
+            } else {
+                fprintf(stderr, "[ERROR] Scheduler must be rr, shortest or weighted:W1,W2,...\n");
+                return 1;
+            }
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-w window] [-c reno|cubic|bbr] [-z] [-b batch] [-g] [-s frag_size] [-f file]... [-e xor:K|rs:K:M] [-d] [-C] [-P streams] [-M manifest] [-S rr|shortest|weighted:W1,W2,...] [-v] <server IP> <server port>\n", argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, "Usage: %s [-w window] [-c reno|cubic|bbr] [-z] [-b batch] [-g] [-s frag_size] [-f file]... [-e xor:K|rs:K:M] [-d] [-C] [-P streams] [-M manifest] [-S rr|shortest|weighted:W1,W2,...] [-v] <server IP> <server port>\n", argv[0]);
+        return 1;
+    }
+    if (manifest && file_count > 1) {
+        fprintf(stderr, "[ERROR] -M bundles into a single destination, name exactly one.\n");
+        return 1;
+    }
+    if (window < 1) window = 1;
+    if (window > MAX_WINDOW) window = MAX_WINDOW;
+    if (batch_depth < 1) batch_depth = 1;
+    if (batch_depth > MAX_BATCH) batch_depth = MAX_BATCH;
+    if (fec_k > window) fec_k = window;    // A group's slots must all still be in the window
+
+    const char *server_ip = argv[optind];
+    int port = atoi(argv[optind + 1]);
+
+    int sockfd = open_socket();
+    if (sockfd < 0) {
+        perror("[ERROR] socket creation failed");
+        return 1;
+    }
+    printf("[DEBUG] Socket created successfully. sockfd=%d\n", sockfd);
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+
+    if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0) {
+        perror("[ERROR] inet_pton failed");
+        close(sockfd);
+        return 1;
+    }
+
+    printf("[DEBUG] Ready to send to server: %s:%d\n", server_ip, port);
+
+    char buffer[BUFFER_SIZE];
+    if (!file_count) {
+        printf("Enter a command (ftp <filename>): ");
+        if (!fgets(buffer, BUFFER_SIZE, stdin)) {
+            fprintf(stderr, "[ERROR] Reading user input failed\n");
+            close(sockfd);
+            return 1;
+        }
+        buffer[strcspn(buffer, "\n")] = '\0';
+
+        if (strncmp(buffer, "ftp ", 4) != 0) {
+            fprintf(stderr, "[ERROR] Invalid command. Must be 'ftp <filename>'.\n");
+            close(sockfd);
+            return 1;
+        }
+        file_args[file_count++] = buffer + 4;
+    }
+
+    // Each file (a directory, or the files a manifest lists, go as one bundle the server unpacks into that name).
+    struct flow *items = calloc(file_count, sizeof(struct flow));
+    if (!items) {
+        perror("[ERROR] calloc (files) failed");
+        close(sockfd);
+        return 1;
+    }
+    int loaded = 0;
+    while (loaded < file_count && flow_load(&items[loaded], file_args[loaded], manifest, delta) == 0) loaded++;
+    if (loaded < file_count) {
+        for (int i = 0; i < loaded; i++) flow_unload(&items[i]);
+        free(items);
+        close(sockfd);
+        return 1;
+    }
+
+    // Any value works as long as concurrent senders are unlikely to collide.
+    struct timeval seed;
+    gettimeofday(&seed, NULL);
+    uint32_t transfer_id = (uint32_t)(seed.tv_sec ^ (seed.tv_usec << 12) ^ (getpid() << 20));
+
+    if (frag_size == 0) {
+        frag_size = probe_frag_size(sockfd, &server_addr, transfer_id);
+        printf("[DEBUG] Path probing chose %d-byte fragments.\n", frag_size);
+    }
+
+    if (file_count > 1 && streams > 1) {
+        printf("[DEBUG] -P splits a single file, multiplexing the %d files over one stream.\n", file_count);
+        streams = 1;
+    }
+    if (items[0].delta && streams > 1) {
+        printf("[DEBUG] -d diffs the file as a whole, sending it as one stream.\n");
+        streams = 1;
+    }
+    if (items[0].bundle && streams > 1) {
+        printf("[DEBUG] A bundle is unpacked once it is verified as a whole, sending it as one stream.\n");
+        streams = 1;
+    }
+    // Streams split the fragments between them, so only the last range can end in a short one.
+    uint64_t file_size = items[0].file_size;
+    uint64_t frags = (file_size + frag_size - 1) / frag_size;
+    if ((uint64_t)streams > frags) streams = frags > 0 ? frags : 1;
+
+    crc32c_init();
+    if (fec_k) gf_init();
+
+    struct stream *st = calloc(streams, sizeof(struct stream));
+    struct flow *ranges = streams > 1 ? calloc(streams, sizeof(struct flow)) : NULL;
+    if (!st || (streams > 1 && !ranges)) {
+        perror("[ERROR] calloc (streams) failed");
+        free(st);
+        for (int i = 0; i < file_count; i++) flow_unload(&items[i]);
+        free(items);
+        close(sockfd);
+        return 1;
+    }
+    // Several files are flows of one stream, under consecutive transfer IDs; -P ranges of one file are one
+    // flow per stream, all under the same transfer ID.
+    for (int i = 0; i < file_count; i++) {
+        items[i].transfer_id = transfer_id + i;
+        items[i].frag_size = frag_size;
+        if (i < weight_count) items[i].weight = weights[i];
+    }
+    for (int i = 0; streams > 1 && i < streams; i++) {
+        uint64_t first = frags * i / streams * frag_size;
+        uint64_t end = i + 1 < streams ? frags * (i + 1) / streams * frag_size : file_size;
+        ranges[i] = items[0];
+        ranges[i].file_map = items[0].file_map ? items[0].file_map + first : NULL;
+        ranges[i].file_size = end - first;
+        ranges[i].range_offset = first;
+        ranges[i].ranged = 1;
+    }
+    int opened = 1;
+    for (int i = 0; i < streams; i++) {
+        st[i].index = i;
+        st[i].count = streams;
+        st[i].sockfd = i ? open_socket() : sockfd;
+        st[i].server_addr = &server_addr;
+        st[i].flows = streams > 1 ? &ranges[i] : items;
+        st[i].flow_count = streams > 1 ? 1 : file_count;
+        st[i].window = window;
+        st[i].verbose = verbose;
+        st[i].zerocopy = zerocopy;
+        st[i].batch_depth = batch_depth;
+        st[i].gso = gso;
+        st[i].fec_k = fec_k;
+        st[i].fec_m = fec_m;
+        st[i].fec_rs = fec_rs;
+        st[i].compress = compress;
+        st[i].scheduler = scheduler;
+        st[i].cc_ops = cc_ops;
+        if (st[i].sockfd < 0) {
+            perror("[ERROR] socket creation failed");
+            break;
+        }
+        opened = i + 1;
+    }
+
+    long long started = current_timestamp_us();
+    int failed = 0;
+    if (opened == streams && streams == 1) {
+        failed = send_stream(&st[0]);
+    } else if (opened == streams) {
+        printf("[DEBUG] Sending in %d parallel streams of about %llu bytes.\n", streams,
+               (unsigned long long)ranges[0].file_size);
+        pthread_t threads[MAX_STREAMS];
+        int running[MAX_STREAMS];
+        for (int i = 0; i < streams; i++) {
+            running[i] = pthread_create(&threads[i], NULL, stream_thread, &st[i]) == 0;
+            if (!running[i]) {
+                perror("[ERROR] pthread_create (stream) failed");
+                break;
+            }
+        }
+        for (int i = 0; i < streams && running[i]; i++) pthread_join(threads[i], NULL);
+    } else {
+        failed = streams;
+    }
+
+    unsigned long long sent = 0;
+    for (int i = 0; i < streams; i++) {
+        for (int f = 0; streams > 1 && f < st[i].flow_count; f++) failed += st[i].flows[f].verified != 1;
+        sent += st[i].sent;
+        if (i && i < opened) close(st[i].sockfd);
+    }
+    if (streams > 1 && !failed) {
+        printf("[DEBUG] File transfer completed: %d streams sent %llu fragments in %.1f ms, every range verified.\n",
+               streams, sent, (current_timestamp_us() - started) / 1000.0);
+    } else if (streams > 1) {
+        fprintf(stderr, "[ERROR] %d of %d streams failed.\n", failed, streams);
+    } else if (file_count > 1 && !failed) {
+        printf("[DEBUG] File transfer completed: %d files sent %llu fragments in %.1f ms, every file verified.\n",
+               file_count, sent, (current_timestamp_us() - started) / 1000.0);
+    } else if (file_count > 1) {
+        fprintf(stderr, "[ERROR] %d of %d files failed.\n", failed, file_count);
+    }
+    free(st);
+    free(ranges);
+    for (int i = 0; i < file_count; i++) flow_unload(&items[i]);
+    free(items);
+    close(sockfd);
+    return failed ? 1 : 0;
+}
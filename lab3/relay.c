@@ -0,0 +1,698 @@
+// Xiaoyi Dong & Sihao Liu March 6, 2025
+/*
+Functionality:
+UDP impairment relay that sits between deliver and server on one box to emulate a WAN path.
+deliver sends to the relay's listen port; every client address gets its own upstream socket towards the server,
+so the server still sees one source port per client. Replies from the server go back out of the listen socket.
+Each direction is impaired independently: -f for client->server (DATA, SETUP, PROBE) and -r for server->client
+(ACKs and the other replies), which lets ACK loss and asymmetric paths be modeled.
+An impairment spec is a comma-separated list such as loss=0.01,delay=20,jitter=5,reorder=0.05,dup=0.01,rate=1000
+(times in ms, rate in Mbit/s), or @file to read the same keys from a file; run with -h for every key.
+Loss is Bernoulli or Gilbert-Elliott, the rate cap serializes packets onto a link with a bounded tail-drop queue,
+and randomness comes from a seedable xoshiro256** PRNG per direction, so runs are reproducible.
+
+Highlights:
+Datagrams are read with recvmmsg() and written with sendmmsg(), -b sets the batch depth.
+Held packets live in a hashed timing wheel of WHEEL_SLOTS slots of TICK_US each (later deadlines wrap around
+with a round count), so scheduling is O(1) per packet; a timerfd wakes the epoll loop on the next tick while
+anything is held. Packet buffers up to POOL_BUF_LEN bytes are recycled through a free list.
+Counters for both directions are printed on SIGINT/SIGTERM.
+Build: gcc relay.c -o relay
+*/
+
+#define _GNU_SOURCE     // sendmmsg/recvmmsg
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#define MAX_PACKET_LEN  65536
+#define DEFAULT_BATCH   32
+#define MAX_BATCH       256
+#define MAX_EVENTS      64
+#define SOCKET_BUF_BYTES (8 * 1024 * 1024)
+
+#define CLIENT_BUCKETS  1024     // Power of two
+#define CLIENT_IDLE_US  60000000 // Close upstream sockets of clients that went silent
+#define SWEEP_EVERY_US  1000000
+
+#define TICK_US         50
+#define WHEEL_BITS      13
+#define WHEEL_SLOTS     (1 << WHEEL_BITS)  // 8192 slots of 50 us cover about 410 ms per round
+#define POOL_BUF_LEN    2048
+
+#define IMPAIR_QUEUE_US 100000   // Default backlog the rate cap queues before tail-dropping
+#define IMPAIR_GAP_US   1000     // Default extra hold of a reordered packet
+
+// Impairment settings of one direction.
+struct impairment {
+    double loss;                 // Bernoulli loss probability
+    int gilbert;                 // Use the two-state Gilbert-Elliott model instead
+    double ge_p;                 // P(good -> bad) per packet
+    double ge_r;                 // P(bad -> good) per packet
+    double ge_loss_good;
+    double ge_loss_bad;
+    long long delay_us;
+    long long jitter_us;         // Delay varies uniformly within +-jitter_us
+    double reorder;              // Probability a packet is held back an extra reorder_us
+    long long reorder_us;
+    double dup;                  // Probability a packet is delivered twice
+    double rate_bps;             // 0 for no rate cap
+    long long queue_us;          // Backlog allowed behind the rate cap
+    uint64_t seed;
+};
+
+// xoshiro256** state.
+struct rng {
+    uint64_t s[4];
+};
+
+// One direction of the emulated path.
+struct link {
+    const char *name;
+    struct impairment imp;
+    struct rng rng;
+    int ge_bad;
+    long long link_free_us;      // When the rate-capped link finishes its backlog
+    unsigned long long received;
+    unsigned long long lost;
+    unsigned long long queue_drops;
+    unsigned long long duplicated;
+    unsigned long long sent;
+};
+
+// One client of the relay and the socket that carries its traffic to the server.
+struct client {
+    struct sockaddr_in addr;
+    int upfd;
+    long long last_active_us;
+    struct client *next;
+};
+
+// A packet on its way out, either in the timing wheel or in the free list.
+struct packet {
+    struct packet *next;
+    int fd;                      // Socket to send it from
+    struct sockaddr_in to;       // Destination, unused for connected upstream sockets
+    int connected;
+    unsigned int rounds;         // Wheel revolutions left before it is due
+    int len;
+    int cap;
+    char data[];
+};
+
+struct wheel_slot {
+    struct packet *head;
+    struct packet *tail;
+};
+
+struct timing_wheel {
+    struct wheel_slot slots[WHEEL_SLOTS];
+    long long tick;              // Last tick processed
+    int held;
+};
+
+// Datagrams queued for sendmmsg(); consecutive entries for the same socket go out in one call.
+struct send_batch {
+    int count;
+    int fds[MAX_BATCH];
+    struct mmsghdr msgs[MAX_BATCH];
+    struct iovec iov[MAX_BATCH];
+    struct packet *pkts[MAX_BATCH];
+};
+
+struct relay {
+    int listenfd;
+    int timerfd;
+    int epfd;
+    int batch_depth;
+    int verbose;
+    struct sockaddr_in server;
+    struct link forward;         // client -> server
+    struct link reverse;         // server -> client
+    struct client *clients[CLIENT_BUCKETS];
+    int client_count;
+    struct timing_wheel wheel;
+    struct send_batch out;
+    struct packet *pool;
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+
+void on_signal(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+long long current_timestamp_us() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+void rng_seed(struct rng *r, uint64_t seed) {
+    for (int i = 0; i < 4; i++) r->s[i] = splitmix64(&seed);
+}
+
+uint64_t rng_next(struct rng *r) {
+    uint64_t *s = r->s;
+    uint64_t x = s[1] * 5;
+    uint64_t result = ((x << 7) | (x >> 57)) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = (s[3] << 45) | (s[3] >> 19);
+    return result;
+}
+
+// Uniform in [0, 1).
+double rng_uniform(struct rng *r) {
+    return (rng_next(r) >> 11) * 0x1.0p-53;
+}
+
+void usage_impairment() {
+    fprintf(stderr,
+            "Impairment keys for -f/-r (comma-separated, or @file):\n"
+            "  loss=P              Bernoulli loss probability\n"
+            "  ge=p:r[:good[:bad]] Gilbert-Elliott loss: transition probabilities good->bad and bad->good,\n"
+            "                      loss probability in each state (defaults 0 and 1)\n"
+            "  delay=MS jitter=MS  fixed delay and uniform +-jitter\n"
+            "  reorder=P[:MS]      hold a packet back an extra MS (default 1) with probability P\n"
+            "  dup=P               duplicate a packet with probability P\n"
+            "  rate=MBPS queue=MS  rate cap and the backlog it queues before dropping (default 100)\n"
+            "  seed=N              PRNG seed (default: time)\n");
+}
+
+// Parse an impairment spec into imp. Returns -1 on an unknown key or bad value.
+int parse_impairment(const char *spec, struct impairment *imp) {
+    char text[4096];
+    if (spec[0] == '@') {
+        FILE *f = fopen(spec + 1, "r");
+        if (!f) {
+            perror("[ERROR] Cannot open impairment file");
+            return -1;
+        }
+        size_t n = fread(text, 1, sizeof(text) - 1, f);
+        text[n] = '\0';
+        fclose(f);
+    } else {
+        snprintf(text, sizeof(text), "%s", spec);
+    }
+
+    memset(imp, 0, sizeof(*imp));
+    imp->reorder_us = IMPAIR_GAP_US;
+    imp->queue_us = IMPAIR_QUEUE_US;
+    imp->seed = (uint64_t)time(NULL);
+    imp->ge_loss_bad = 1.0;
+
+    char *save = NULL;
+    for (char *tok = strtok_r(text, ", \t\r\n", &save); tok; tok = strtok_r(NULL, ", \t\r\n", &save)) {
+        if (tok[0] == '#') break;
+        char *val = strchr(tok, '=');
+        if (!val) {
+            fprintf(stderr, "[ERROR] Impairment '%s' needs a value\n", tok);
+            return -1;
+        }
+        *val++ = '\0';
+        double ms;
+        if (!strcmp(tok, "loss")) {
+            imp->loss = atof(val);
+        } else if (!strcmp(tok, "ge")) {
+            imp->gilbert = 1;
+            if (sscanf(val, "%lf:%lf:%lf:%lf", &imp->ge_p, &imp->ge_r,
+                       &imp->ge_loss_good, &imp->ge_loss_bad) < 2) {
+                fprintf(stderr, "[ERROR] ge needs at least p:r\n");
+                return -1;
+            }
+        } else if (!strcmp(tok, "delay")) {
+            imp->delay_us = atof(val) * 1000;
+        } else if (!strcmp(tok, "jitter")) {
+            imp->jitter_us = atof(val) * 1000;
+        } else if (!strcmp(tok, "reorder")) {
+            ms = IMPAIR_GAP_US / 1000.0;
+            sscanf(val, "%lf:%lf", &imp->reorder, &ms);
+            imp->reorder_us = ms * 1000;
+        } else if (!strcmp(tok, "dup")) {
+            imp->dup = atof(val);
+        } else if (!strcmp(tok, "rate")) {
+            imp->rate_bps = atof(val) * 1e6;
+        } else if (!strcmp(tok, "queue")) {
+            imp->queue_us = atof(val) * 1000;
+        } else if (!strcmp(tok, "seed")) {
+            imp->seed = strtoull(val, NULL, 0);
+        } else {
+            fprintf(stderr, "[ERROR] Unknown impairment '%s'\n", tok);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+struct packet *packet_alloc(struct relay *r, int len) {
+    struct packet *p;
+    if (len <= POOL_BUF_LEN && r->pool) {
+        p = r->pool;
+        r->pool = p->next;
+        return p;
+    }
+    int cap = len <= POOL_BUF_LEN ? POOL_BUF_LEN : len;
+    p = malloc(sizeof(*p) + cap);
+    if (p) p->cap = cap;
+    return p;
+}
+
+void packet_free(struct relay *r, struct packet *p) {
+    if (p->cap == POOL_BUF_LEN) {
+        p->next = r->pool;
+        r->pool = p;
+    } else {
+        free(p);
+    }
+}
+
+// Send every queued packet, one sendmmsg() per run of entries on the same socket.
+void batch_flush(struct relay *r) {
+    struct send_batch *b = &r->out;
+    int start = 0;
+    while (start < b->count) {
+        int end = start + 1;
+        while (end < b->count && b->fds[end] == b->fds[start]) end++;
+        int done = start;
+        while (done < end) {
+            int n = sendmmsg(b->fds[start], b->msgs + done, end - done, 0);
+            if (n < 0) {
+                // ECONNREFUSED and friends surface here on connected sockets; skip the datagram.
+                if (r->verbose) perror("[DEBUG] sendmmsg failed");
+                n = 1;
+            }
+            done += n;
+        }
+        start = end;
+    }
+    for (int i = 0; i < b->count; i++) packet_free(r, b->pkts[i]);
+    b->count = 0;
+}
+
+void batch_add(struct relay *r, struct packet *p) {
+    struct send_batch *b = &r->out;
+    if (b->count == MAX_BATCH) batch_flush(r);
+    int i = b->count++;
+    b->fds[i] = p->fd;
+    b->pkts[i] = p;
+    b->iov[i].iov_base = p->data;
+    b->iov[i].iov_len = p->len;
+    memset(&b->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+    if (!p->connected) {
+        b->msgs[i].msg_hdr.msg_name = &p->to;
+        b->msgs[i].msg_hdr.msg_namelen = sizeof(p->to);
+    }
+    b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+    b->msgs[i].msg_hdr.msg_iovlen = 1;
+}
+
+// Schedule p for release at due_us, or queue it for sending right away if that is already past.
+void wheel_insert(struct relay *r, struct packet *p, long long due_us) {
+    struct timing_wheel *w = &r->wheel;
+    long long due_tick = due_us / TICK_US;
+    if (due_tick <= w->tick) {
+        batch_add(r, p);
+        return;
+    }
+    long long ahead = due_tick - w->tick - 1;
+    p->rounds = ahead >> WHEEL_BITS;
+    p->next = NULL;
+    struct wheel_slot *slot = &w->slots[due_tick & (WHEEL_SLOTS - 1)];
+    if (slot->tail) slot->tail->next = p;
+    else slot->head = p;
+    slot->tail = p;
+    w->held++;
+}
+
+// Release everything due up to now, keeping the order packets were scheduled in within a slot.
+void wheel_advance(struct relay *r, long long now) {
+    struct timing_wheel *w = &r->wheel;
+    long long now_tick = now / TICK_US;
+    if (w->held == 0) {
+        w->tick = now_tick;
+        return;
+    }
+    while (w->tick < now_tick && w->held > 0) {
+        w->tick++;
+        struct wheel_slot *slot = &w->slots[w->tick & (WHEEL_SLOTS - 1)];
+        struct packet **cur = &slot->head;
+        struct packet *last = NULL;
+        while (*cur) {
+            struct packet *p = *cur;
+            if (p->rounds > 0) {
+                p->rounds--;
+                last = p;
+                cur = &p->next;
+                continue;
+            }
+            *cur = p->next;
+            w->held--;
+            batch_add(r, p);
+        }
+        slot->tail = last;
+    }
+    w->tick = now_tick;
+}
+
+// Arm the timerfd for the next tick while anything is held, disarm it otherwise.
+void wheel_arm(struct relay *r) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (r->wheel.held > 0) its.it_value.tv_nsec = TICK_US * 1000;
+    timerfd_settime(r->timerfd, 0, &its, NULL);
+}
+
+// Apply one direction's impairment to a received datagram and schedule what survives.
+void impair(struct relay *r, struct link *l, const char *buf, int len, int fd,
+            const struct sockaddr_in *to, long long now) {
+    const struct impairment *imp = &l->imp;
+    struct rng *g = &l->rng;
+    l->received++;
+
+    int lost;
+    if (imp->gilbert) {
+        if (l->ge_bad) {
+            if (rng_uniform(g) < imp->ge_r) l->ge_bad = 0;
+        } else {
+            if (rng_uniform(g) < imp->ge_p) l->ge_bad = 1;
+        }
+        lost = rng_uniform(g) < (l->ge_bad ? imp->ge_loss_bad : imp->ge_loss_good);
+    } else {
+        lost = imp->loss > 0 && rng_uniform(g) < imp->loss;
+    }
+    if (lost) {
+        l->lost++;
+        return;
+    }
+
+    long long due_us = now;
+    if (imp->rate_bps > 0) {
+        // Serialize onto the capped link; tail-drop once its backlog exceeds queue_us.
+        if (l->link_free_us < now) l->link_free_us = now;
+        if (l->link_free_us - now > imp->queue_us) {
+            l->queue_drops++;
+            return;
+        }
+        l->link_free_us += (long long)(len * 8 * 1e6 / imp->rate_bps);
+        due_us = l->link_free_us;
+    }
+    due_us += imp->delay_us;
+    if (imp->jitter_us > 0) {
+        due_us += (long long)((2 * rng_uniform(g) - 1) * imp->jitter_us);
+    }
+    if (imp->reorder > 0 && rng_uniform(g) < imp->reorder) due_us += imp->reorder_us;
+
+    int copies = 1;
+    if (imp->dup > 0 && rng_uniform(g) < imp->dup) {
+        copies = 2;
+        l->duplicated++;
+    }
+    for (int c = 0; c < copies; c++) {
+        struct packet *p = packet_alloc(r, len);
+        if (!p) return;
+        memcpy(p->data, buf, len);
+        p->len = len;
+        p->fd = fd;
+        p->connected = to == NULL;
+        if (to) p->to = *to;
+        l->sent++;
+        wheel_insert(r, p, due_us);
+    }
+}
+
+unsigned int client_hash(const struct sockaddr_in *addr) {
+    uint64_t h = ((uint64_t)addr->sin_addr.s_addr << 16) ^ addr->sin_port;
+    h *= 0x9E3779B97F4A7C15ULL;
+    return (unsigned int)(h >> 40) & (CLIENT_BUCKETS - 1);
+}
+
+// Find the client with this address, creating it and its upstream socket on first contact.
+struct client *client_get(struct relay *r, const struct sockaddr_in *addr, long long now) {
+    struct client **bucket = &r->clients[client_hash(addr)];
+    for (struct client *c = *bucket; c; c = c->next) {
+        if (c->addr.sin_addr.s_addr == addr->sin_addr.s_addr && c->addr.sin_port == addr->sin_port) {
+            c->last_active_us = now;
+            return c;
+        }
+    }
+
+    int upfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (upfd < 0) {
+        perror("[ERROR] socket (upstream) failed");
+        return NULL;
+    }
+    int sock_buf = SOCKET_BUF_BYTES;
+    setsockopt(upfd, SOL_SOCKET, SO_RCVBUF, &sock_buf, sizeof(sock_buf));
+    setsockopt(upfd, SOL_SOCKET, SO_SNDBUF, &sock_buf, sizeof(sock_buf));
+    if (connect(upfd, (struct sockaddr*)&r->server, sizeof(r->server)) < 0) {
+        perror("[ERROR] connect (upstream) failed");
+        close(upfd);
+        return NULL;
+    }
+
+    struct client *c = calloc(1, sizeof(*c));
+    if (!c) {
+        close(upfd);
+        return NULL;
+    }
+    c->addr = *addr;
+    c->upfd = upfd;
+    c->last_active_us = now;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    epoll_ctl(r->epfd, EPOLL_CTL_ADD, upfd, &ev);
+    c->next = *bucket;
+    *bucket = c;
+    r->client_count++;
+    if (r->verbose) {
+        printf("[DEBUG] New client %s:%d, %d active.\n",
+               inet_ntoa(addr->sin_addr), ntohs(addr->sin_port), r->client_count);
+    }
+    return c;
+}
+
+// Close upstream sockets of clients that have been silent in both directions. Called with the send
+// batch empty; anything of theirs still in the wheel would have to be delayed by over CLIENT_IDLE_US.
+void client_sweep(struct relay *r, long long now) {
+    for (int b = 0; b < CLIENT_BUCKETS; b++) {
+        struct client **cur = &r->clients[b];
+        while (*cur) {
+            struct client *c = *cur;
+            if (now - c->last_active_us <= CLIENT_IDLE_US) {
+                cur = &c->next;
+                continue;
+            }
+            *cur = c->next;
+            epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->upfd, NULL);
+            close(c->upfd);
+            free(c);
+            r->client_count--;
+        }
+    }
+}
+
+// Drain a socket with recvmmsg() and push every datagram through the link's impairment.
+void relay_drain(struct relay *r, int fd, struct client *c, char *bufs, struct mmsghdr *msgs,
+                 struct iovec *iov, struct sockaddr_in *addrs) {
+    while (1) {
+        for (int m = 0; m < r->batch_depth; m++) {
+            iov[m].iov_base = bufs + (size_t)m * MAX_PACKET_LEN;
+            iov[m].iov_len = MAX_PACKET_LEN;
+            memset(&msgs[m].msg_hdr, 0, sizeof(struct msghdr));
+            msgs[m].msg_hdr.msg_name = &addrs[m];
+            msgs[m].msg_hdr.msg_namelen = sizeof(addrs[m]);
+            msgs[m].msg_hdr.msg_iov = &iov[m];
+            msgs[m].msg_hdr.msg_iovlen = 1;
+        }
+        int got = recvmmsg(fd, msgs, r->batch_depth, MSG_DONTWAIT, NULL);
+        if (got <= 0) {
+            if (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+                errno != ECONNREFUSED) {
+                perror("[ERROR] recvmmsg failed");
+            }
+            return;
+        }
+
+        long long now = current_timestamp_us();
+        for (int m = 0; m < got; m++) {
+            char *buf = bufs + (size_t)m * MAX_PACKET_LEN;
+            int len = msgs[m].msg_len;
+            if (c) {
+                // Reply from the server, back to the client it belongs to.
+                c->last_active_us = now;
+                impair(r, &r->reverse, buf, len, r->listenfd, &c->addr, now);
+            } else {
+                struct client *from = client_get(r, &addrs[m], now);
+                if (from) impair(r, &r->forward, buf, len, from->upfd, NULL, now);
+            }
+        }
+        if (got < r->batch_depth) return;
+    }
+}
+
+void print_link(const struct link *l) {
+    printf("[DEBUG] %s: %llu received, %llu lost, %llu queue drops, %llu duplicated, %llu sent\n",
+           l->name, l->received, l->lost, l->queue_drops, l->duplicated, l->sent);
+}
+
+int main(int argc, char *argv[]) {
+    static struct relay r;
+    r.batch_depth = DEFAULT_BATCH;
+    r.forward.name = "client->server";
+    r.reverse.name = "server->client";
+    parse_impairment("", &r.forward.imp);
+    parse_impairment("", &r.reverse.imp);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:f:r:hv")) != -1) {
+        switch (opt) {
+        case 'b':
+            r.batch_depth = atoi(optarg);
+            break;
+        case 'f':
+            if (parse_impairment(optarg, &r.forward.imp) < 0) {
+                usage_impairment();
+                return 1;
+            }
+            break;
+        case 'r':
+            if (parse_impairment(optarg, &r.reverse.imp) < 0) {
+                usage_impairment();
+                return 1;
+            }
+            break;
+        case 'v':
+            r.verbose = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-b batch] [-f impairment] [-r impairment] [-v] "
+                    "<listen port> <server IP> <server port>\n", argv[0]);
+            usage_impairment();
+            return 1;
+        }
+    }
+    if (argc - optind != 3) {
+        fprintf(stderr, "Usage: %s [-b batch] [-f impairment] [-r impairment] [-v] "
+                "<listen port> <server IP> <server port>\n", argv[0]);
+        return 1;
+    }
+    if (r.batch_depth < 1) r.batch_depth = 1;
+    if (r.batch_depth > MAX_BATCH) r.batch_depth = MAX_BATCH;
+    rng_seed(&r.forward.rng, r.forward.imp.seed);
+    rng_seed(&r.reverse.rng, r.reverse.imp.seed ^ 0x5DEECE66DULL);
+
+    int port = atoi(argv[optind]);
+    memset(&r.server, 0, sizeof(r.server));
+    r.server.sin_family = AF_INET;
+    r.server.sin_port = htons(atoi(argv[optind + 2]));
+    if (inet_pton(AF_INET, argv[optind + 1], &r.server.sin_addr) <= 0) {
+        perror("[ERROR] Invalid server address");
+        return 1;
+    }
+
+    r.listenfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (r.listenfd < 0) {
+        perror("[ERROR] socket creation failed");
+        return 1;
+    }
+    int sock_buf = SOCKET_BUF_BYTES;
+    setsockopt(r.listenfd, SOL_SOCKET, SO_RCVBUF, &sock_buf, sizeof(sock_buf));
+    setsockopt(r.listenfd, SOL_SOCKET, SO_SNDBUF, &sock_buf, sizeof(sock_buf));
+
+    struct sockaddr_in listen_addr;
+    memset(&listen_addr, 0, sizeof(listen_addr));
+    listen_addr.sin_family = AF_INET;
+    listen_addr.sin_addr.s_addr = INADDR_ANY;
+    listen_addr.sin_port = htons(port);
+    if (bind(r.listenfd, (struct sockaddr*)&listen_addr, sizeof(listen_addr)) < 0) {
+        perror("[ERROR] bind failed");
+        return 1;
+    }
+
+    r.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    r.epfd = epoll_create1(0);
+    if (r.timerfd < 0 || r.epfd < 0) {
+        perror("[ERROR] timerfd/epoll creation failed");
+        return 1;
+    }
+    // data.ptr is the client for upstream sockets; NULL marks the listen socket, &r the timer.
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(r.epfd, EPOLL_CTL_ADD, r.listenfd, &ev);
+    ev.data.ptr = &r;
+    epoll_ctl(r.epfd, EPOLL_CTL_ADD, r.timerfd, &ev);
+
+    char *bufs = malloc((size_t)r.batch_depth * MAX_PACKET_LEN);
+    struct mmsghdr *msgs = calloc(r.batch_depth, sizeof(struct mmsghdr));
+    struct iovec *iov = calloc(r.batch_depth, sizeof(struct iovec));
+    struct sockaddr_in *addrs = calloc(r.batch_depth, sizeof(struct sockaddr_in));
+    if (!bufs || !msgs || !iov || !addrs) {
+        perror("[ERROR] malloc (receive buffers) failed");
+        return 1;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    printf("[DEBUG] Relaying port %d to %s:%s.\n", port, argv[optind + 1], argv[optind + 2]);
+
+    r.wheel.tick = current_timestamp_us() / TICK_US;
+    long long last_sweep_us = current_timestamp_us();
+    struct epoll_event events[MAX_EVENTS];
+    while (!stop_requested) {
+        int n = epoll_wait(r.epfd, events, MAX_EVENTS, 1000);
+        if (n < 0 && errno != EINTR) {
+            perror("[ERROR] epoll_wait failed");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &r) {
+                uint64_t expirations;
+                if (read(r.timerfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+                    perror("[ERROR] read (timerfd) failed");
+                }
+            } else if (ptr == NULL) {
+                relay_drain(&r, r.listenfd, NULL, bufs, msgs, iov, addrs);
+            } else {
+                struct client *c = ptr;
+                relay_drain(&r, c->upfd, c, bufs, msgs, iov, addrs);
+            }
+        }
+
+        long long now = current_timestamp_us();
+        wheel_advance(&r, now);
+        batch_flush(&r);
+        wheel_arm(&r);
+
+        if (now - last_sweep_us > SWEEP_EVERY_US) {
+            client_sweep(&r, now);
+            last_sweep_us = now;
+        }
+    }
+
+    print_link(&r.forward);
+    print_link(&r.reverse);
+    return 0;
+}
@@ -1,49 +1,2693 @@
 // Xiaoyi Dong & Sihao Liu March 6, 2025
 /*
 Functionality:
-Connects to a TCP server and provides a command-line chat interface.
-Supports commands like /login, /logout, /joinsession, /createsession, /list, etc.
-Maintains client session state, pending session info, and handles user interactions.
-Starts a separate thread to asynchronously receive server messages.
+Receives files over UDP from any number of deliver clients at once.
+A transfer starts with a SETUP packet naming the file; the server opens it and replies SETUP_ACK
+(or SETUP_ACK with FLAG_REJECT if the file cannot be created).
+Per-transfer state lives in a hash table keyed by (peer address, transfer ID), driven by an event loop;
+finished transfers linger for DONE_LINGER_US to re-ACK stray retransmissions, silent ones expire after IDLE_TIMEOUT_US.
+The fragment size proposed in SETUP is clamped to MAX_FRAG_SIZE and returned in SETUP_ACK;
+PROBE packets (used by the sender for path MTU discovery) are echoed statelessly with PROBE_ACK.
+Every DATA fragment is written at its byte offset with pwrite() and ACKed individually, so fragments may arrive
+in any order; a bitmap of received fragments drops duplicates (e.g. resent after a lost ACK) before any disk I/O.
+Disk writes happen off the network path: each receive loop copies payloads into pooled buffers of a lock-free
+single-producer/single-consumer ring drained by its own writer thread, and ACKs a fragment once it is queued.
+A full ring drops the fragment unACKed, so a slow disk shows up to the sender as backpressure, not as stalled ACKs.
+-m instead preallocates each output file with fallocate() and maps it: the header of every datagram is peeked,
+then recvmsg() scatters it into a small header buffer and the payload directly to its final offset in the mapping,
+so DATA skips both the userspace copy and the writer ring (this mode receives one datagram per call, without GRO).
+FEC: when SETUP announces parity groups (K data fragments, M XOR or Reed-Solomon parities), recent groups are
+cached and a group that has lost fragments is rebuilt as soon as enough of its K + M fragments have arrived;
+rebuilt fragments are stored like received ones and ACKed with FLAG_FEC_REBUILT, saving the sender a round trip.
+Resume: when SETUP carries a file identity the server keeps <file>.journal, a header naming that identity followed
+by the received bitmap. It is checkpointed every sweep through the writer ring, after an fdatasync() of the output,
+so it never claims a fragment that is not on disk, written once more when a transfer is abandoned and deleted when
+the file is complete. A SETUP for the same file, size, fragment size and identity reloads it, keeps the partial
+output and answers SETUP_ACK with FLAG_RESUME; the sender then pulls the bitmap with BITMAP requests and only sends
+what is missing. Anything that does not match starts over with a fresh file and journal.
+Delta: a SETUP with FLAG_DELTA for a file that already exists makes it the basis. Its signature (rsync's weak
+rolling checksum plus a MurmurHash3 128-bit strong hash per block of about sqrt(size) bytes) is built on a
+thread of its own, with SETUP answered FLAG_PENDING until it is ready. It is served through SIGNATURE requests,
+and COPY records then have the writer copy matched stretches from the basis (copy_file_range()). The new version
+is built in <file>.delta and renamed over the old one only once verified; delta transfers are not journaled.
+Integrity: DATA fragments carry a CRC32C of header and payload (SSE4.2 or ARMv8 CRC instructions, else
+slicing-by-8 tables); one that fails it is dropped unACKed and resent like a lost one. The writer thread also
+reads the output back as its complete prefix grows and streams it through MurmurHash3 x64_128, so the
+whole-file digest is ready moments after the last write without the receive loop ever touching it. The sender
+ends with FIN carrying its own digest; FIN_ACK reports a match (journal deleted, delta output renamed in place),
+a mismatch (FLAG_REJECT, both discarded) or FLAG_PENDING while the writer is still hashing.
+Parallel streams: a SETUP with FLAG_RANGE covers only range_length bytes of the file from range_offset, and its
+fragment offsets count from there. Each stream of one deliver run comes from its own port, so it is a transfer of
+its own (possibly on another -t shard) that shares the transfer ID; all of them open the same output without
+truncating it, size and preallocate it to the whole file and write, map and digest only their own range.
+Bundles: a SETUP with FLAG_BUNDLE is received into <file>.bundle, which starts with a manifest of paths, modes,
+sizes and offsets. Once FIN verifies it the writer hands it to a background thread that checks every path stays
+inside directory <file>, creates the directories and then the files with UNPACK_THREADS workers copying their
+bytes out (copy_file_range()), and deletes the bundle. Everything is created relative to <file> without following
+symlinks already in it, and without setuid, setgid or sticky bits.
+Compression: a SETUP with FLAG_LZ is accepted with FLAG_LZ echoed; DATA carrying it holds one LZ4 block, which is
+bounds-checked and expanded straight into the ring slot (or the mapping with -m) and must fill the fragment exactly.
+-i <spec> impairs incoming DATA and PARITY to exercise the sender's recovery and congestion control (off by default,
+and then never touched): Bernoulli or Gilbert-Elliott loss, fixed and jittered delay, reordering, duplication,
+single-bit payload corruption and a rate cap with a bounded queue, driven by a seedable xoshiro256** PRNG per
+shard. <spec> is a comma-separated list such as loss=0.01,delay=20,jitter=5,reorder=0.05,dup=0.01,rate=100,seed=7
+(times in ms, rate in Mbit/s), or @file to read the same keys from a file; see usage_impairment() for every key.
+Large and sparse files: offsets, sizes and fragment counts are 64-bit (journal format 2 stores a 64-bit count).
+A SETUP with FLAG_SPARSE has its output only sized, never preallocated, and COPY records with the COPY_HOLE basis
+offset are queued to the writer, which punches holes over whatever an earlier version left there (or writes
+zeros where that is not supported).
 
 Highlights:
-Uses strtok() to parse command arguments, with validation checks.
-Structured message format sent as: <type>:<size>:<source>:<data>\n.
-Session state managed via global variables with proper resets on logout.
-Warning messages standardized using [warning]: prefix for clarity.
+Binary packet format: fixed 24-byte struct pkt_header (version, type, flags, transfer ID, 64-bit offset, length)
+followed by the payload; the filename travels only once, in the SETUP body.
+Datagrams are received with recvmmsg() and replies go out with sendmmsg(), -b sets the batch depth.
+-g enables UDP GRO and splits coalesced datagrams back into fragments.
+-t N runs N receive loops on their own threads, each with its own SO_REUSEPORT socket and transfer table.
+The kernel steers every flow to one socket by its 4-tuple hash, so shards own disjoint transfers and share no locks.
+SIGINT/SIGTERM stop the receive loops, close every open transfer and let the writers drain before exiting,
+so everything ACKed is on disk when the process ends.
+Reed-Solomon decoding inverts a Cauchy submatrix over GF(2^8) and runs the same split-nibble multiply-add kernels
+as deliver (AVX2, SSSE3 or NEON, picked at startup, with a table-driven fallback).
+Build: gcc server.c -o server -pthread
 */
 
+#define _GNU_SOURCE     // sendmmsg/recvmmsg
+#define _FILE_OFFSET_BITS 64    // Files past 2GB on 32-bit builds too
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <endian.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <netinet/udp.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#define MAX_NAME_LEN    1024
+#define MAX_PACKET_LEN  65536    // One max-size UDP payload, which is also the largest GRO datagram
+#define MAX_DATAGRAM    65507
+#define MAX_FRAG_SIZE   (MAX_DATAGRAM - HEADER_LEN)
+#define DEFAULT_BATCH   32
+#define MAX_BATCH       256
+#define SOCKET_BUF_BYTES (8 * 1024 * 1024)
+
+#define TABLE_BUCKETS   1024     // Power of two
+#define DONE_LINGER_US  30000000 // Keep finished transfers to re-ACK stray retransmissions
+#define IDLE_TIMEOUT_US 60000000 // Abandon transfers whose sender went silent
+#define SWEEP_EVERY_US  1000000
+#define MAX_THREADS     64
+#define RING_SLOTS      1024     // Queued disk writes per shard, power of two
+#define WRITER_SPINS    64       // Empty polls before the writer starts sleeping
+#define WRITER_NAP_NS   50000
+#define IMPAIR_QUEUE_US 100000   // Default backlog the rate cap queues before tail-dropping
+#define IMPAIR_GAP_US   1000     // Default extra hold of a reordered packet
+#define JOURNAL_SUFFIX  ".journal"
+#define JOURNAL_MAGIC   "UDPJRNL2"    // 2: 64-bit received count
+#define TABLE_CHUNK     1024     // Largest BITMAP/SIGNATURE reply payload, keeps it within one Ethernet frame
+#define DELTA_SUFFIX    ".delta"
+#define BUNDLE_SUFFIX   ".bundle"
+#define BUNDLE_MAGIC    "UDPBNDL1"
+#define BUNDLE_MAX_PATH 4096
+#define UNPACK_THREADS  8        // Files of a bundle created and filled in parallel
+#define DELTA_MIN_BLOCK 1024     // Signature block size bounds; sqrt(size) in between
+#define DELTA_MAX_BLOCK 65536
+#define SIG_ENTRY_LEN   20       // Weak checksum (4 bytes) and 128-bit strong hash per block
+#define MURMUR_C1       0x87C37B91114253D5ULL
+#define MURMUR_C2       0x4CF5AD432745937FULL
+#define COPY_RECORD_LEN 24       // New offset, old offset and length, 8 bytes each
+#define COPY_PIECE      (16 * 1024 * 1024)   // Largest single queued copy
+#define ZERO_PIECE      (1024 * 1024 * 1024) // Largest single queued hole, a punch is cheap but zeros are not
+#define COPY_HOLE       UINT64_MAX           // COPY record source offset of a hole, which reads as zeros
+#define DIGEST_STEP     (4 * 1024 * 1024)    // Output bytes read back and hashed per queued digest step
+#define CRC_LANE        4096     // Bytes per interleaved CRC32C stream
+
+#ifndef UDP_GRO
+#define UDP_GRO         104
+#endif
+
+#define PROTO_VERSION   1
+
+#define PKT_SETUP       1
+#define PKT_SETUP_ACK   2
+#define PKT_DATA        3
+#define PKT_ACK         4
+#define PKT_PROBE       5
+#define PKT_PROBE_ACK   6
+#define PKT_PARITY      7        // FEC parity of the group starting at offset; reserved = parity index
+#define PKT_BITMAP      8        // Received bitmap bytes from offset; reserved = bytes wanted in the request
+#define PKT_SIGNATURE   9        // Delta signature bytes from offset, requested like BITMAP
+#define PKT_COPY        10       // Delta copy records numbered from offset; ACKed with an empty COPY
+#define PKT_FIN         11       // Sender's whole-file digest, 16 bytes, once every fragment is ACKed
+#define PKT_FIN_ACK     12       // Verdict on FIN: FLAG_REJECT for a mismatch, FLAG_PENDING while still hashing
+
+#define FLAG_REJECT     0x0001
+#define FLAG_FEC_RS     0x0002   // SETUP, PARITY: Reed-Solomon rather than XOR parity
+#define FLAG_FEC_REBUILT 0x0004  // ACK: the server rebuilt this fragment from parity
+#define FLAG_RESUME     0x0008   // SETUP_ACK: part of the file is already on disk, fetch the bitmap
+#define FLAG_DELTA      0x0010   // SETUP: diff against the server's copy; SETUP_ACK: its signature is ready
+#define FLAG_CRC        0x0020   // DATA: reserved holds the fragment's CRC32C
+#define FLAG_PENDING    0x0040   // FIN_ACK: the output is still being read back and hashed, ask again;
+                                 // SETUP_ACK: the delta signature is still being built
+#define FLAG_LZ         0x0080   // SETUP, SETUP_ACK: LZ4 fragments offered/accepted; DATA: payload is one LZ4 block
+#define FLAG_RANGE      0x0100   // SETUP: one stream of a parallel transfer, sending only range_length bytes
+#define FLAG_BUNDLE     0x0200   // SETUP: the file is a bundle of many, unpack it into a directory of this name
+#define FLAG_SPARSE     0x0400   // SETUP: the file has holes, sent as COPY_HOLE records, so it is not preallocated
+
+#define FEC_MAX_K       64
+#define FEC_MAX_M       16
+#define FEC_CACHE_BYTES (32 * 1024 * 1024)   // Per transfer, bounds how many groups are kept
+#define FEC_MAX_GROUPS  256
+
+// Fixed-size header at the start of every datagram. All fields are big-endian on the wire.
+struct pkt_header {
+    uint8_t  version;
+    uint8_t  type;
+    uint16_t flags;
+    uint32_t transfer_id;
+    uint64_t offset;             // Byte offset of the payload within the file
+    uint32_t length;             // Payload bytes following the header
+    uint32_t reserved;
+};
+
+// Body of a SETUP packet; the filename (name_len bytes, no NUL) follows it.
+struct setup_body {
+    uint64_t file_size;
+    uint32_t frag_size;
+    uint16_t name_len;
+    uint16_t fec;                // FEC group size K << 8 | parity count M, 0 for none
+    uint64_t file_id;            // Identity of the sender's file for resuming, 0 for no journal
+    uint64_t range_offset;       // With FLAG_RANGE: the part of the file this stream sends, offsets are relative
+    uint64_t range_length;
+};
+
+// Body of SETUP_ACK: the fragment size the server accepted.
+struct setup_ack_body {
+    uint32_t frag_size;
+    uint32_t delta_block;        // Signature block size (with FLAG_DELTA)
+    uint64_t resumed;            // Fragments already on disk (with FLAG_RESUME)
+    uint64_t delta_blocks;       // Signature entries (with FLAG_DELTA)
+};
+
+// Start of a bundle: a manifest of entries records, each followed by its path, then the files' bytes.
+struct bundle_header {
+    char magic[8];
+    uint32_t entries;
+    uint32_t manifest_len;       // Bytes of entry records and paths after this header
+};
+
+// One file or directory of a bundle; path_len bytes of relative path (no NUL) follow it.
+struct bundle_entry {
+    uint64_t offset;             // Where the file's bytes start in the bundle
+    uint64_t size;
+    uint32_t mode;               // st_mode: S_IFREG or S_IFDIR and permission bits
+    uint16_t path_len;
+    uint16_t reserved;
+};
+
+// Start of a receive journal; the transfer's received bitmap follows it.
+struct journal_header {
+    char magic[8];
+    uint64_t file_id;
+    uint64_t file_size;
+    uint32_t frag_size;
+    uint32_t reserved;
+    uint64_t received_count;
+};
+
+#define HEADER_LEN      ((int)sizeof(struct pkt_header))
+
+// Incremental MurmurHash3 x64_128 state.
+struct murmur3 {
+    uint64_t h1, h2;
+    uint64_t len;
+    uint8_t tail[16];
+    int tail_len;
+};
+
+// Whole-file digest of a transfer's output, read back from disk and hashed by the writer thread as the
+// complete prefix of the file grows. ready is released once result holds the digest of the whole file.
+struct file_digest {
+    struct murmur3 hash;
+    atomic_int ready;
+    uint64_t result[2];
+};
+
+// Replies (SETUP_ACK and ACK) queued for one sendmmsg() call.
+struct reply_batch {
+    int count;
+    struct mmsghdr msgs[MAX_BATCH];
+    struct iovec iov[MAX_BATCH][2];
+    struct pkt_header hdrs[MAX_BATCH];
+    struct setup_ack_body bodies[MAX_BATCH];
+    struct sockaddr_in addrs[MAX_BATCH];
+};
+
+// One cached FEC group: the fragments seen so far, zero-padded to frag_size.
+struct fec_group {
+    long long index;             // Group number, -1 while the slot is unused
+    int k;                       // Data fragments in the group; the last group may be short
+    int complete;                // Every data fragment is known
+    int data_have;
+    int parity_have;
+    uint64_t data_mask;
+    uint32_t parity_mask;
+    uint8_t *data;               // k * frag_size
+    uint8_t *parity;             // m * frag_size
+};
+
+// Receive-side state of one transfer, chained in a transfer_table bucket.
+// A delta basis's signature, built on a thread of its own so that a large basis does not hold up the shard.
+// Shared by the transfer and that thread; whichever lets go last frees it.
+struct signature_job {
+    int fd;                      // The basis, through a descriptor of its own
+    uint32_t block;
+    uint64_t blocks;
+    uint8_t *sig;                // blocks entries of SIG_ENTRY_LEN bytes
+    atomic_int state;            // 0 while hashing, 1 once sig is complete, -1 if the basis could not be read
+    atomic_int refs;
+};
+
+struct transfer {
+    struct sockaddr_in peer;
+    uint32_t id;
+    int done;
+    int fd;
+    char *map;                   // Whole output file (or range) when mapped (-m), else NULL
+    uint64_t *received;          // Bitmap of fragments already queued for disk
+    uint64_t file_size;          // Bytes this transfer carries: the file, or one stream's range of it
+    uint64_t range_offset;       // Where those bytes go in the output, 0 unless FLAG_RANGE
+    uint32_t frag_size;
+    uint64_t total_frag;
+    uint64_t received_count;
+    uint64_t duplicates;
+    uint64_t reordered;
+    uint64_t ring_full;          // Fragments dropped because the writer was behind
+    uint64_t highest_index;
+    int fec_k;                   // 0 when the sender sends no parity
+    int fec_m;
+    int fec_rs;
+    int fec_slots;
+    struct fec_group *fec;       // Ring of recent groups, indexed by group % fec_slots
+    uint8_t *fec_pool;
+    uint64_t fec_rebuilt;
+    uint64_t file_id;
+    int journal_fd;              // -1 without a journal
+    uint64_t journal_count;      // received_count at the last checkpoint
+    uint64_t resumed;            // Fragments found on disk at SETUP
+    int basis_fd;                // Delta: the existing copy being diffed against, -1 otherwise
+    uint64_t basis_size;
+    uint32_t delta_block;
+    uint64_t delta_blocks;
+    struct signature_job *sig_job;
+    uint8_t *signature;          // sig_job's signature once it is complete, NULL before
+    uint64_t copied_bytes;       // Delta: bytes taken from the basis instead of the network
+    uint64_t hole_bytes;         // Sparse: bytes left as holes instead of received
+    int sparse;                  // The sender's file has holes, the output is not preallocated
+    int delta;                   // Output goes to <file>.delta until it is verified
+    int bundle;                  // Output goes to <file>.bundle, unpacked into directory <file> once verified
+    struct file_digest *digest;  // Shared with the writer thread, which also frees it
+    uint64_t digest_next;        // Every fragment before this one is received
+    uint64_t digest_queued;      // Every fragment before this one is queued for hashing
+    int verified;                // Outcome of FIN: 1 digest matched, -1 it did not, 0 not asked yet
+    uint64_t crc_errors;         // DATA fragments dropped for a bad CRC32C
+    int compress;                // The sender may send LZ4-compressed fragments
+    uint64_t lz_fragments;       // Fragments that arrived compressed, with their wire and expanded bytes
+    uint64_t lz_bytes;
+    uint64_t lz_raw_bytes;
+    long long last_active_us;
+    char filename[MAX_NAME_LEN + 1];
+    struct transfer *next;
+};
+
+struct transfer_table {
+    struct transfer *buckets[TABLE_BUCKETS];
+    int count;
+};
+
+enum write_op {
+    WRITE_DATA,                  // Write length bytes of buf at offset
+    WRITE_COPY,                  // Copy length bytes at src_offset of src_fd to offset (delta transfers)
+    WRITE_ZERO,                  // Make length bytes at offset read as zeros (holes of a sparse file)
+    WRITE_CLOSE,                 // Close fd once earlier operations on it are done
+    WRITE_RENAME,                // Rename buf = "from\0to\0" (a finished delta transfer)
+    WRITE_UNPACK,                // Unpack bundle buf = "bundle\0directory\0" (a finished bundle transfer)
+    WRITE_DIGEST,                // Read back length bytes of fd at offset and add them to digest
+    WRITE_DIGEST_END,            // Finish digest and mark it ready
+    WRITE_DIGEST_FREE,           // Free digest, nothing queued after this uses it
+};
+
+// One queued disk operation.
+struct write_req {
+    enum write_op op;
+    int fd;
+    int sync_fd;                 // WRITE_DATA: fdatasync() this file first (journal checkpoints), -1 for none
+    int src_fd;
+    uint64_t src_offset;
+    struct file_digest *digest;
+    uint64_t offset;
+    uint32_t length;
+    uint32_t capacity;           // Size of buf, which is reused by whatever lands in this slot next
+    char *buf;
+};
+
+// SPSC ring between a receive loop (producer) and its writer thread (consumer).
+// head and tail only ever grow; each index is written by one side and read with acquire by the other.
+struct write_ring {
+    struct write_req slots[RING_SLOTS];
+    _Alignas(64) atomic_uint head;   // Next slot the producer fills
+    _Alignas(64) atomic_uint tail;   // Next slot the consumer drains
+    _Alignas(64) atomic_uint write_errors;
+    atomic_int stop;                 // Set once the producer is gone; the writer exits when drained
+};
+
+// Impairment settings from -i; read-only once the shards start.
+struct impairment {
+    double loss;                 // Bernoulli loss probability
+    int gilbert;                 // Use the two-state Gilbert-Elliott model instead
+    double ge_p;                 // P(good -> bad) per packet
+    double ge_r;                 // P(bad -> good) per packet
+    double ge_loss_good;
+    double ge_loss_bad;
+    long long delay_us;
+    long long jitter_us;         // Delay varies uniformly within +-jitter_us
+    double reorder;              // Probability a packet is held back an extra reorder_us
+    long long reorder_us;
+    double dup;                  // Probability a packet is delivered twice
+    double corrupt;              // Probability one payload bit of a DATA packet is flipped
+    double rate_bps;             // 0 for no rate cap
+    long long queue_us;          // Backlog allowed behind the rate cap
+    uint64_t seed;
+};
+
+// xoshiro256** state.
+struct rng {
+    uint64_t s[4];
+};
+
+// A datagram held back by the impairment layer until release_us.
+struct held_packet {
+    long long release_us;
+    uint64_t seq;                // Ties keep arrival order
+    struct sockaddr_in from;
+    int len;
+    char *data;
+};
+
+// Everything one receive loop (shard) owns; only its write ring is shared, with its own writer thread.
+struct receiver {
+    int shard;
+    int sockfd;
+    int verbose;
+    int batch_depth;
+    int map_output;              // -m: receive payloads straight into mapped output files
+    const struct impairment *imp;    // NULL unless -i was given
+    struct rng rng;
+    int ge_bad;
+    long long link_free_us;          // When the rate-capped link finishes its backlog
+    struct held_packet *held;        // Min-heap on (release_us, seq)
+    int held_count;
+    int held_cap;
+    uint64_t held_seq;
+    struct transfer_table table;
+    struct reply_batch replies;
+    struct write_ring *ring;
+    pthread_t writer;
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+
+void on_signal(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+// GF(2^8) arithmetic (polynomial 0x11D) for Reed-Solomon parity.
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static void (*gf_mul_add_region)(uint8_t *dst, const uint8_t *src, uint8_t c, int len);
+
+uint8_t gf_mul(uint8_t a, uint8_t b) {
+    if (a == 0 || b == 0) return 0;
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+uint8_t gf_inv(uint8_t a) {
+    return gf_exp[255 - gf_log[a]];
+}
+
+// Cauchy coefficient of data fragment i in parity fragment j: 1 / (x_j + y_i) with x_j = FEC_MAX_K + j, y_i = i.
+// Any k rows of [identity; Cauchy] are invertible, so any k of the k + m fragments rebuild the group.
+uint8_t fec_coef(int j, int i) {
+    return gf_inv((uint8_t)((FEC_MAX_K + j) ^ i));
+}
+
+void xor_region(uint8_t *dst, const uint8_t *src, int len) {
+    int i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a ^= b;
+        memcpy(dst + i, &a, 8);
+    }
+    for (; i < len; i++) dst[i] ^= src[i];
+}
+
+// Split-nibble product tables: c * x = lo[x & 15] ^ hi[x >> 4].
+void gf_nibble_tables(uint8_t c, uint8_t *lo, uint8_t *hi) {
+    for (int x = 0; x < 16; x++) {
+        lo[x] = gf_mul(c, x);
+        hi[x] = gf_mul(c, x << 4);
+    }
+}
+
+// dst ^= c * src, one byte at a time.
+void gf_mul_add_scalar(uint8_t *dst, const uint8_t *src, uint8_t c, int len) {
+    uint8_t lo[16], hi[16];
+    gf_nibble_tables(c, lo, hi);
+    for (int i = 0; i < len; i++) dst[i] ^= lo[src[i] & 15] ^ hi[src[i] >> 4];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// 16 (SSSE3) or 32 (AVX2) bytes per step, the nibble tables looked up with pshufb.
+__attribute__((target("ssse3")))
+void gf_mul_add_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c, int len) {
+    uint8_t lo[16], hi[16];
+    gf_nibble_tables(c, lo, hi);
+    __m128i tlo = _mm_loadu_si128((const __m128i *)lo);
+    __m128i thi = _mm_loadu_si128((const __m128i *)hi);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    int i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i p = _mm_xor_si128(_mm_shuffle_epi8(tlo, _mm_and_si128(s, mask)),
+                                  _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, p));
+    }
+    for (; i < len; i++) dst[i] ^= lo[src[i] & 15] ^ hi[src[i] >> 4];
+}
+
+__attribute__((target("avx2")))
+void gf_mul_add_avx2(uint8_t *dst, const uint8_t *src, uint8_t c, int len) {
+    uint8_t lo[16], hi[16];
+    gf_nibble_tables(c, lo, hi);
+    __m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+    __m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+    int i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i p = _mm256_xor_si256(_mm256_shuffle_epi8(tlo, _mm256_and_si256(s, mask)),
+                                     _mm256_shuffle_epi8(thi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, p));
+    }
+    for (; i < len; i++) dst[i] ^= lo[src[i] & 15] ^ hi[src[i] >> 4];
+}
+#elif defined(__aarch64__)
+void gf_mul_add_neon(uint8_t *dst, const uint8_t *src, uint8_t c, int len) {
+    uint8_t lo[16], hi[16];
+    gf_nibble_tables(c, lo, hi);
+    uint8x16_t tlo = vld1q_u8(lo), thi = vld1q_u8(hi), mask = vdupq_n_u8(0x0f);
+    int i = 0;
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t s = vld1q_u8(src + i);
+        uint8x16_t p = veorq_u8(vqtbl1q_u8(tlo, vandq_u8(s, mask)), vqtbl1q_u8(thi, vshrq_n_u8(s, 4)));
+        vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), p));
+    }
+    for (; i < len; i++) dst[i] ^= lo[src[i] & 15] ^ hi[src[i] >> 4];
+}
+#endif
+
+// Build the log/exp tables and pick the widest multiply-add kernel this CPU runs.
+void gf_init() {
+    int x = 1;
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & 0x100) x ^= 0x11D;
+    }
+    for (int i = 255; i < 512; i++) gf_exp[i] = gf_exp[i - 255];
+
+    gf_mul_add_region = gf_mul_add_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) gf_mul_add_region = gf_mul_add_avx2;
+    else if (__builtin_cpu_supports("ssse3")) gf_mul_add_region = gf_mul_add_ssse3;
+#elif defined(__aarch64__)
+    gf_mul_add_region = gf_mul_add_neon;
+#endif
+}
+
+// CRC32C (Castagnoli), the per-fragment checksum: SSE4.2 or ARMv8 CRC instructions when the CPU has them,
+// otherwise slicing-by-8 tables. The instructions have a few cycles of latency, so large buffers run as three
+// interleaved CRC_LANE streams whose results are joined with precomputed "append zeros" tables.
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_shift_table[2][4][256];   // Register after CRC_LANE, or 2 * CRC_LANE, zero bytes
+static uint32_t (*crc32c)(uint32_t crc, const void *data, size_t len);
+
+uint32_t crc32c_sw(uint32_t crc, const void *data, size_t len) {
+    const uint8_t *p = data;
+    crc = ~crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        v = le64toh(v) ^ crc;
+        crc = crc32c_table[7][v & 0xff] ^ crc32c_table[6][(v >> 8) & 0xff] ^
+              crc32c_table[5][(v >> 16) & 0xff] ^ crc32c_table[4][(v >> 24) & 0xff] ^
+              crc32c_table[3][(v >> 32) & 0xff] ^ crc32c_table[2][(v >> 40) & 0xff] ^
+              crc32c_table[1][(v >> 48) & 0xff] ^ crc32c_table[0][v >> 56];
+    }
+    while (len--) crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+// The CRC register after (which + 1) * CRC_LANE more zero bytes; linear, so four byte lookups.
+uint32_t crc32c_shift(int which, uint32_t crc) {
+    const uint32_t (*t)[256] = crc32c_shift_table[which];
+    return t[0][crc & 0xff] ^ t[1][(crc >> 8) & 0xff] ^ t[2][(crc >> 16) & 0xff] ^ t[3][crc >> 24];
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const void *data, size_t len) {
+    const uint8_t *p = data;
+    uint64_t c0 = ~crc;
+    for (; len >= 3 * CRC_LANE; p += 3 * CRC_LANE, len -= 3 * CRC_LANE) {
+        uint64_t c1 = 0, c2 = 0;
+        for (int i = 0; i < CRC_LANE; i += 8) {
+            uint64_t v0, v1, v2;
+            memcpy(&v0, p + i, 8);
+            memcpy(&v1, p + CRC_LANE + i, 8);
+            memcpy(&v2, p + 2 * CRC_LANE + i, 8);
+            c0 = _mm_crc32_u64(c0, v0);
+            c1 = _mm_crc32_u64(c1, v1);
+            c2 = _mm_crc32_u64(c2, v2);
+        }
+        c0 = crc32c_shift(1, c0) ^ crc32c_shift(0, c1) ^ c2;
+    }
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c0 = _mm_crc32_u64(c0, v);
+    }
+    while (len--) c0 = _mm_crc32_u8((uint32_t)c0, *p++);
+    return ~(uint32_t)c0;
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+uint32_t crc32c_armv8(uint32_t crc, const void *data, size_t len) {
+    const uint8_t *p = data;
+    uint32_t c0 = ~crc;
+    for (; len >= 3 * CRC_LANE; p += 3 * CRC_LANE, len -= 3 * CRC_LANE) {
+        uint32_t c1 = 0, c2 = 0;
+        for (int i = 0; i < CRC_LANE; i += 8) {
+            uint64_t v0, v1, v2;
+            memcpy(&v0, p + i, 8);
+            memcpy(&v1, p + CRC_LANE + i, 8);
+            memcpy(&v2, p + 2 * CRC_LANE + i, 8);
+            c0 = __crc32cd(c0, v0);
+            c1 = __crc32cd(c1, v1);
+            c2 = __crc32cd(c2, v2);
+        }
+        c0 = crc32c_shift(1, c0) ^ crc32c_shift(0, c1) ^ c2;
+    }
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c0 = __crc32cd(c0, v);
+    }
+    while (len--) c0 = __crc32cb(c0, *p++);
+    return ~c0;
+}
+#endif
+
+void crc32c_init() {
+    for (int i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c >> 1) ^ (c & 1 ? 0x82F63B78 : 0);
+        crc32c_table[0][i] = c;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            crc32c_table[t][i] = (crc32c_table[t - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[t - 1][i] & 0xff];
+        }
+    }
+    // Shift tables from the 32 single-bit registers run through CRC_LANE and 2 * CRC_LANE zero bytes.
+    for (int w = 0; w < 2; w++) {
+        uint32_t bit[32];
+        for (int b = 0; b < 32; b++) {
+            uint32_t c = (uint32_t)1 << b;
+            for (int n = 0; n < (w + 1) * CRC_LANE; n++) c = crc32c_table[0][c & 0xff] ^ (c >> 8);
+            bit[b] = c;
+        }
+        for (int k = 0; k < 4; k++) {
+            for (int v = 0; v < 256; v++) {
+                uint32_t c = 0;
+                for (int j = 0; j < 8; j++) {
+                    if (v >> j & 1) c ^= bit[8 * k + j];
+                }
+                crc32c_shift_table[w][k][v] = c;
+            }
+        }
+    }
+    crc32c = crc32c_sw;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) crc32c = crc32c_sse42;
+#elif defined(__aarch64__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) crc32c = crc32c_armv8;
+#endif
+}
+
+uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xFF51AFD7ED558CCDULL;
+    k ^= k >> 33;
+    k *= 0xC4CEB9FE1A85EC53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+// MurmurHash3 x64_128 (seed 0), fed incrementally: the strong hash of delta signature blocks and the
+// whole-file digest. Any split of the input gives the same result as hashing it in one piece.
+void murmur3_mix(uint64_t *h1, uint64_t *h2, const uint8_t *block, int last) {
+    uint64_t k[2];
+    memcpy(k, block, 16);
+    *h1 ^= rotl64(le64toh(k[0]) * MURMUR_C1, 31) * MURMUR_C2;
+    if (!last) *h1 = (rotl64(*h1, 27) + *h2) * 5 + 0x52DCE729;
+    *h2 ^= rotl64(le64toh(k[1]) * MURMUR_C2, 33) * MURMUR_C1;
+    if (!last) *h2 = (rotl64(*h2, 31) + *h1) * 5 + 0x38495AB5;
+}
+
+void murmur3_init(struct murmur3 *m) {
+    memset(m, 0, sizeof(*m));
+}
+
+void murmur3_update(struct murmur3 *m, const uint8_t *data, size_t len) {
+    m->len += len;
+    if (m->tail_len) {
+        size_t take = 16 - (size_t)m->tail_len;
+        if (take > len) take = len;
+        memcpy(m->tail + m->tail_len, data, take);
+        m->tail_len += take;
+        data += take;
+        len -= take;
+        if (m->tail_len < 16) return;
+        murmur3_mix(&m->h1, &m->h2, m->tail, 0);
+        m->tail_len = 0;
+    }
+    for (; len >= 16; data += 16, len -= 16) murmur3_mix(&m->h1, &m->h2, data, 0);
+    memcpy(m->tail, data, len);
+    m->tail_len = len;
+}
+
+void murmur3_final(struct murmur3 *m, uint64_t out[2]) {
+    uint64_t h1 = m->h1, h2 = m->h2;
+    if (m->tail_len) {
+        // The reference tail switch is the same as mixing a zero-padded block without the rotations.
+        memset(m->tail + m->tail_len, 0, 16 - m->tail_len);
+        murmur3_mix(&h1, &h2, m->tail, 1);
+    }
+    h1 ^= m->len;
+    h2 ^= m->len;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    out[0] = h1;
+    out[1] = h2;
+}
+
+void murmur3_128(const uint8_t *data, size_t len, uint64_t out[2]) {
+    struct murmur3 m;
+    murmur3_init(&m);
+    murmur3_update(&m, data, len);
+    murmur3_final(&m, out);
+}
+
+// Decode one LZ4 block (the format of the reference lz4 library, no frame) into dst, which it must fill
+// exactly. Every length and offset is checked, so a damaged block fails rather than writing out of bounds.
+// Returns 0, or -1 for a malformed block.
+int lz4_decompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t raw) {
+    const uint8_t *ip = src, *iend = src + len;
+    uint8_t *op = dst, *oend = dst + raw;
+    while (ip < iend) {
+        int token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            int b;
+            do {
+                if (ip == iend) return -1;
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) break;          // The last sequence is literals only
+        if (iend - ip < 2) return -1;
+        size_t off = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (off == 0 || off > (size_t)(op - dst)) return -1;
+        size_t match = (token & 15) + 4;
+        if ((token & 15) == 15) {
+            int b;
+            do {
+                if (ip == iend) return -1;
+                b = *ip++;
+                match += b;
+            } while (b == 255);
+        }
+        if (match > (size_t)(oend - op)) return -1;
+        const uint8_t *ref = op - off;
+        if (off >= match) {
+            memcpy(op, ref, match);
+            op += match;
+        } else {
+            // Overlapping copy: a run repeating the last off bytes.
+            while (match--) *op++ = *ref++;
+        }
+    }
+    return op == oend ? 0 : -1;
+}
+
+long long current_timestamp_us() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// One bit per fragment.
+uint64_t *bitmap_alloc(uint64_t bits) {
+    return calloc((bits + 63) / 64 + 1, sizeof(uint64_t));
+}
+
+int bitmap_test(const uint64_t *map, uint64_t bit) {
+    return (map[bit / 64] >> (bit % 64)) & 1;
+}
+
+void bitmap_set(uint64_t *map, uint64_t bit) {
+    map[bit / 64] |= (uint64_t)1 << (bit % 64);
+}
+
+// Bits [first, last) a word at a time: count the set ones, or set them all and count those that were clear.
+// A COPY_HOLE record of a large sparse file covers millions of fragments.
+uint64_t bitmap_range(uint64_t *map, uint64_t first, uint64_t last, int set) {
+    uint64_t count = 0;
+    while (first < last) {
+        uint64_t n = 64 - first % 64 < last - first ? 64 - first % 64 : last - first;
+        uint64_t mask = (n == 64 ? ~(uint64_t)0 : ((uint64_t)1 << n) - 1) << (first % 64);
+        count += __builtin_popcountll((set ? ~map[first / 64] : map[first / 64]) & mask);
+        if (set) map[first / 64] |= mask;
+        first += n;
+    }
+    return count;
+}
+
+// Producer side: the next free slot, or NULL if the writer has fallen RING_SLOTS behind.
+struct write_req *ring_reserve(struct write_ring *ring) {
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == RING_SLOTS) return NULL;
+    return &ring->slots[head & (RING_SLOTS - 1)];
+}
+
+// Producer side: hand the reserved slot to the writer.
+void ring_commit(struct write_ring *ring) {
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Queue a copy of one fragment for the writer. Returns -1 if the ring is full.
+int ring_push_write(struct write_ring *ring, int fd, uint64_t offset, const char *payload, uint32_t length) {
+    struct write_req *req = ring_reserve(ring);
+    if (!req) return -1;
+    if (req->capacity < length) {
+        char *buf = realloc(req->buf, length);
+        if (!buf) return -1;
+        req->buf = buf;
+        req->capacity = length;
+    }
+    memcpy(req->buf, payload, length);
+    req->op = WRITE_DATA;
+    req->fd = fd;
+    req->sync_fd = -1;
+    req->offset = offset;
+    req->length = length;
+    ring_commit(ring);
+    return 0;
+}
+
+// Queue a fragment that arrived LZ4-compressed, decompressing it straight into the slot's buffer so it is
+// copied only once. Returns -1 if the ring is full, -2 if it does not decompress to exactly raw bytes.
+// *stored is set to the decompressed bytes, valid until the next push.
+int ring_push_decompress(struct write_ring *ring, int fd, uint64_t offset, const char *payload, uint32_t length,
+                         uint32_t raw, const char **stored) {
+    struct write_req *req = ring_reserve(ring);
+    if (!req) return -1;
+    if (req->capacity < raw) {
+        char *buf = realloc(req->buf, raw);
+        if (!buf) return -1;
+        req->buf = buf;
+        req->capacity = raw;
+    }
+    if (lz4_decompress((const uint8_t *)payload, length, (uint8_t *)req->buf, raw) < 0) return -2;
+    req->op = WRITE_DATA;
+    req->fd = fd;
+    req->sync_fd = -1;
+    req->offset = offset;
+    req->length = raw;
+    ring_commit(ring);
+    *stored = req->buf;
+    return 0;
+}
+
+// Queue closing fd behind its pending writes. Must not be lost, so wait for room.
+void ring_push_close(struct write_ring *ring, int fd) {
+    struct write_req *req;
+    while (!(req = ring_reserve(ring))) sched_yield();
+    req->op = WRITE_CLOSE;
+    req->fd = fd;
+    req->length = 0;
+    ring_commit(ring);
+}
+
+// Queue a copy of length bytes from src_fd to fd. Returns -1 if the ring is full.
+int ring_push_copy(struct write_ring *ring, int fd, uint64_t offset, int src_fd, uint64_t src_offset,
+                   uint32_t length) {
+    struct write_req *req = ring_reserve(ring);
+    if (!req) return -1;
+    req->op = WRITE_COPY;
+    req->fd = fd;
+    req->src_fd = src_fd;
+    req->src_offset = src_offset;
+    req->offset = offset;
+    req->length = length;
+    ring_commit(ring);
+    return 0;
+}
+
+// Queue zeroing length bytes of fd at offset. Returns -1 if the ring is full.
+int ring_push_zero(struct write_ring *ring, int fd, uint64_t offset, uint32_t length) {
+    struct write_req *req = ring_reserve(ring);
+    if (!req) return -1;
+    req->op = WRITE_ZERO;
+    req->fd = fd;
+    req->offset = offset;
+    req->length = length;
+    ring_commit(ring);
+    return 0;
+}
+
+// Queue an operation on two paths (WRITE_RENAME from to to, WRITE_UNPACK bundle from into directory to) behind
+// everything queued before. Must not be lost, so wait for room.
+void ring_push_paths(struct write_ring *ring, enum write_op op, const char *from, const char *to) {
+    struct write_req *req;
+    while (!(req = ring_reserve(ring))) sched_yield();
+    uint32_t length = strlen(from) + strlen(to) + 2;
+    if (req->capacity < length) {
+        char *buf = realloc(req->buf, length);
+        if (!buf) {
+            perror("[ERROR] realloc (paths) failed");
+            return;
+        }
+        req->buf = buf;
+        req->capacity = length;
+    }
+    strcpy(req->buf, from);
+    strcpy(req->buf + strlen(from) + 1, to);
+    req->op = op;
+    req->length = length;
+    ring_commit(ring);
+}
+
+// Queue a journal checkpoint: header and bitmap, written once data_fd is synced so that everything the
+// bitmap claims is on disk first. Returns -1 if the ring is full, unless wait is set.
+int ring_push_journal(struct write_ring *ring, int journal_fd, int data_fd, const struct journal_header *jh,
+                      const uint64_t *bitmap, uint32_t bitmap_bytes, int wait) {
+    struct write_req *req;
+    while (!(req = ring_reserve(ring))) {
+        if (!wait) return -1;
+        sched_yield();
+    }
+    uint32_t length = sizeof(*jh) + bitmap_bytes;
+    if (req->capacity < length) {
+        char *buf = realloc(req->buf, length);
+        if (!buf) return -1;
+        req->buf = buf;
+        req->capacity = length;
+    }
+    memcpy(req->buf, jh, sizeof(*jh));
+    memcpy(req->buf + sizeof(*jh), bitmap, bitmap_bytes);
+    req->op = WRITE_DATA;
+    req->fd = journal_fd;
+    req->sync_fd = data_fd;
+    req->offset = 0;
+    req->length = length;
+    ring_commit(ring);
+    return 0;
+}
+
+// Queue a digest operation on fd (see enum write_op). Returns -1 if the ring is full, unless wait is set.
+int ring_push_digest(struct write_ring *ring, enum write_op op, struct file_digest *digest, int fd,
+                     uint64_t offset, uint32_t length, int wait) {
+    struct write_req *req;
+    while (!(req = ring_reserve(ring))) {
+        if (!wait) return -1;
+        sched_yield();
+    }
+    req->op = op;
+    req->fd = fd;
+    req->digest = digest;
+    req->offset = offset;
+    req->length = length;
+    ring_commit(ring);
+    return 0;
+}
+
+// Read length bytes at offset of fd back and add them to digest. Returns -1 on a read error.
+int digest_range(struct file_digest *digest, int fd, uint64_t offset, uint32_t length) {
+    uint8_t buf[65536];
+    uint32_t done = 0;
+    while (done < length) {
+        uint32_t want = length - done < sizeof(buf) ? length - done : sizeof(buf);
+        ssize_t n = pread(fd, buf, want, offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        murmur3_update(&digest->hash, buf, n);
+        done += n;
+    }
+    return 0;
+}
+
+// Make length bytes of the output at offset read as zeros: deallocate them, or write zeros where the file
+// system cannot punch holes. An output that was just created is all hole already, but a resumed or shared one
+// may hold older data there.
+int zero_range(int fd, uint64_t offset, uint64_t length) {
+    if (length == 0 || fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0) return 0;
+    static const char zeros[65536];
+    for (uint64_t done = 0; done < length;) {
+        size_t want = length - done < sizeof(zeros) ? length - done : sizeof(zeros);
+        ssize_t n = pwrite(fd, zeros, want, offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+// Copy length bytes between files, in the kernel where the filesystem allows it. Returns -1 on error.
+int copy_range(int src_fd, uint64_t src_offset, int fd, uint64_t offset, uint32_t length) {
+    loff_t in = src_offset, out = offset;
+    uint32_t done = 0;
+    while (done < length) {
+        ssize_t n = copy_file_range(src_fd, &in, fd, &out, length - done, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    // Older kernels and some filesystem pairs refuse copy_file_range(), fall back to reading and writing.
+    char buf[65536];
+    while (done < length) {
+        uint32_t want = length - done < sizeof(buf) ? length - done : sizeof(buf);
+        ssize_t n = pread(src_fd, buf, want, src_offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        ssize_t w = 0;
+        while (w < n) {
+            ssize_t m = pwrite(fd, buf + w, n - w, offset + done + w);
+            if (m < 0 && errno == EINTR) continue;
+            if (m <= 0) return -1;
+            w += m;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// A verified bundle being unpacked into its directory.
+struct unpack_job {
+    char bundle[MAX_NAME_LEN + sizeof(JOURNAL_SUFFIX)];
+    char dest[MAX_NAME_LEN + 1];
+    int fd;
+    int dir_fd;                  // dest, everything is created relative to it
+    uint8_t *manifest;
+    uint32_t entries;
+    uint32_t *entry_at;          // Offset of each entry record in manifest
+    unsigned int files;
+    uint64_t bytes;
+    atomic_uint next;            // Next entry for a worker to claim
+    atomic_uint failed;
+};
+
+// A bundle path must stay inside its directory: relative, without empty, "." or ".." components.
+int bundle_path_ok(const char *path, int len) {
+    if (len == 0 || len > BUNDLE_MAX_PATH || path[0] == '/' || memchr(path, '\0', len)) return 0;
+    for (int start = 0; start <= len;) {
+        int end = start;
+        while (end < len && path[end] != '/') end++;
+        int n = end - start;
+        if (n == 0 || (n == 1 && path[start] == '.') || (n == 2 && path[start] == '.' && path[start + 1] == '.')) {
+            return 0;
+        }
+        start = end + 1;
+    }
+    return 1;
+}
+
+// Entry i of a loaded manifest in host order, and its path relative to the destination.
+void unpack_entry(const struct unpack_job *job, uint32_t i, struct bundle_entry *e, char *path) {
+    memcpy(e, job->manifest + job->entry_at[i], sizeof(*e));
+    e->offset = be64toh(e->offset);
+    e->size = be64toh(e->size);
+    e->mode = ntohl(e->mode);
+    e->path_len = ntohs(e->path_len);
+    snprintf(path, BUNDLE_MAX_PATH + 1, "%.*s", e->path_len,
+             (const char *)job->manifest + job->entry_at[i] + sizeof(*e));
+}
+
+// Read and check a finished bundle's manifest. Returns NULL, with the bundle left in place, if it is unusable.
+struct unpack_job *unpack_load(const char *bundle, const char *dest) {
+    struct unpack_job *job = calloc(1, sizeof(*job));
+    if (!job) return NULL;
+    snprintf(job->bundle, sizeof(job->bundle), "%s", bundle);
+    snprintf(job->dest, sizeof(job->dest), "%s", dest);
+    job->fd = open(bundle, O_RDONLY);
+    struct stat st;
+    struct bundle_header bh;
+    int ok = job->fd >= 0 && fstat(job->fd, &st) == 0 && pread(job->fd, &bh, sizeof(bh), 0) == sizeof(bh) &&
+             memcmp(bh.magic, BUNDLE_MAGIC, sizeof(bh.magic)) == 0 &&
+             ntohl(bh.manifest_len) <= (uint64_t)st.st_size - sizeof(bh);
+    uint32_t len = ok ? ntohl(bh.manifest_len) : 0;
+    job->entries = ok ? ntohl(bh.entries) : 0;
+    ok = ok && job->entries <= len / sizeof(struct bundle_entry);
+    if (ok) {
+        job->manifest = malloc(len ? len : 1);
+        job->entry_at = malloc(((size_t)job->entries + 1) * sizeof(uint32_t));
+        ok = job->manifest && job->entry_at && pread(job->fd, job->manifest, len, sizeof(bh)) == (ssize_t)len;
+    }
+    uint32_t at = 0;
+    for (uint32_t i = 0; ok && i < job->entries; i++) {
+        struct bundle_entry e;
+        ok = len - at >= sizeof(e);
+        if (!ok) break;
+        memcpy(&e, job->manifest + at, sizeof(e));
+        uint64_t offset = be64toh(e.offset), size = be64toh(e.size);
+        uint32_t mode = ntohl(e.mode);
+        uint16_t path_len = ntohs(e.path_len);
+        ok = path_len <= len - at - sizeof(e) &&
+             bundle_path_ok((const char *)job->manifest + at + sizeof(e), path_len) &&
+             (S_ISDIR(mode) || (S_ISREG(mode) && offset <= (uint64_t)st.st_size && size <= st.st_size - offset));
+        job->entry_at[i] = at;
+        if (S_ISREG(mode)) {
+            job->files++;
+            job->bytes += size;
+        }
+        at += sizeof(e) + path_len;
+    }
+    if (!ok) {
+        fprintf(stderr, "[ERROR] Bundle '%s' is not readable or its manifest is damaged, left in place.\n", bundle);
+    } else {
+        mkdir(dest, 0755);
+        job->dir_fd = open(dest, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        ok = job->dir_fd >= 0;
+        if (!ok) fprintf(stderr, "[ERROR] Cannot unpack into '%s': %s, bundle left in place.\n", dest, strerror(errno));
+    }
+    if (!ok) {
+        if (job->fd >= 0) close(job->fd);
+        free(job->manifest);
+        free(job->entry_at);
+        free(job);
+        return NULL;
+    }
+    return job;
+}
+
+// Open the directory that holds path, relative to dir_fd, creating the missing ones on the way if create is set.
+// Every step is opened with O_NOFOLLOW, so a symlink already in the tree cannot lead outside it.
+// Returns the directory's fd and points *leaf at the last component of path, or -1.
+int open_parent(int dir_fd, char *path, int create, char **leaf) {
+    int fd = dup(dir_fd);
+    char *name = path;
+    for (char *slash; fd >= 0 && (slash = strchr(name, '/')); name = slash + 1) {
+        *slash = '\0';
+        if (create) mkdirat(fd, name, 0755);
+        int next = openat(fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        *slash = '/';
+        close(fd);
+        fd = next;
+    }
+    *leaf = name;
+    return fd;
+}
+
+// Unpack worker: claim files one at a time, create each and copy its bytes out of the bundle.
+void *unpack_worker(void *arg) {
+    struct unpack_job *job = arg;
+    char path[BUNDLE_MAX_PATH + 1], *leaf;
+    struct bundle_entry e;
+    unsigned int i;
+    while ((i = atomic_fetch_add_explicit(&job->next, 1, memory_order_relaxed)) < job->entries) {
+        unpack_entry(job, i, &e, path);
+        if (!S_ISREG(e.mode)) continue;
+        // Whatever is already there, a symlink included, is replaced rather than written through. Special mode
+        // bits are the sender's to ask for, not to get.
+        int dir = open_parent(job->dir_fd, path, 0, &leaf), fd = -1;
+        if (dir >= 0) {
+            unlinkat(dir, leaf, 0);
+            fd = openat(dir, leaf, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, e.mode & 0777);
+        }
+        int ok = fd >= 0;
+        for (uint64_t done = 0; ok && done < e.size; done += COPY_PIECE) {
+            uint32_t piece = e.size - done < COPY_PIECE ? e.size - done : COPY_PIECE;
+            ok = copy_range(job->fd, e.offset + done, fd, done, piece) == 0;
+        }
+        int err = errno;
+        if (fd >= 0) close(fd);
+        if (dir >= 0) close(dir);
+        if (!ok) {
+            fprintf(stderr, "[ERROR] Unpacking '%s/%s' failed: %s\n", job->dest, path, strerror(err));
+            atomic_fetch_add_explicit(&job->failed, 1, memory_order_relaxed);
+        }
+    }
+    return NULL;
+}
+
+// Unpack a bundle on its own thread, so the writer goes on with other transfers: directories first, then the
+// files by up to UNPACK_THREADS workers. The bundle is deleted once every file is out.
+void *unpack_bundle(void *arg) {
+    struct unpack_job *job = arg;
+    long long started = current_timestamp_us();
+    char path[BUNDLE_MAX_PATH + 1], *leaf;
+    char made[BUNDLE_MAX_PATH + 1] = "";
+    struct bundle_entry e;
+    for (uint32_t i = 0; i < job->entries; i++) {
+        unpack_entry(job, i, &e, path);
+        // Files come grouped by directory, so their parents are usually the ones just made.
+        char *slash = strrchr(path, '/');
+        if (!S_ISDIR(e.mode)) {
+            if (!slash) continue;
+            *slash = '\0';
+            int same = strcmp(path, made) == 0;
+            if (!same) strcpy(made, path);
+            *slash = '/';
+            if (same) continue;
+        }
+        int dir = open_parent(job->dir_fd, path, 1, &leaf);
+        if (dir < 0) continue;
+        if (S_ISDIR(e.mode)) mkdirat(dir, leaf, e.mode & 0777);
+        close(dir);
+    }
+
+    pthread_t workers[UNPACK_THREADS];
+    int count = 0;
+    while (count < UNPACK_THREADS && (unsigned int)count < job->files &&
+           pthread_create(&workers[count], NULL, unpack_worker, job) == 0) {
+        count++;
+    }
+    if (count == 0) unpack_worker(job);
+    for (int i = 0; i < count; i++) pthread_join(workers[i], NULL);
+
+    unsigned int failed = atomic_load(&job->failed);
+    if (failed) {
+        fprintf(stderr, "[ERROR] %u of %u files of bundle '%s' could not be unpacked, it is kept.\n",
+                failed, job->files, job->bundle);
+    } else {
+        unlink(job->bundle);
+        printf("[DEBUG] Unpacked %u files (%llu bytes) into '%s' with %d threads in %.1f ms.\n", job->files,
+               (unsigned long long)job->bytes, job->dest, count ? count : 1,
+               (current_timestamp_us() - started) / 1000.0);
+    }
+    close(job->fd);
+    close(job->dir_fd);
+    free(job->manifest);
+    free(job->entry_at);
+    free(job);
+    return NULL;
+}
+
+// Start unpacking a finished bundle in the background.
+void start_unpack(const char *bundle, const char *dest) {
+    struct unpack_job *job = unpack_load(bundle, dest);
+    if (!job) return;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, unpack_bundle, job) == 0) pthread_detach(thread);
+    else unpack_bundle(job);
+}
+
+// Writer thread: drain the ring in order, sleeping briefly once it has been empty for a while.
+void *writer_loop(void *arg) {
+    struct write_ring *ring = arg;
+    int idle = 0;
+    while (1) {
+        int stopping = atomic_load_explicit(&ring->stop, memory_order_acquire);
+        unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail == head) {
+            if (stopping) break;
+            if (++idle > WRITER_SPINS) {
+                struct timespec nap = { 0, WRITER_NAP_NS };
+                nanosleep(&nap, NULL);
+            }
+            continue;
+        }
+        idle = 0;
+
+        struct write_req *req = &ring->slots[tail & (RING_SLOTS - 1)];
+        if (req->op == WRITE_CLOSE) {
+            close(req->fd);
+        } else if (req->op == WRITE_RENAME) {
+            if (rename(req->buf, req->buf + strlen(req->buf) + 1) < 0) perror("[ERROR] rename failed");
+        } else if (req->op == WRITE_UNPACK) {
+            start_unpack(req->buf, req->buf + strlen(req->buf) + 1);
+        } else if (req->op == WRITE_DIGEST) {
+            if (digest_range(req->digest, req->fd, req->offset, req->length) < 0) {
+                // The digest can no longer match, which FIN reports to the sender.
+                perror("[ERROR] reading the output back for its digest failed");
+                atomic_fetch_add_explicit(&ring->write_errors, 1, memory_order_relaxed);
+            }
+        } else if (req->op == WRITE_DIGEST_END) {
+            murmur3_final(&req->digest->hash, req->digest->result);
+            atomic_store_explicit(&req->digest->ready, 1, memory_order_release);
+        } else if (req->op == WRITE_DIGEST_FREE) {
+            free(req->digest);
+        } else if (req->op == WRITE_COPY) {
+            if (copy_range(req->src_fd, req->src_offset, req->fd, req->offset, req->length) < 0) {
+                perror("[ERROR] copy from the basis file failed");
+                atomic_fetch_add_explicit(&ring->write_errors, 1, memory_order_relaxed);
+            }
+        } else if (req->op == WRITE_ZERO) {
+            if (zero_range(req->fd, req->offset, req->length) < 0) {
+                perror("[ERROR] Zeroing a hole failed");
+                atomic_fetch_add_explicit(&ring->write_errors, 1, memory_order_relaxed);
+            }
+        } else if (req->sync_fd >= 0 && fdatasync(req->sync_fd) < 0) {
+            perror("[ERROR] fdatasync failed, journal checkpoint skipped");
+        } else {
+            uint32_t done = 0;
+            while (done < req->length) {
+                ssize_t n = pwrite(req->fd, req->buf + done, req->length - done, req->offset + done);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                    // Already ACKed, so all that is left is to report it.
+                    perror("[ERROR] pwrite failed");
+                    atomic_fetch_add_explicit(&ring->write_errors, 1, memory_order_relaxed);
+                    break;
+                }
+                done += n;
+            }
+        }
+        atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+unsigned int transfer_hash(const struct sockaddr_in *peer, uint32_t id) {
+    uint64_t h = ((uint64_t)peer->sin_addr.s_addr << 16) ^ peer->sin_port ^ ((uint64_t)id << 24) ^ id;
+    h *= 0x9E3779B97F4A7C15ULL;
+    return (unsigned int)(h >> 40) & (TABLE_BUCKETS - 1);
+}
+
+struct transfer *transfer_find(struct transfer_table *table, const struct sockaddr_in *peer, uint32_t id) {
+    struct transfer *cur = table->buckets[transfer_hash(peer, id)];
+    while (cur) {
+        if (cur->id == id && cur->peer.sin_addr.s_addr == peer->sin_addr.s_addr &&
+            cur->peer.sin_port == peer->sin_port)
+            return cur;
+        cur = cur->next;
+    }
+    return NULL;
+}
+
+void transfer_insert(struct transfer_table *table, struct transfer *t) {
+    unsigned int b = transfer_hash(&t->peer, t->id);
+    t->next = table->buckets[b];
+    table->buckets[b] = t;
+    table->count++;
+}
+
+// Set up the group cache for a transfer whose SETUP asked for FEC. Returns -1 if it cannot be allocated.
+int fec_alloc(struct transfer *t, int k, int m, int rs) {
+    size_t group_bytes = (size_t)(k + m) * t->frag_size;
+    int slots = FEC_CACHE_BYTES / group_bytes;
+    if (slots < 2) slots = 2;
+    if (slots > FEC_MAX_GROUPS) slots = FEC_MAX_GROUPS;
+    t->fec = calloc(slots, sizeof(struct fec_group));
+    // One more group's worth of scratch for syndromes during a rebuild.
+    t->fec_pool = malloc((slots + 1) * group_bytes);
+    if (!t->fec || !t->fec_pool) {
+        free(t->fec);
+        free(t->fec_pool);
+        t->fec = NULL;
+        t->fec_pool = NULL;
+        return -1;
+    }
+    for (int i = 0; i < slots; i++) {
+        t->fec[i].index = -1;
+        t->fec[i].data = t->fec_pool + i * group_bytes;
+        t->fec[i].parity = t->fec[i].data + (size_t)k * t->frag_size;
+    }
+    t->fec_k = k;
+    t->fec_m = m;
+    t->fec_rs = rs;
+    t->fec_slots = slots;
+    return 0;
+}
+
+void fec_free(struct transfer *t) {
+    free(t->fec);
+    free(t->fec_pool);
+    t->fec = NULL;
+    t->fec_pool = NULL;
+    t->fec_k = 0;
+}
+
+// The cache slot of group g, claimed for it if an older group holds it; NULL if a newer one does.
+struct fec_group *fec_group_get(struct transfer *t, long long g) {
+    struct fec_group *grp = &t->fec[g % t->fec_slots];
+    if (grp->index == g) return grp;
+    if (grp->index > g) return NULL;
+    grp->index = g;
+    long long left = t->total_frag - g * t->fec_k;
+    grp->k = left < t->fec_k ? (int)left : t->fec_k;
+    grp->complete = 0;
+    grp->data_have = 0;
+    grp->parity_have = 0;
+    grp->data_mask = 0;
+    grp->parity_mask = 0;
+    return grp;
+}
+
+// Invert the n x n matrix a in place over GF(2^8). Cauchy submatrices always are invertible.
+void gf_invert_matrix(uint8_t a[FEC_MAX_M][FEC_MAX_M], uint8_t inv[FEC_MAX_M][FEC_MAX_M], int n) {
+    for (int r = 0; r < n; r++) {
+        for (int c = 0; c < n; c++) inv[r][c] = r == c;
+    }
+    for (int col = 0; col < n; col++) {
+        int pivot = col;
+        while (a[pivot][col] == 0) pivot++;
+        for (int c = 0; c < n; c++) {
+            uint8_t tmp = a[col][c]; a[col][c] = a[pivot][c]; a[pivot][c] = tmp;
+            tmp = inv[col][c]; inv[col][c] = inv[pivot][c]; inv[pivot][c] = tmp;
+        }
+        uint8_t scale = gf_inv(a[col][col]);
+        for (int c = 0; c < n; c++) {
+            a[col][c] = gf_mul(a[col][c], scale);
+            inv[col][c] = gf_mul(inv[col][c], scale);
+        }
+        for (int r = 0; r < n; r++) {
+            uint8_t f = a[r][col];
+            if (r == col || f == 0) continue;
+            for (int c = 0; c < n; c++) {
+                a[r][c] ^= gf_mul(f, a[col][c]);
+                inv[r][c] ^= gf_mul(f, inv[col][c]);
+            }
+        }
+    }
+}
+
+// Rebuild the missing data fragments of grp in place. Returns 0 once the group is complete.
+int fec_rebuild(struct transfer *t, struct fec_group *grp) {
+    int missing[FEC_MAX_M], present_parity[FEC_MAX_M];
+    int e = 0, p = 0;
+    for (int i = 0; i < grp->k; i++) {
+        if (!(grp->data_mask >> i & 1)) missing[e++] = i;
+    }
+    for (int j = 0; j < t->fec_m && p < e; j++) {
+        if (grp->parity_mask >> j & 1) present_parity[p++] = j;
+    }
+    if (e == 0 || p < e) return -1;
+
+    int len = t->frag_size;
+    if (!t->fec_rs) {
+        // Single XOR parity: the missing fragment is the parity minus everything else.
+        uint8_t *out = grp->data + (size_t)missing[0] * len;
+        memcpy(out, grp->parity, len);
+        for (int i = 0; i < grp->k; i++) {
+            if (i != missing[0]) xor_region(out, grp->data + (size_t)i * len, len);
+        }
+        return 0;
+    }
+
+    // Syndromes: each used parity with the known data fragments' contributions removed.
+    uint8_t *syn = t->fec_pool + (size_t)t->fec_slots * (t->fec_k + t->fec_m) * len;
+    uint8_t a[FEC_MAX_M][FEC_MAX_M], inv[FEC_MAX_M][FEC_MAX_M];
+    for (int r = 0; r < e; r++) {
+        uint8_t *sr = syn + (size_t)r * len;
+        memcpy(sr, grp->parity + (size_t)present_parity[r] * len, len);
+        for (int i = 0; i < grp->k; i++) {
+            if (grp->data_mask >> i & 1) {
+                gf_mul_add_region(sr, grp->data + (size_t)i * len, fec_coef(present_parity[r], i), len);
+            }
+        }
+        for (int c = 0; c < e; c++) a[r][c] = fec_coef(present_parity[r], missing[c]);
+    }
+    gf_invert_matrix(a, inv, e);
+    for (int c = 0; c < e; c++) {
+        uint8_t *out = grp->data + (size_t)missing[c] * len;
+        memset(out, 0, len);
+        for (int r = 0; r < e; r++) {
+            if (inv[c][r]) gf_mul_add_region(out, syn + (size_t)r * len, inv[c][r], len);
+        }
+    }
+    return 0;
+}
+
+// Close a transfer's output file. The writer thread closes it after any writes or journal checkpoints still
+// queued for it; a mapped file is unmapped right away, its pages are already in the page cache.
+void transfer_close_file(struct receiver *rx, struct transfer *t) {
+    if (t->map) {
+        uint64_t slack = t->range_offset % sysconf(_SC_PAGESIZE);
+        munmap(t->map - slack, t->file_size + slack);
+        t->map = NULL;
+    }
+    if (t->fd >= 0) ring_push_close(rx->ring, t->fd);
+    t->fd = -1;
+}
+
+size_t bitmap_bytes(uint64_t bits) {
+    return (bits + 63) / 64 * sizeof(uint64_t);
+}
+
+// Path of a file kept next to the output: the journal or a delta transfer's temporary output.
+void side_path(const struct transfer *t, const char *suffix, char *path) {
+    snprintf(path, MAX_NAME_LEN + sizeof(JOURNAL_SUFFIX), "%s%s", t->filename, suffix);
+}
+
+// Load the journal of an interrupted transfer of the same file into t->received.
+// Returns the number of fragments it records, or -1 if there is no matching journal.
+int64_t journal_load(struct transfer *t, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct journal_header jh;
+    ssize_t bytes = bitmap_bytes(t->total_frag);
+    int ok = pread(fd, &jh, sizeof(jh), 0) == sizeof(jh) && memcmp(jh.magic, JOURNAL_MAGIC, 8) == 0 &&
+             jh.file_id == t->file_id && jh.file_size == t->file_size && jh.frag_size == t->frag_size &&
+             pread(fd, t->received, bytes, sizeof(jh)) == bytes;
+    close(fd);
+    if (!ok) {
+        memset(t->received, 0, bytes);
+        return -1;
+    }
+    // A word at a time; bits past total_frag are cleared, so a damaged tail cannot count.
+    if (t->total_frag % 64) t->received[t->total_frag / 64] &= ((uint64_t)1 << (t->total_frag % 64)) - 1;
+    int64_t count = 0;
+    for (uint64_t w = 0; w < (t->total_frag + 63) / 64; w++) count += __builtin_popcountll(t->received[w]);
+    return count;
+}
+
+// Queue a checkpoint of t's journal if anything arrived since the last one. A checkpoint that does not fit
+// in the ring is retried at the next sweep, unless final asks to wait for room.
+void journal_checkpoint(struct receiver *rx, struct transfer *t, int final) {
+    if (t->journal_fd < 0 || t->fd < 0 || t->received_count == t->journal_count) return;
+    struct journal_header jh;
+    memset(&jh, 0, sizeof(jh));
+    memcpy(jh.magic, JOURNAL_MAGIC, sizeof(jh.magic));
+    jh.file_id = t->file_id;
+    jh.file_size = t->file_size;
+    jh.frag_size = t->frag_size;
+    jh.received_count = t->received_count;
+    if (ring_push_journal(rx->ring, t->journal_fd, t->fd, &jh, t->received, bitmap_bytes(t->total_frag),
+                          final) == 0) {
+        t->journal_count = t->received_count;
+    }
+}
+
+// Close t's journal after checkpointing it one last time. It is only deleted once FIN has verified the file.
+// Must run before transfer_close_file(), a checkpoint syncs the output file first.
+void transfer_close_journal(struct receiver *rx, struct transfer *t) {
+    if (t->journal_fd < 0) return;
+    journal_checkpoint(rx, t, 1);
+    ring_push_close(rx->ring, t->journal_fd);
+    t->journal_fd = -1;
+}
+
+// Queue the output's newly complete prefix for the writer to read back into the whole-file digest,
+// DIGEST_STEP bytes at a time and the rest once the file is complete. Waits for ring room if wait is set,
+// otherwise whatever does not fit is queued by a later call.
+void digest_advance(struct receiver *rx, struct transfer *t, int wait) {
+    if (!t->digest || t->fd < 0) return;
+    while (t->digest_next < t->total_frag && bitmap_test(t->received, t->digest_next)) {
+        // Whole words at once where they are full, as after a COPY_HOLE record.
+        if (t->digest_next % 64 == 0 && t->received[t->digest_next / 64] == ~(uint64_t)0) t->digest_next += 64;
+        else t->digest_next++;
+    }
+    uint64_t step = DIGEST_STEP / t->frag_size;
+    while (t->digest_queued < t->digest_next) {
+        uint64_t n = t->digest_next - t->digest_queued;
+        if (n > step) n = step;
+        else if (n < step && t->digest_next < t->total_frag) break;
+        uint64_t offset = t->digest_queued * t->frag_size;
+        uint64_t end = (t->digest_queued + n) * t->frag_size;
+        if (end > t->file_size) end = t->file_size;
+        if (ring_push_digest(rx->ring, WRITE_DIGEST, t->digest, t->fd, t->range_offset + offset, end - offset,
+                             wait) < 0) {
+            return;
+        }
+        t->digest_queued += n;
+    }
+}
+
+// Size the output to file_size bytes and allocate its blocks up front. The streams of a parallel transfer
+// share the file, so each one sizes it to the whole and the file may still be an older, longer version.
+// A sparse file is only sized: allocating it would fill in the holes the sender is not going to send.
+int preallocate_output(int fd, uint64_t file_size, int shared, int sparse) {
+    if ((shared || sparse) && ftruncate(fd, file_size) < 0) return -1;
+    if (!sparse && fallocate(fd, 0, 0, file_size) < 0 && ftruncate(fd, file_size) < 0) return -1;
+    return 0;
+}
+
+// Map length bytes of a preallocated output file from offset, which need not be page aligned.
+char *map_output_file(int fd, uint64_t offset, uint64_t length) {
+    uint64_t slack = offset % sysconf(_SC_PAGESIZE);
+    char *map = mmap(NULL, length + slack, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset - slack);
+    return map == MAP_FAILED ? NULL : map + slack;
+}
+
+// rsync's rolling checksum: sums a and b of the bytes, 16 bits each.
+uint32_t weak_checksum(const uint8_t *data, uint32_t len) {
+    uint32_t a = 0, b = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        a += data[i];
+        b += (len - i) * data[i];
+    }
+    return (a & 0xffff) | b << 16;
+}
+
+// About sqrt(size), as a power of two, so the signature and the matched blocks stay in proportion.
+uint32_t delta_block_size(uint64_t size) {
+    uint32_t block = DELTA_MIN_BLOCK;
+    while (block < DELTA_MAX_BLOCK && (uint64_t)block * block < size) block <<= 1;
+    return block;
+}
+
+void signature_release(struct signature_job *job) {
+    if (atomic_fetch_sub_explicit(&job->refs, 1, memory_order_acq_rel) != 1) return;
+    close(job->fd);
+    free(job->sig);
+    free(job);
+}
+
+// Signature thread: read the basis a block at a time and hash each block.
+void *signature_worker(void *arg) {
+    struct signature_job *job = arg;
+    uint8_t *buf = malloc(job->block);
+    int ok = buf != NULL;
+    for (uint64_t i = 0; ok && i < job->blocks; i++) {
+        ok = pread(job->fd, buf, job->block, (off_t)i * job->block) == (ssize_t)job->block;
+        uint32_t weak = htonl(weak_checksum(buf, job->block));
+        uint64_t strong[2];
+        murmur3_128(buf, job->block, strong);
+        strong[0] = htobe64(strong[0]);
+        strong[1] = htobe64(strong[1]);
+        memcpy(job->sig + (size_t)i * SIG_ENTRY_LEN, &weak, 4);
+        memcpy(job->sig + (size_t)i * SIG_ENTRY_LEN + 4, strong, 16);
+    }
+    free(buf);
+    atomic_store_explicit(&job->state, ok ? 1 : -1, memory_order_release);
+    signature_release(job);
+    return NULL;
+}
 
-#define BUFFER_SIZE     1024
-#define MAX_PACKET_LEN  1100
+// Set up a delta transfer against the existing copy of t's file: keep it open as the basis, start building
+// its signature and create the temporary output the new version is built in. Returns -1, leaving nothing
+// behind, if there is no usable copy.
+int delta_prepare(struct transfer *t, int mode) {
+    int fd = open(t->filename, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    uint32_t block = 0;
+    uint64_t blocks = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        block = delta_block_size(st.st_size);
+        blocks = st.st_size / block;
+    }
+    struct signature_job *job = blocks ? calloc(1, sizeof(*job)) : NULL;
+    if (job) {
+        job->sig = malloc((size_t)blocks * SIG_ENTRY_LEN);
+        job->fd = job->sig ? dup(fd) : -1;
+    }
 
-///////////////////////////////////////////////////////////
-double uniform_rand() {
-    return (double)rand() / RAND_MAX;
+    char path[MAX_NAME_LEN + sizeof(JOURNAL_SUFFIX)];
+    side_path(t, DELTA_SUFFIX, path);
+    int out = job && job->fd >= 0 ? open(path, mode | O_CREAT | O_TRUNC, 0644) : -1;
+    if (out < 0) {
+        if (job && job->fd >= 0) close(job->fd);
+        if (job) free(job->sig);
+        free(job);
+        close(fd);
+        return -1;
+    }
+    job->block = block;
+    job->blocks = blocks;
+    atomic_init(&job->state, 0);
+    atomic_init(&job->refs, 2);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, signature_worker, job) == 0) pthread_detach(thread);
+    else signature_worker(job);
+    t->fd = out;
+    t->basis_fd = fd;
+    t->basis_size = st.st_size;
+    t->delta_block = block;
+    t->sig_job = job;
+    return 0;
 }
-///////////////////////////////////////////////////////////
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <UDP listen port>\n", argv[0]);
-        return 1;
+// 1 while t's delta signature is still being built, which SETUP_ACK reports with FLAG_PENDING. Once it is
+// done it is published for SIGNATURE requests, or if the basis could not be read, the transfer goes on without
+// one and everything is sent.
+int delta_pending(struct transfer *t) {
+    if (!t->sig_job || t->signature) return 0;
+    int state = atomic_load_explicit(&t->sig_job->state, memory_order_acquire);
+    if (state == 0) return 1;
+    if (state > 0) {
+        t->signature = t->sig_job->sig;
+        t->delta_blocks = t->sig_job->blocks;
+    }
+    return 0;
+}
+
+// Stop diffing against the basis: close it behind the copies still queued from it and drop its signature.
+void delta_close_basis(struct receiver *rx, struct transfer *t) {
+    if (t->basis_fd < 0) return;
+    ring_push_close(rx->ring, t->basis_fd);
+    t->basis_fd = -1;
+    if (t->sig_job) signature_release(t->sig_job);
+    t->sig_job = NULL;
+    t->signature = NULL;
+}
+
+// End a delta transfer: a verified new version replaces the old one once everything queued before has been
+// written, anything else is discarded and the old version stays. Call after transfer_close_file().
+void transfer_finish_delta(struct receiver *rx, struct transfer *t, int verified) {
+    if (!t->delta) return;
+    delta_close_basis(rx, t);
+    char path[MAX_NAME_LEN + sizeof(JOURNAL_SUFFIX)];
+    side_path(t, DELTA_SUFFIX, path);
+    if (verified) ring_push_paths(rx->ring, WRITE_RENAME, path, t->filename);
+    else unlink(path);
+    t->delta = 0;
+}
+
+// End a bundle transfer: a verified bundle is unpacked once everything queued before has been written,
+// anything else is discarded. Call after transfer_close_file().
+void transfer_finish_bundle(struct receiver *rx, struct transfer *t, int verified) {
+    if (!t->bundle) return;
+    char path[MAX_NAME_LEN + sizeof(JOURNAL_SUFFIX)];
+    side_path(t, BUNDLE_SUFFIX, path);
+    if (verified) ring_push_paths(rx->ring, WRITE_UNPACK, path, t->filename);
+    else unlink(path);
+    t->bundle = 0;
+}
+
+// Release a transfer's resources; an unfinished or unverified file is left as it is on disk, with its journal.
+void transfer_free(struct receiver *rx, struct transfer *t) {
+    transfer_close_journal(rx, t);
+    transfer_close_file(rx, t);
+    transfer_finish_delta(rx, t, 0);
+    transfer_finish_bundle(rx, t, 0);
+    if (t->digest) ring_push_digest(rx->ring, WRITE_DIGEST_FREE, t->digest, -1, 0, 0, 1);
+    fec_free(t);
+    free(t->received);
+    free(t);
+}
+
+// Free every transfer, e.g. on shutdown.
+void table_clear(struct receiver *rx) {
+    for (int b = 0; b < TABLE_BUCKETS; b++) {
+        while (rx->table.buckets[b]) {
+            struct transfer *t = rx->table.buckets[b];
+            rx->table.buckets[b] = t->next;
+            if (!t->done) {
+                printf("[DEBUG] Transfer %08x of '%s' abandoned at shutdown (%llu/%llu fragments).\n", t->id,
+                       t->filename, (unsigned long long)t->received_count, (unsigned long long)t->total_frag);
+            }
+            transfer_free(rx, t);
+        }
+    }
+    rx->table.count = 0;
+}
+
+// Drop finished transfers past their linger time and transfers whose sender went quiet,
+// and checkpoint the journals of the others.
+void table_sweep(struct receiver *rx, long long now) {
+    struct transfer_table *table = &rx->table;
+    for (int b = 0; b < TABLE_BUCKETS; b++) {
+        struct transfer **cur = &table->buckets[b];
+        while (*cur) {
+            struct transfer *t = *cur;
+            long long idle = now - t->last_active_us;
+            if ((t->done && idle > DONE_LINGER_US) || (!t->done && idle > IDLE_TIMEOUT_US)) {
+                // transfer_free() writes the last journal checkpoint.
+                if (!t->done) {
+                    printf("[DEBUG] Transfer %08x of '%s' timed out (%llu/%llu fragments).\n", t->id,
+                           t->filename, (unsigned long long)t->received_count, (unsigned long long)t->total_frag);
+                }
+                *cur = t->next;
+                table->count--;
+                transfer_free(rx, t);
+            } else {
+                if (!t->done) {
+                    journal_checkpoint(rx, t, 0);
+                    digest_advance(rx, t, 0);
+                }
+                cur = &t->next;
+            }
+        }
+    }
+}
+
+uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+void rng_seed(struct rng *r, uint64_t seed) {
+    for (int i = 0; i < 4; i++) r->s[i] = splitmix64(&seed);
+}
+
+uint64_t rng_next(struct rng *r) {
+    uint64_t *s = r->s;
+    uint64_t x = s[1] * 5;
+    uint64_t result = ((x << 7) | (x >> 57)) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = (s[3] << 45) | (s[3] >> 19);
+    return result;
+}
+
+// Uniform in [0, 1).
+double rng_uniform(struct rng *r) {
+    return (rng_next(r) >> 11) * 0x1.0p-53;
+}
+
+// Validate and convert a received header to host byte order.
+int parse_header(const char *buf, int len, struct pkt_header *hdr) {
+    if (len < HEADER_LEN) return -1;
+    memcpy(hdr, buf, HEADER_LEN);
+    if (hdr->version != PROTO_VERSION) return -1;
+    hdr->flags = ntohs(hdr->flags);
+    hdr->transfer_id = ntohl(hdr->transfer_id);
+    hdr->offset = be64toh(hdr->offset);
+    hdr->length = ntohl(hdr->length);
+    hdr->reserved = ntohl(hdr->reserved);
+    if (hdr->length != (uint32_t)(len - HEADER_LEN)) return -1;
+    return 0;
+}
+
+// Send every queued reply with as few sendmmsg() calls as possible.
+void reply_flush(int sockfd, struct reply_batch *batch) {
+    int done = 0;
+    while (done < batch->count) {
+        int n = sendmmsg(sockfd, batch->msgs + done, batch->count - done, 0);
+        if (n < 0) {
+            perror("[ERROR] sendmmsg (ACK) failed");
+            break;
+        }
+        done += n;
+    }
+    batch->count = 0;
+}
+
+// Queue a header-only reply.
+void reply_add(int sockfd, struct reply_batch *batch, const struct sockaddr_in *to,
+               uint8_t type, uint16_t flags, uint32_t transfer_id, uint64_t offset, uint32_t length) {
+    if (batch->count == MAX_BATCH) reply_flush(sockfd, batch);
+    int i = batch->count++;
+
+    struct pkt_header *hdr = &batch->hdrs[i];
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->version = PROTO_VERSION;
+    hdr->type = type;
+    hdr->flags = htons(flags);
+    hdr->transfer_id = htonl(transfer_id);
+    hdr->offset = htobe64(offset);
+    hdr->length = htonl(length);
+
+    batch->addrs[i] = *to;
+    batch->iov[i][0].iov_base = hdr;
+    batch->iov[i][0].iov_len = HEADER_LEN;
+    memset(&batch->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+    batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+    batch->msgs[i].msg_hdr.msg_namelen = sizeof(batch->addrs[i]);
+    batch->msgs[i].msg_hdr.msg_iov = batch->iov[i];
+    batch->msgs[i].msg_hdr.msg_iovlen = 1;
+}
+
+// Queue a SETUP_ACK that accepts t with its fragment size, announcing a resume, a delta signature or that
+// compressed fragments are welcome.
+void reply_setup_ack(int sockfd, struct reply_batch *batch, const struct sockaddr_in *to,
+                     const struct transfer *t) {
+    uint16_t flags = (t->resumed ? FLAG_RESUME : 0) | (t->delta_blocks ? FLAG_DELTA : 0) |
+                     (t->compress ? FLAG_LZ : 0);
+    reply_add(sockfd, batch, to, PKT_SETUP_ACK, flags, t->id, 0, sizeof(struct setup_ack_body));
+    int i = batch->count - 1;
+    memset(&batch->bodies[i], 0, sizeof(batch->bodies[i]));
+    batch->bodies[i].frag_size = htonl(t->frag_size);
+    batch->bodies[i].resumed = htobe64(t->resumed);
+    batch->bodies[i].delta_block = htonl(t->delta_block);
+    batch->bodies[i].delta_blocks = htobe64(t->delta_blocks);
+    batch->iov[i][1].iov_base = &batch->bodies[i];
+    batch->iov[i][1].iov_len = sizeof(batch->bodies[i]);
+    batch->msgs[i].msg_hdr.msg_iovlen = 2;
+}
+
+// Close the file once every fragment is queued for disk, behind the last of its digest; the entry lingers to
+// answer late duplicates and the sender's FIN.
+void transfer_check_done(struct receiver *rx, struct transfer *t) {
+    if (t->done || t->received_count != t->total_frag) return;
+    digest_advance(rx, t, 1);
+    ring_push_digest(rx->ring, WRITE_DIGEST_END, t->digest, -1, 0, 0, 1);
+    transfer_close_journal(rx, t);
+    transfer_close_file(rx, t);
+    delta_close_basis(rx, t);
+    fec_free(t);
+    free(t->received);
+    t->received = NULL;
+    t->done = 1;
+    printf("[DEBUG] File '%s' received completely (%llu fragments, %llu reordered, %llu duplicates dropped, "
+           "%llu deferred by a full write ring, %llu rebuilt from parity, %llu failed CRC).\n",
+           t->filename, (unsigned long long)t->total_frag, (unsigned long long)t->reordered,
+           (unsigned long long)t->duplicates, (unsigned long long)t->ring_full, (unsigned long long)t->fec_rebuilt,
+           (unsigned long long)t->crc_errors);
+    if (t->copied_bytes) {
+        printf("[DEBUG] Delta: %llu of %llu bytes copied from the existing copy.\n",
+               (unsigned long long)t->copied_bytes, (unsigned long long)t->file_size);
+    }
+    if (t->hole_bytes) {
+        printf("[DEBUG] Sparse: %llu of %llu bytes left as holes.\n",
+               (unsigned long long)t->hole_bytes, (unsigned long long)t->file_size);
+    }
+    if (t->lz_fragments) {
+        printf("[DEBUG] LZ4: %llu fragments arrived compressed, %llu bytes expanded to %llu.\n",
+               (unsigned long long)t->lz_fragments, (unsigned long long)t->lz_bytes,
+               (unsigned long long)t->lz_raw_bytes);
+    }
+}
+
+void handle_setup(struct receiver *rx, const struct sockaddr_in *from, const struct pkt_header *hdr,
+                  const char *body, long long now) {
+    struct transfer *t = transfer_find(&rx->table, from, hdr->transfer_id);
+    if (t) {
+        // A retransmitted SETUP whose SETUP_ACK was lost, or asking again while the signature is built.
+        t->last_active_us = now;
+        if (delta_pending(t)) reply_add(rx->sockfd, &rx->replies, from, PKT_SETUP_ACK, FLAG_PENDING, t->id, 0, 0);
+        else reply_setup_ack(rx->sockfd, &rx->replies, from, t);
+        return;
+    }
+
+    struct setup_body setup;
+    if (hdr->length < sizeof(setup)) return;
+    memcpy(&setup, body, sizeof(setup));
+    int name_len = ntohs(setup.name_len);
+    if (name_len == 0 || name_len > MAX_NAME_LEN ||
+        sizeof(setup) + name_len > hdr->length || ntohl(setup.frag_size) == 0) {
+        fprintf(stderr, "[DEBUG] Malformed SETUP dropped\n");
+        return;
+    }
+
+    t = calloc(1, sizeof(*t));
+    if (!t) {
+        perror("[ERROR] calloc (transfer) failed");
+        return;
+    }
+    t->peer = *from;
+    t->id = hdr->transfer_id;
+    t->fd = -1;
+    t->journal_fd = -1;
+    t->basis_fd = -1;
+    memcpy(t->filename, body + sizeof(setup), name_len);
+    t->filename[name_len] = '\0';
+    t->file_size = be64toh(setup.file_size);
+    uint64_t output_size = t->file_size;
+    int ranged = (hdr->flags & FLAG_RANGE) != 0;
+    if (ranged) {
+        t->range_offset = be64toh(setup.range_offset);
+        t->file_size = be64toh(setup.range_length);
+        if (t->range_offset > output_size || t->file_size > output_size - t->range_offset) {
+            fprintf(stderr, "[DEBUG] SETUP range outside the file dropped\n");
+            free(t);
+            return;
+        }
+    }
+    t->frag_size = ntohl(setup.frag_size);
+    if (t->frag_size > MAX_FRAG_SIZE) t->frag_size = MAX_FRAG_SIZE;
+    t->total_frag = (t->file_size + t->frag_size - 1) / t->frag_size;
+    t->file_id = be64toh(setup.file_id);
+    t->compress = (hdr->flags & FLAG_LZ) != 0;
+    t->sparse = (hdr->flags & FLAG_SPARSE) != 0;
+    t->last_active_us = now;
+
+    // Opened for reading too: the writer reads the output back for its digest, and -m maps it shared.
+    int mode = O_RDWR;
+    char journal[MAX_NAME_LEN + sizeof(JOURNAL_SUFFIX)];
+    int64_t resumed = -1;
+    t->received = bitmap_alloc(t->total_frag);
+    t->digest = calloc(1, sizeof(*t->digest));
+    // A range stream shares the output with its siblings: it is neither journaled nor diffed, and must not
+    // truncate what they have already written.
+    if (ranged) t->file_id = 0;
+    // A checkpoint is queued as one write of at most 4GB, which caps a journal at about 2^35 fragments.
+    if (t->file_id && bitmap_bytes(t->total_frag) > UINT32_MAX - sizeof(struct journal_header)) {
+        printf("[DEBUG] '%s' has too many fragments (%llu) to journal, the transfer will not be resumable.\n",
+               t->filename, (unsigned long long)t->total_frag);
+        t->file_id = 0;
+    }
+    // A bundle is received whole into <file>.bundle, and is neither journaled nor diffed either.
+    if ((hdr->flags & FLAG_BUNDLE) && !ranged) {
+        t->bundle = 1;
+        t->file_id = 0;
+        char path[MAX_NAME_LEN + sizeof(JOURNAL_SUFFIX)];
+        side_path(t, BUNDLE_SUFFIX, path);
+        t->fd = open(path, mode | O_CREAT | O_TRUNC, 0644);
+    }
+    // A delta transfer builds the new version beside the old one and is not journaled.
+    if (!ranged && !t->bundle && (hdr->flags & FLAG_DELTA) && t->received && t->total_frag > 0 &&
+        delta_prepare(t, mode) == 0) {
+        t->file_id = 0;
+        t->delta = 1;
+        printf("[DEBUG] Delta transfer of '%s': %u-byte signature blocks over the %llu-byte existing copy.\n",
+               t->filename, t->delta_block, (unsigned long long)t->basis_size);
+    }
+    if (t->received && t->file_id) {
+        side_path(t, JOURNAL_SUFFIX, journal);
+        resumed = journal_load(t, journal);
+    }
+    // Resuming keeps the partial output, so it only works while that is still there.
+    if (resumed >= 0) t->fd = open(t->filename, mode);
+    if (t->fd < 0 && !t->bundle) {
+        if (resumed > 0) memset(t->received, 0, bitmap_bytes(t->total_frag));
+        resumed = -1;
+        t->fd = open(t->filename, mode | O_CREAT | (ranged ? 0 : O_TRUNC), 0644);
+    }
+    // A sparse file is sized now, writes alone would leave it short of a trailing hole.
+    if (t->fd >= 0 && (ranged || t->sparse) && preallocate_output(t->fd, output_size, ranged, t->sparse) < 0) {
+        close(t->fd);
+        t->fd = -1;
+    }
+    if (t->fd < 0 || !t->received || !t->digest) {
+        perror("[ERROR] open failed");
+        reply_add(rx->sockfd, &rx->replies, from, PKT_SETUP_ACK, FLAG_REJECT, hdr->transfer_id, 0, 0);
+        transfer_free(rx, t);
+        return;
+    }
+    int fec = ntohs(setup.fec);
+    int fec_k = fec >> 8, fec_m = fec & 0xff, fec_rs = (hdr->flags & FLAG_FEC_RS) != 0;
+    if (fec && t->total_frag > 0) {
+        if (fec_k < 2 || fec_k > FEC_MAX_K || fec_m < 1 || fec_m > FEC_MAX_M || (!fec_rs && fec_m != 1) ||
+            fec_alloc(t, fec_k, fec_m, fec_rs) < 0) {
+            fprintf(stderr, "[DEBUG] FEC %d+%d not usable, parity will be ignored\n", fec_k, fec_m);
+        }
+    }
+    if (t->file_id) {
+        // A journal of another version of the file is replaced by a new inode, not rewritten in place.
+        if (resumed < 0) unlink(journal);
+        t->journal_fd = open(journal, O_WRONLY | O_CREAT, 0644);
+        if (t->journal_fd < 0) perror("[DEBUG] Opening the journal failed, transfer will not be resumable");
+    }
+    if (resumed > 0) {
+        t->resumed = t->received_count = t->journal_count = resumed;
+        printf("[DEBUG] Resuming '%s' from its journal, %llu/%llu fragments already on disk.\n",
+               t->filename, (unsigned long long)t->resumed, (unsigned long long)t->total_frag);
+        digest_advance(rx, t, 0);
+    }
+    // Past SIZE_MAX (a 32-bit build) the output cannot be mapped and goes through the ring instead.
+    if (rx->map_output && t->file_size > 0 && t->file_size <= SIZE_MAX) {
+        if (ranged || preallocate_output(t->fd, output_size, 0, t->sparse) == 0) {
+            t->map = map_output_file(t->fd, t->range_offset, t->file_size);
+        }
+        if (!t->map) perror("[DEBUG] Mapping output failed, writing through the ring instead");
+    }
+    transfer_insert(&rx->table, t);
+    if (ranged) {
+        printf("[DEBUG] Start receiving bytes %llu-%llu of file '%s' (%llu fragments) from %s:%d, %d active.\n",
+               (unsigned long long)t->range_offset, (unsigned long long)(t->range_offset + t->file_size),
+               t->filename, (unsigned long long)t->total_frag, inet_ntoa(from->sin_addr), ntohs(from->sin_port),
+               rx->table.count);
+    } else {
+        printf("[DEBUG] Start receiving file '%s' (%llu bytes, total %llu fragments) from %s:%d, %d active.\n",
+               t->filename, (unsigned long long)t->file_size, (unsigned long long)t->total_frag,
+               inet_ntoa(from->sin_addr), ntohs(from->sin_port), rx->table.count);
+    }
+
+    if (delta_pending(t)) reply_add(rx->sockfd, &rx->replies, from, PKT_SETUP_ACK, FLAG_PENDING, t->id, 0, 0);
+    else reply_setup_ack(rx->sockfd, &rx->replies, from, t);
+    transfer_check_done(rx, t);
+}
+
+// Store a new fragment (copy into the mapping or queue it for the writer) and mark it received.
+// A compressed (LZ4) payload is expanded on the way, straight into the mapping or the ring slot, and *raw
+// then points at the fragment's bytes. Returns -1 if the write ring is full, -2 if it does not decompress.
+int accept_fragment(struct receiver *rx, struct transfer *t, uint64_t frag_index, const char *payload,
+                    uint32_t length, int compressed, const char **raw) {
+    uint64_t offset = frag_index * t->frag_size;
+    uint32_t raw_length = t->file_size - offset < t->frag_size ? (uint32_t)(t->file_size - offset) : t->frag_size;
+    const char *stored = payload;
+    int rc = 0;
+    if (compressed && t->map) {
+        stored = t->map + offset;
+        rc = lz4_decompress((const uint8_t *)payload, length, (uint8_t *)t->map + offset, raw_length) < 0 ? -2 : 0;
+    } else if (compressed) {
+        rc = ring_push_decompress(rx->ring, t->fd, t->range_offset + offset, payload, length, raw_length, &stored);
+    } else if (t->map) {
+        // receive_mapped() usually put the payload in place already.
+        if (payload != t->map + offset) memcpy(t->map + offset, payload, length);
+    } else {
+        rc = ring_push_write(rx->ring, t->fd, t->range_offset + offset, payload, length);
+    }
+    if (rc == -1) t->ring_full++;
+    if (rc < 0) return rc;
+    if (compressed) {
+        t->lz_fragments++;
+        t->lz_bytes += length;
+        t->lz_raw_bytes += raw_length;
+    }
+    if (raw) *raw = stored;
+    bitmap_set(t->received, frag_index);
+    t->received_count++;
+    if (frag_index < t->highest_index) t->reordered++;
+    else t->highest_index = frag_index;
+    if (frag_index == t->digest_next) digest_advance(rx, t, 0);
+    return 0;
+}
+
+// Add data fragment i (parity j < 0) or parity j of group g to the FEC cache, then rebuild whatever it allows.
+void fec_add(struct receiver *rx, struct transfer *t, const struct sockaddr_in *from, long long g,
+             int i, int j, const char *payload, uint32_t length) {
+    struct fec_group *grp = fec_group_get(t, g);
+    if (!grp || grp->complete) return;
+    if (j < 0) {
+        if (grp->data_mask >> i & 1) return;
+        uint8_t *dst = grp->data + (size_t)i * t->frag_size;
+        memcpy(dst, payload, length);
+        memset(dst + length, 0, t->frag_size - length);
+        grp->data_mask |= (uint64_t)1 << i;
+        grp->data_have++;
+    } else {
+        if (grp->parity_mask >> j & 1) return;
+        memcpy(grp->parity + (size_t)j * t->frag_size, payload, t->frag_size);
+        grp->parity_mask |= (uint32_t)1 << j;
+        grp->parity_have++;
+    }
+    if (grp->data_have == grp->k) {
+        grp->complete = 1;
+        return;
+    }
+    if (grp->data_have + grp->parity_have < grp->k) return;
+
+    uint64_t had = grp->data_mask;
+    if (fec_rebuild(t, grp) < 0) return;
+    grp->complete = 1;
+    for (int d = 0; d < grp->k; d++) {
+        if (had >> d & 1) continue;
+        uint64_t frag_index = g * t->fec_k + d;
+        uint64_t offset = frag_index * t->frag_size;
+        uint32_t len = t->file_size - offset < t->frag_size ? (uint32_t)(t->file_size - offset) : t->frag_size;
+        if (bitmap_test(t->received, frag_index)) continue;
+        if (accept_fragment(rx, t, frag_index, (const char *)grp->data + (size_t)d * t->frag_size, len, 0, NULL) < 0) {
+            grp->complete = 0;      // Let the sender's retransmission fill it in
+            continue;
+        }
+        t->fec_rebuilt++;
+        reply_add(rx->sockfd, &rx->replies, from, PKT_ACK, FLAG_FEC_REBUILT, t->id, offset, len);
+    }
+}
+
+// Check the CRC32C a DATA fragment carries in reserved (FLAG_CRC). It covers the header as sent, with
+// reserved zeroed, and then the payload, so a damaged offset is caught as well as damaged data.
+int fragment_crc_ok(const struct pkt_header *hdr, const char *payload) {
+    struct pkt_header wire;
+    memset(&wire, 0, sizeof(wire));
+    wire.version = hdr->version;
+    wire.type = hdr->type;
+    wire.flags = htons(hdr->flags);
+    wire.transfer_id = htonl(hdr->transfer_id);
+    wire.offset = htobe64(hdr->offset);
+    wire.length = htonl(hdr->length);
+    return crc32c(crc32c(0, &wire, HEADER_LEN), payload, hdr->length) == hdr->reserved;
+}
+
+void handle_data(struct receiver *rx, const struct sockaddr_in *from, const struct pkt_header *hdr,
+                 const char *payload, long long now) {
+    struct transfer *t = transfer_find(&rx->table, from, hdr->transfer_id);
+    if (!t) return;
+    t->last_active_us = now;
+
+    // A retransmission whose ACK was lost after the transfer finished.
+    if (t->done) {
+        reply_add(rx->sockfd, &rx->replies, from, PKT_ACK, 0, t->id, hdr->offset, hdr->length);
+        return;
+    }
+
+    // A plain payload must be the fragment's full length. A compressed one only has to fit the datagram,
+    // it must expand to that length.
+    int compressed = (hdr->flags & FLAG_LZ) != 0;
+    uint64_t frag_index = hdr->offset / t->frag_size;
+    if (hdr->offset % t->frag_size != 0 || frag_index >= t->total_frag) {
+        fprintf(stderr, "[DEBUG] Fragment at offset %llu out of range\n",
+                (unsigned long long)hdr->offset);
+        return;
+    }
+    uint32_t raw_length = t->file_size - hdr->offset < t->frag_size ? t->file_size - hdr->offset : t->frag_size;
+    if (compressed && !t->compress) {
+        fprintf(stderr, "[DEBUG] Fragment at offset %llu is compressed, LZ4 was not agreed\n",
+                (unsigned long long)hdr->offset);
+        return;
+    }
+    if (!compressed && hdr->length != raw_length) {
+        fprintf(stderr, "[DEBUG] Fragment at offset %llu has %u bytes, expected %u\n",
+                (unsigned long long)hdr->offset, hdr->length, raw_length);
+        return;
+    }
+
+    if (bitmap_test(t->received, frag_index)) {
+        t->duplicates++;
+    } else {
+        if ((hdr->flags & FLAG_CRC) && !fragment_crc_ok(hdr, payload)) {
+            t->crc_errors++;
+            if (rx->verbose) {
+                printf("[DEBUG] Fragment #%llu failed its CRC, dropped.\n", (unsigned long long)frag_index + 1);
+            }
+            return;      // Not ACKed, so the sender will resend it
+        }
+        const char *raw;
+        int rc = accept_fragment(rx, t, frag_index, payload, hdr->length, compressed, &raw);
+        if (rc < 0) {
+            if (rx->verbose) {
+                printf("[DEBUG] %s, fragment #%llu dropped.\n", rc == -1 ? "Write ring full" : "Bad LZ4 block",
+                       (unsigned long long)frag_index + 1);
+            }
+            return;      // Not ACKed, so the sender will resend it
+        }
+        if (t->fec_k) fec_add(rx, t, from, frag_index / t->fec_k, frag_index % t->fec_k, -1, raw, raw_length);
+    }
+
+    reply_add(rx->sockfd, &rx->replies, from, PKT_ACK, 0, t->id, hdr->offset, hdr->length);
+    if (rx->verbose) {
+        printf("[DEBUG] Sent ACK for fragment #%llu of %08x\n", (unsigned long long)frag_index + 1, t->id);
+    }
+    transfer_check_done(rx, t);
+}
+
+// Answer a request for bytes [offset, offset + reserved) of one of a transfer's tables: the received bitmap
+// (BITMAP, bit i of byte i / 8 stands for fragment i) or the delta signature (SIGNATURE).
+// Sent straight away rather than batched, the tables may be freed before a flush.
+void handle_table(struct receiver *rx, const struct sockaddr_in *from, const struct pkt_header *hdr,
+                  long long now) {
+    struct transfer *t = transfer_find(&rx->table, from, hdr->transfer_id);
+    if (!t) return;
+    t->last_active_us = now;
+    uint64_t bytes = (t->total_frag + 7) / 8;
+    if (hdr->type == PKT_SIGNATURE) bytes = t->signature ? (uint64_t)t->delta_blocks * SIG_ENTRY_LEN : 0;
+    if (hdr->offset >= bytes) return;
+    uint32_t len = hdr->reserved < TABLE_CHUNK ? hdr->reserved : TABLE_CHUNK;
+    if (len > bytes - hdr->offset) len = bytes - hdr->offset;
+
+    char pkt[HEADER_LEN + TABLE_CHUNK];
+    struct pkt_header *reply = (struct pkt_header *)pkt;
+    memset(reply, 0, HEADER_LEN);
+    reply->version = PROTO_VERSION;
+    reply->type = hdr->type;
+    reply->transfer_id = htonl(t->id);
+    reply->offset = htobe64(hdr->offset);
+    reply->length = htonl(len);
+    if (hdr->type == PKT_SIGNATURE) {
+        memcpy(pkt + HEADER_LEN, t->signature + hdr->offset, len);
+    } else {
+        for (uint32_t i = 0; i < len; i++) {
+            uint64_t byte = hdr->offset + i;
+            pkt[HEADER_LEN + i] = t->done ? 0xff : (t->received[byte / 8] >> (byte % 8 * 8)) & 0xff;
+        }
+    }
+    if (sendto(rx->sockfd, pkt, HEADER_LEN + len, 0, (const struct sockaddr *)from, sizeof(*from)) < 0) {
+        perror("[ERROR] sendto (table) failed");
+    }
+}
+
+// Apply a packet of COPY records: queue each delta copy from the basis for the writer, zero each hole
+// (COPY_HOLE) in place, and count every fragment lying wholly inside one record as received, the sender will
+// not send those. ACKed with an empty COPY once all are applied; a repeat after a lost ACK does the same again.
+void handle_copy(struct receiver *rx, const struct sockaddr_in *from, const struct pkt_header *hdr,
+                 const char *body, long long now) {
+    struct transfer *t = transfer_find(&rx->table, from, hdr->transfer_id);
+    if (!t) return;
+    t->last_active_us = now;
+    if (!t->done) {
+        if (hdr->length % COPY_RECORD_LEN != 0) return;
+        for (uint32_t r = 0; r < hdr->length / COPY_RECORD_LEN; r++) {
+            uint64_t rec[3];
+            memcpy(rec, body + r * COPY_RECORD_LEN, COPY_RECORD_LEN);
+            uint64_t offset = be64toh(rec[0]), src = be64toh(rec[1]), len = be64toh(rec[2]);
+            int hole = src == COPY_HOLE;
+            if (offset > t->file_size || len > t->file_size - offset ||
+                (!hole && (t->basis_fd < 0 || src > t->basis_size || len > t->basis_size - src))) {
+                fprintf(stderr, "[DEBUG] COPY record outside the files dropped\n");
+                return;
+            }
+            // A COPY resent after its ACK was lost, or after the ring filled up part way through, repeats
+            // records already applied: skip those whose whole fragments are all in, so nothing counts twice.
+            uint64_t first = (offset + t->frag_size - 1) / t->frag_size;
+            uint64_t last = offset + len == t->file_size ? t->total_frag : (offset + len) / t->frag_size;
+            if (last < first) last = first;
+            if (last > first && bitmap_range(t->received, first, last, 0) == last - first) continue;
+            // Holes go through the ring too: without hole punching they are written as zeros, which must not
+            // hold up this shard's ACKs.
+            uint64_t piece_max = hole ? ZERO_PIECE : COPY_PIECE;
+            for (uint64_t done = 0; done < len; done += piece_max) {
+                uint32_t piece = len - done < piece_max ? len - done : piece_max;
+                int queued = hole ? ring_push_zero(rx->ring, t->fd, t->range_offset + offset + done, piece)
+                                  : ring_push_copy(rx->ring, t->fd, offset + done, t->basis_fd, src + done, piece);
+                if (queued < 0) {
+                    t->ring_full++;
+                    return;      // Not ACKed, so the sender will resend it
+                }
+            }
+            if (hole) t->hole_bytes += len;
+            else t->copied_bytes += len;
+            t->received_count += bitmap_range(t->received, first, last, 1);
+        }
+        digest_advance(rx, t, 0);
+    }
+    reply_add(rx->sockfd, &rx->replies, from, PKT_COPY, 0, t->id, hdr->offset, 0);
+    transfer_check_done(rx, t);
+}
+
+// Compare the sender's whole-file digest (FIN) with the one read back from the output and answer FIN_ACK,
+// with FLAG_PENDING while the writer is still hashing. Only a verified file loses its journal and only a
+// verified delta output replaces the old version; after a mismatch both are discarded so a retry starts over.
+void handle_fin(struct receiver *rx, const struct sockaddr_in *from, const struct pkt_header *hdr,
+                const char *body, long long now) {
+    struct transfer *t = transfer_find(&rx->table, from, hdr->transfer_id);
+    if (!t) return;
+    t->last_active_us = now;
+    if (!t->done || hdr->length < 2 * sizeof(uint64_t)) return;
+    if (!t->verified) {
+        if (!atomic_load_explicit(&t->digest->ready, memory_order_acquire)) {
+            reply_add(rx->sockfd, &rx->replies, from, PKT_FIN_ACK, FLAG_PENDING, t->id, 0, 0);
+            return;
+        }
+        uint64_t sent[2];
+        memcpy(sent, body, sizeof(sent));
+        const uint64_t *have = t->digest->result;
+        t->verified = be64toh(sent[0]) == have[0] && be64toh(sent[1]) == have[1] ? 1 : -1;
+        if (t->file_id) {
+            char journal[MAX_NAME_LEN + sizeof(JOURNAL_SUFFIX)];
+            side_path(t, JOURNAL_SUFFIX, journal);
+            unlink(journal);
+        }
+        transfer_finish_delta(rx, t, t->verified > 0);
+        transfer_finish_bundle(rx, t, t->verified > 0);
+        if (t->verified > 0) {
+            printf("[DEBUG] File '%s' verified, digest %016llx%016llx.\n", t->filename,
+                   (unsigned long long)have[0], (unsigned long long)have[1]);
+        } else {
+            fprintf(stderr, "[ERROR] File '%s' does not match the sender's digest (%016llx%016llx here).\n",
+                    t->filename, (unsigned long long)have[0], (unsigned long long)have[1]);
+        }
+    }
+    reply_add(rx->sockfd, &rx->replies, from, PKT_FIN_ACK, t->verified < 0 ? FLAG_REJECT : 0, t->id, 0, 0);
+}
+
+// Store a parity fragment and rebuild its group if that is now possible. Parity is never ACKed.
+void handle_parity(struct receiver *rx, const struct sockaddr_in *from, const struct pkt_header *hdr,
+                   const char *payload, long long now) {
+    struct transfer *t = transfer_find(&rx->table, from, hdr->transfer_id);
+    if (!t) return;
+    t->last_active_us = now;
+    if (t->done || !t->fec_k) return;
+
+    uint64_t first = hdr->offset / t->frag_size;
+    if (hdr->offset % t->frag_size != 0 || first % t->fec_k != 0 || first >= t->total_frag ||
+        hdr->length != t->frag_size || hdr->reserved >= (uint32_t)t->fec_m ||
+        ((hdr->flags & FLAG_FEC_RS) != 0) != t->fec_rs) {
+        fprintf(stderr, "[DEBUG] Parity at offset %llu does not match the transfer\n",
+                (unsigned long long)hdr->offset);
+        return;
+    }
+    fec_add(rx, t, from, first / t->fec_k, 0, hdr->reserved, payload, hdr->length);
+    transfer_check_done(rx, t);
+}
+
+// Dispatch a parsed packet of len bytes whose body (payload) is at body.
+void dispatch_packet(struct receiver *rx, const struct sockaddr_in *from, const struct pkt_header *hdr,
+                     const char *body, int len, long long now) {
+    switch (hdr->type) {
+    case PKT_SETUP:
+        handle_setup(rx, from, hdr, body, now);
+        break;
+    case PKT_PROBE:
+        // Echo the probed datagram size so the sender learns it crossed the path.
+        reply_add(rx->sockfd, &rx->replies, from, PKT_PROBE_ACK, 0, hdr->transfer_id, len, 0);
+        break;
+    case PKT_DATA:
+        handle_data(rx, from, hdr, body, now);
+        break;
+    case PKT_PARITY:
+        handle_parity(rx, from, hdr, body, now);
+        break;
+    case PKT_BITMAP:
+    case PKT_SIGNATURE:
+        handle_table(rx, from, hdr, now);
+        break;
+    case PKT_COPY:
+        handle_copy(rx, from, hdr, body, now);
+        break;
+    case PKT_FIN:
+        handle_fin(rx, from, hdr, body, now);
+        break;
+    default:
+        break;
+    }
+}
+
+void handle_packet(struct receiver *rx, const struct sockaddr_in *from, const char *buf, int len,
+                   long long now) {
+    struct pkt_header hdr;
+    if (parse_header(buf, len, &hdr) < 0) {
+        fprintf(stderr, "[DEBUG] Invalid packet (%d bytes) dropped\n", len);
+        return;
+    }
+    dispatch_packet(rx, from, &hdr, buf + HEADER_LEN, len, now);
+}
+
+void usage_impairment() {
+    fprintf(stderr,
+            "Impairment keys for -i (comma-separated, or @file):\n"
+            "  loss=P              Bernoulli loss probability\n"
+            "  ge=p:r[:good[:bad]] Gilbert-Elliott loss: transition probabilities good->bad and bad->good,\n"
+            "                      loss probability in each state (defaults 0 and 1)\n"
+            "  delay=MS jitter=MS  fixed delay and uniform +-jitter\n"
+            "  reorder=P[:MS]      hold a packet back an extra MS (default 1) with probability P\n"
+            "  dup=P               duplicate a packet with probability P\n"
+            "  corrupt=P           flip one payload bit of a DATA packet with probability P\n"
+            "  rate=MBPS queue=MS  rate cap and the backlog it queues before dropping (default 100)\n"
+            "  seed=N              PRNG seed (default: time); shard i uses N + i\n");
+}
+
+// Parse an -i spec into imp. Returns -1 on an unknown key or bad value.
+int parse_impairment(const char *spec, struct impairment *imp) {
+    char text[4096];
+    if (spec[0] == '@') {
+        FILE *f = fopen(spec + 1, "r");
+        if (!f) {
+            perror("[ERROR] Cannot open impairment file");
+            return -1;
+        }
+        size_t n = fread(text, 1, sizeof(text) - 1, f);
+        text[n] = '\0';
+        fclose(f);
+    } else {
+        snprintf(text, sizeof(text), "%s", spec);
+    }
+
+    memset(imp, 0, sizeof(*imp));
+    imp->reorder_us = IMPAIR_GAP_US;
+    imp->queue_us = IMPAIR_QUEUE_US;
+    imp->seed = (uint64_t)time(NULL);
+    imp->ge_loss_bad = 1.0;
+
+    char *save = NULL;
+    for (char *tok = strtok_r(text, ", \t\r\n", &save); tok; tok = strtok_r(NULL, ", \t\r\n", &save)) {
+        if (tok[0] == '#') break;
+        char *val = strchr(tok, '=');
+        if (!val) {
+            fprintf(stderr, "[ERROR] Impairment '%s' needs a value\n", tok);
+            return -1;
+        }
+        *val++ = '\0';
+        double ms;
+        if (!strcmp(tok, "loss")) {
+            imp->loss = atof(val);
+        } else if (!strcmp(tok, "ge")) {
+            imp->gilbert = 1;
+            if (sscanf(val, "%lf:%lf:%lf:%lf", &imp->ge_p, &imp->ge_r,
+                       &imp->ge_loss_good, &imp->ge_loss_bad) < 2) {
+                fprintf(stderr, "[ERROR] ge needs at least p:r\n");
+                return -1;
+            }
+        } else if (!strcmp(tok, "delay")) {
+            imp->delay_us = atof(val) * 1000;
+        } else if (!strcmp(tok, "jitter")) {
+            imp->jitter_us = atof(val) * 1000;
+        } else if (!strcmp(tok, "reorder")) {
+            ms = IMPAIR_GAP_US / 1000.0;
+            sscanf(val, "%lf:%lf", &imp->reorder, &ms);
+            imp->reorder_us = ms * 1000;
+        } else if (!strcmp(tok, "dup")) {
+            imp->dup = atof(val);
+        } else if (!strcmp(tok, "corrupt")) {
+            imp->corrupt = atof(val);
+        } else if (!strcmp(tok, "rate")) {
+            imp->rate_bps = atof(val) * 1e6;
+        } else if (!strcmp(tok, "queue")) {
+            imp->queue_us = atof(val) * 1000;
+        } else if (!strcmp(tok, "seed")) {
+            imp->seed = strtoull(val, NULL, 0);
+        } else {
+            fprintf(stderr, "[ERROR] Unknown impairment '%s'\n", tok);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Hold a copy of a datagram until release_us.
+void held_push(struct receiver *rx, const struct sockaddr_in *from, const char *buf, int len,
+               long long release_us) {
+    if (rx->held_count == rx->held_cap) {
+        int cap = rx->held_cap ? rx->held_cap * 2 : 256;
+        struct held_packet *held = realloc(rx->held, cap * sizeof(*held));
+        if (!held) return;
+        rx->held = held;
+        rx->held_cap = cap;
+    }
+    struct held_packet p = { release_us, rx->held_seq++, *from, len, malloc(len) };
+    if (!p.data) return;
+    memcpy(p.data, buf, len);
+
+    int i = rx->held_count++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        struct held_packet *up = &rx->held[parent];
+        if (up->release_us < p.release_us || (up->release_us == p.release_us && up->seq < p.seq)) break;
+        rx->held[i] = *up;
+        i = parent;
+    }
+    rx->held[i] = p;
+}
+
+// Remove the earliest held packet into *out.
+void held_pop(struct receiver *rx, struct held_packet *out) {
+    *out = rx->held[0];
+    struct held_packet last = rx->held[--rx->held_count];
+    int i = 0;
+    while (1) {
+        int child = 2 * i + 1;
+        if (child >= rx->held_count) break;
+        struct held_packet *c = &rx->held[child];
+        if (child + 1 < rx->held_count &&
+            (c[1].release_us < c->release_us || (c[1].release_us == c->release_us && c[1].seq < c->seq)))
+            c++, child++;
+        if (last.release_us < c->release_us || (last.release_us == c->release_us && last.seq < c->seq)) break;
+        rx->held[i] = *c;
+        i = child;
+    }
+    rx->held[i] = last;
+}
+
+// Decide the fate of one incoming DATA datagram: drop it, damage it, hold it back, or handle it right away.
+void impair_input(struct receiver *rx, const struct sockaddr_in *from, char *buf, int len,
+                  long long now) {
+    const struct impairment *imp = rx->imp;
+    struct rng *r = &rx->rng;
+
+    int lost;
+    if (imp->gilbert) {
+        if (rx->ge_bad) {
+            if (rng_uniform(r) < imp->ge_r) rx->ge_bad = 0;
+        } else {
+            if (rng_uniform(r) < imp->ge_p) rx->ge_bad = 1;
+        }
+        lost = rng_uniform(r) < (rx->ge_bad ? imp->ge_loss_bad : imp->ge_loss_good);
+    } else {
+        lost = imp->loss > 0 && rng_uniform(r) < imp->loss;
+    }
+    if (lost) {
+        if (rx->verbose) printf("[DEBUG] Packet lost, simulating network failure.\n");
+        return;
+    }
+    // Damage the kind of link checksums can miss: a single bit, in place.
+    if (imp->corrupt > 0 && buf[1] == PKT_DATA && len > HEADER_LEN && rng_uniform(r) < imp->corrupt) {
+        uint64_t bit = rng_next(r) % ((uint64_t)(len - HEADER_LEN) * 8);
+        buf[HEADER_LEN + bit / 8] ^= 1 << (bit % 8);
+    }
+
+    long long release_us = now;
+    if (imp->rate_bps > 0) {
+        // Serialize onto the capped link; tail-drop once its backlog exceeds queue_us.
+        if (rx->link_free_us < now) rx->link_free_us = now;
+        if (rx->link_free_us - now > imp->queue_us) {
+            if (rx->verbose) printf("[DEBUG] Packet dropped by the rate-capped queue.\n");
+            return;
+        }
+        rx->link_free_us += (long long)(len * 8 * 1e6 / imp->rate_bps);
+        release_us = rx->link_free_us;
+    }
+    release_us += imp->delay_us;
+    if (imp->jitter_us > 0) {
+        release_us += (long long)((2 * rng_uniform(r) - 1) * imp->jitter_us);
+    }
+    if (imp->reorder > 0 && rng_uniform(r) < imp->reorder) release_us += imp->reorder_us;
+
+    int copies = (imp->dup > 0 && rng_uniform(r) < imp->dup) ? 2 : 1;
+    for (int c = 0; c < copies; c++) {
+        if (release_us <= now && rx->held_count == 0) {
+            handle_packet(rx, from, buf, len, now);
+        } else {
+            held_push(rx, from, buf, len, release_us);
+        }
+    }
+}
+
+// Entry point for every received datagram; only DATA and PARITY go through the impairment layer.
+void input_packet(struct receiver *rx, const struct sockaddr_in *from, char *buf, int len,
+                  long long now) {
+    if (rx->imp && len >= HEADER_LEN && (buf[1] == PKT_DATA || buf[1] == PKT_PARITY)) {
+        impair_input(rx, from, buf, len, now);
+    } else {
+        handle_packet(rx, from, buf, len, now);
+    }
+}
+
+// Handle every held packet that is due.
+void impair_release(struct receiver *rx, long long now) {
+    while (rx->held_count > 0 && rx->held[0].release_us <= now) {
+        struct held_packet p;
+        held_pop(rx, &p);
+        handle_packet(rx, &p.from, p.data, p.len, now);
+        free(p.data);
+    }
+}
+
+// With packets held, wait only until the next one is due. Returns extra flags for the receive call.
+int impair_wait(struct receiver *rx) {
+    if (rx->held_count == 0) return 0;
+    long long wait_us = rx->held[0].release_us - current_timestamp_us();
+    if (wait_us > 0) {
+        struct pollfd pfd = { rx->sockfd, POLLIN, 0 };
+        struct timespec ts = { wait_us / 1000000, (wait_us % 1000000) * 1000 };
+        ppoll(&pfd, 1, &ts, NULL);
+    }
+    return MSG_DONTWAIT;
+}
+
+// Receive one datagram in -m mode. The header is peeked first; a new in-range uncompressed DATA fragment
+// of a mapped transfer is then scattered so its payload lands at its final offset, anything else goes
+// through scratch (compressed fragments are expanded from there into the mapping).
+// Returns -1 when nothing was received.
+int receive_mapped(struct receiver *rx, char *scratch, int flags) {
+    char head[HEADER_LEN];
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+    int len = recvfrom(rx->sockfd, head, HEADER_LEN, flags | MSG_PEEK | MSG_TRUNC,
+                       (struct sockaddr*)&from, &from_len);
+    if (len < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) perror("[ERROR] recvfrom failed");
+        return -1;
+    }
+
+    char *dest = NULL;
+    struct pkt_header hdr;
+    if (!rx->imp && parse_header(head, len, &hdr) == 0 && hdr.type == PKT_DATA) {
+        struct transfer *t = transfer_find(&rx->table, &from, hdr.transfer_id);
+        if (t && t->map && !t->done && !(hdr.flags & FLAG_LZ) && hdr.offset % t->frag_size == 0 &&
+            hdr.offset / t->frag_size < t->total_frag && hdr.offset + hdr.length <= t->file_size &&
+            !bitmap_test(t->received, hdr.offset / t->frag_size)) {
+            dest = t->map + hdr.offset;
+        }
     }
 
-    int port = atoi(argv[1]);
+    long long now;
+    if (dest) {
+        struct iovec iov[2] = { { head, HEADER_LEN }, { dest, hdr.length } };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+        if (recvmsg(rx->sockfd, &msg, flags) < 0) return -1;
+        now = current_timestamp_us();
+        dispatch_packet(rx, &from, &hdr, dest, len, now);
+    } else {
+        len = recvfrom(rx->sockfd, scratch, MAX_PACKET_LEN, flags, (struct sockaddr*)&from, &from_len);
+        if (len < 0) return -1;
+        now = current_timestamp_us();
+        input_packet(rx, &from, scratch, len, now);
+    }
+    return 0;
+}
 
+// Create one shard's socket. SO_REUSEPORT lets every shard bind the same port.
+int open_shard_socket(int port, int gro) {
     int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0) {
         perror("[ERROR] socket creation failed");
-        return 1;
+        return -1;
+    }
+
+    int one = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        perror("[ERROR] SO_REUSEPORT failed");
+        close(sockfd);
+        return -1;
     }
-    printf("[DEBUG] Server socket created successfully.\n");
 
-    struct sockaddr_in serv_addr, cli_addr;
+    // Large fragments need a deep receive buffer or a single burst overflows it.
+    int sock_buf = SOCKET_BUF_BYTES;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &sock_buf, sizeof(sock_buf));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &sock_buf, sizeof(sock_buf));
+
+    // Wake up periodically even when idle so stale transfers get swept.
+    struct timeval rcv_timeout = { 1, 0 };
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &rcv_timeout, sizeof(rcv_timeout));
+
+    struct sockaddr_in serv_addr;
     memset(&serv_addr, 0, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_addr.s_addr = INADDR_ANY;
@@ -52,131 +2696,226 @@ int main(int argc, char *argv[]) {
     if (bind(sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
         perror("[ERROR] bind failed");
         close(sockfd);
-        return 1;
+        return -1;
     }
-    printf("[DEBUG] Server bound to port %d.\n", port);
-
-    socklen_t cli_len = sizeof(cli_addr);
-
-    while (1) {
-        printf("[DEBUG] Waiting for handshake (ftp)...\n");
-        char buffer[BUFFER_SIZE];
-        int n = recvfrom(sockfd, buffer, BUFFER_SIZE - 1, 0,
-                         (struct sockaddr*)&cli_addr, &cli_len);
-        if (n < 0) {
-            perror("[ERROR] recvfrom failed");
-            continue;
-        }
-        buffer[n] = '\0';
-        printf("[DEBUG] Received message: '%s'\n", buffer);
-
-        if (strcmp(buffer, "ftp") == 0) {
-            const char* reply = "yes";
-            sendto(sockfd, reply, strlen(reply), 0,
-                   (struct sockaddr*)&cli_addr, cli_len);
-            printf("[DEBUG] Sent 'yes' to client. Start receiving file...\n");
-
-            FILE *fp = NULL;
-            unsigned int total_frag = 0;
-            unsigned int received_count = 0;
-            char filename[256];
-
-            while (1) {
-                char recv_buf[MAX_PACKET_LEN];
-                int packet_len = recvfrom(sockfd, recv_buf, sizeof(recv_buf), 0,
-                                          (struct sockaddr*)&cli_addr, &cli_len);
-                if (packet_len < 0) {
-                    perror("[ERROR] recvfrom (fragment) failed");
-                    break;
-                }
-
-////////////////////////////////////////////////////////////////////////////////////////////////
-                // Simulate packet loss
-                if (uniform_rand() <= 1e-2) {
-                    printf("[DEBUG] Packet lost, simulating network failure.\n");
-                    continue;
-                }
-////////////////////////////////////////////////////////////////////////////////////////////////
-
-                int colon_count = 0;
-                int header_end_index = -1;
-                for (int i = 0; i < packet_len; i++) {
-                    if (recv_buf[i] == ':') {
-                        colon_count++;
-                        if (colon_count == 4) {
-                            header_end_index = i;
-                            break;
-                        }
-                    }
-                }
-                if (header_end_index < 0) {
-                    fprintf(stderr, "[DEBUG] Invalid packet: no 4 colons\n");
-                    continue;
-                }
-
-                char header[300];
-                memcpy(header, recv_buf, header_end_index);
-                header[header_end_index] = '\0';
 
-                unsigned int t_frag, frag_no, f_size;
-                char fname[200];
+    if (gro && setsockopt(sockfd, SOL_UDP, UDP_GRO, &one, sizeof(one)) < 0) {
+        perror("[DEBUG] UDP_GRO unavailable, receiving one fragment per datagram");
+    }
+    return sockfd;
+}
 
-                if (sscanf(header, "%u:%u:%u:%s", &t_frag, &frag_no, &f_size, fname) < 4) {
-                    fprintf(stderr, "[DEBUG] sscanf parse header failed\n");
-                    continue;
-                }
+// Receive loop of one shard: batches in, per-transfer handling, batched replies out.
+void *receiver_loop(void *arg) {
+    struct receiver *rx = arg;
+    int batch_depth = rx->batch_depth;
+    int recv_buf_len = MAX_PACKET_LEN;
 
-                int data_start = header_end_index + 1;
-                int data_len = packet_len - data_start;
+    // Datagrams are received in batches of up to batch_depth.
+    struct mmsghdr *recv_msgs = calloc(batch_depth, sizeof(struct mmsghdr));
+    struct iovec *recv_iov = calloc(batch_depth, sizeof(struct iovec));
+    struct sockaddr_in *recv_addrs = calloc(batch_depth, sizeof(struct sockaddr_in));
+    char (*recv_cmsg)[CMSG_SPACE(sizeof(int))] = calloc(batch_depth, CMSG_SPACE(sizeof(int)));
+    char *recv_bufs = malloc((size_t)batch_depth * recv_buf_len);
+    if (!recv_msgs || !recv_iov || !recv_addrs || !recv_cmsg || !recv_bufs) {
+        perror("[ERROR] malloc (receive buffers) failed");
+        exit(1);
+    }
 
-                if ((unsigned int)data_len != f_size) {
-                    fprintf(stderr, "[DEBUG] data size mismatch: data_len=%d, f_size=%u\n",
-                            data_len, f_size);
-                    continue;
-                }
+    long long last_sweep_us = current_timestamp_us();
+    printf("[DEBUG] Shard %d waiting for transfers...\n", rx->shard);
+    while (!stop_requested) {
+        long long now;
+        int wait_flags = rx->imp ? impair_wait(rx) : 0;
+        if (rx->map_output) {
+            for (int m = 0; m < batch_depth; m++) {
+                if (receive_mapped(rx, recv_bufs, m ? MSG_DONTWAIT : wait_flags) < 0) break;
+            }
+            now = current_timestamp_us();
+        } else {
+            for (int m = 0; m < batch_depth; m++) {
+                recv_iov[m].iov_base = recv_bufs + (size_t)m * recv_buf_len;
+                recv_iov[m].iov_len = recv_buf_len;
+                memset(&recv_msgs[m].msg_hdr, 0, sizeof(struct msghdr));
+                recv_msgs[m].msg_hdr.msg_name = &recv_addrs[m];
+                recv_msgs[m].msg_hdr.msg_namelen = sizeof(recv_addrs[m]);
+                recv_msgs[m].msg_hdr.msg_iov = &recv_iov[m];
+                recv_msgs[m].msg_hdr.msg_iovlen = 1;
+                recv_msgs[m].msg_hdr.msg_control = recv_cmsg[m];
+                recv_msgs[m].msg_hdr.msg_controllen = sizeof(recv_cmsg[m]);
+            }
+            int got = recvmmsg(rx->sockfd, recv_msgs, batch_depth, MSG_WAITFORONE | wait_flags, NULL);
+            if (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("[ERROR] recvmmsg failed");
+            }
 
-                if (frag_no == 1) {
-                    total_frag = t_frag;
-                    strcpy(filename, fname);
-                    fp = fopen(filename, "wb");
-                    if (!fp) {
-                        perror("[ERROR] fopen failed");
-                        continue;
+            now = current_timestamp_us();
+            for (int m = 0; m < got; m++) {
+                // With GRO one datagram may hold several fragments of seg_size bytes each.
+                char *datagram = recv_bufs + (size_t)m * recv_buf_len;
+                int datagram_len = recv_msgs[m].msg_len;
+                int seg_size = datagram_len;
+                struct cmsghdr *cm;
+                for (cm = CMSG_FIRSTHDR(&recv_msgs[m].msg_hdr); cm;
+                     cm = CMSG_NXTHDR(&recv_msgs[m].msg_hdr, cm)) {
+                    if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                        memcpy(&seg_size, CMSG_DATA(cm), sizeof(int));
                     }
-                    printf("[DEBUG] Start receiving file '%s' (total %u fragments)\n",
-                           filename, total_frag);
                 }
+                if (seg_size <= 0) seg_size = datagram_len;
 
-                if (fp) {
-                    fwrite(recv_buf + data_start, 1, f_size, fp);
+                for (int seg_off = 0; seg_off < datagram_len; seg_off += seg_size) {
+                    int packet_len = datagram_len - seg_off < seg_size ? datagram_len - seg_off : seg_size;
+                    input_packet(rx, &recv_addrs[m], datagram + seg_off, packet_len, now);
                 }
+            }
+        }
+        if (rx->held_count > 0) impair_release(rx, current_timestamp_us());
+        reply_flush(rx->sockfd, &rx->replies);
 
-                received_count++;
+        if (now - last_sweep_us > SWEEP_EVERY_US) {
+            table_sweep(rx, now);
+            last_sweep_us = now;
+        }
+    }
 
-                char ack_msg[64];
-                sprintf(ack_msg, "ACK:%u", frag_no);
-                sendto(sockfd, ack_msg, strlen(ack_msg), 0,
-                       (struct sockaddr*)&cli_addr, cli_len);
-                printf("[DEBUG] Sent ACK for fragment #%u\n", frag_no);
+    table_clear(rx);
+    while (rx->held_count > 0) {
+        struct held_packet p;
+        held_pop(rx, &p);
+        free(p.data);
+    }
+    free(rx->held);
+    free(recv_bufs);
+    free(recv_cmsg);
+    free(recv_addrs);
+    free(recv_iov);
+    free(recv_msgs);
+    return NULL;
+}
 
-                if (frag_no == total_frag) {
-                    fclose(fp);
-                    printf("[DEBUG] File '%s' received completely (%u fragments).\n",
-                           filename, total_frag);
-                    break;
-                }
+int main(int argc, char *argv[]) {
+    int batch_depth = DEFAULT_BATCH;
+    int verbose = 0;
+    int gro = 0;
+    int map_output = 0;
+    int nthreads = 1;
+    struct impairment imp;
+    int impaired = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:gi:mt:v")) != -1) {
+        switch (opt) {
+        case 'b':
+            batch_depth = atoi(optarg);
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'g':
+            gro = 1;
+            break;
+        case 'i':
+            if (parse_impairment(optarg, &imp) < 0) {
+                usage_impairment();
+                return 1;
             }
+            impaired = 1;
+            break;
+        case 'm':
+            map_output = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-b batch] [-g] [-i impairment] [-m] [-t threads] [-v] <UDP listen port>\n", argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 1) {
+        fprintf(stderr, "Usage: %s [-b batch] [-g] [-i impairment] [-m] [-t threads] [-v] <UDP listen port>\n", argv[0]);
+        return 1;
+    }
+    if (batch_depth < 1) batch_depth = 1;
+    if (batch_depth > MAX_BATCH) batch_depth = MAX_BATCH;
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+    if (map_output && gro) {
+        fprintf(stderr, "[DEBUG] -m receives datagram by datagram, ignoring -g\n");
+        gro = 0;
+    }
 
-            continue;
+    int port = atoi(argv[optind]);
+    gf_init();
+    crc32c_init();
+
+    struct receiver *shards = calloc(nthreads, sizeof(struct receiver));
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    if (!shards || !threads) {
+        perror("[ERROR] calloc (shards) failed");
+        return 1;
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        shards[i].shard = i;
+        shards[i].verbose = verbose;
+        shards[i].batch_depth = batch_depth;
+        shards[i].map_output = map_output;
+        if (impaired) {
+            shards[i].imp = &imp;
+            rng_seed(&shards[i].rng, imp.seed + i);
+        }
+        shards[i].sockfd = open_shard_socket(port, gro);
+        if (shards[i].sockfd < 0) return 1;
+        shards[i].ring = calloc(1, sizeof(struct write_ring));
+        if (!shards[i].ring) {
+            perror("[ERROR] calloc (write ring) failed");
+            return 1;
+        }
+        if (pthread_create(&shards[i].writer, NULL, writer_loop, shards[i].ring) != 0) {
+            perror("[ERROR] pthread_create (writer) failed");
+            return 1;
+        }
+    }
+    // No SA_RESTART, so a blocked receive call returns EINTR and its loop sees stop_requested.
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    printf("[DEBUG] Server bound to port %d with %d receiver thread(s).\n", port, nthreads);
+    if (impaired) {
+        if (imp.gilbert) {
+            printf("[DEBUG] Impairing DATA: Gilbert-Elliott loss p %g r %g (%g/%g)", imp.ge_p, imp.ge_r,
+                   imp.ge_loss_good, imp.ge_loss_bad);
         } else {
-            const char* reply = "no";
-            sendto(sockfd, reply, strlen(reply), 0,
-                   (struct sockaddr*)&cli_addr, cli_len);
-            printf("[DEBUG] Sent 'no' to client.\n");
+            printf("[DEBUG] Impairing DATA: loss %g", imp.loss);
+        }
+        printf(", delay %lld+-%lld us, reorder %g, dup %g, corrupt %g, rate %g Mbit/s, seed %llu\n",
+               imp.delay_us, imp.jitter_us, imp.reorder, imp.dup, imp.corrupt, imp.rate_bps / 1e6,
+               (unsigned long long)imp.seed);
+    }
+
+    for (int i = 1; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, receiver_loop, &shards[i]) != 0) {
+            perror("[ERROR] pthread_create failed");
+            return 1;
         }
     }
+    receiver_loop(&shards[0]);
 
-    close(sockfd);
+    for (int i = 1; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        atomic_store_explicit(&shards[i].ring->stop, 1, memory_order_release);
+        pthread_join(shards[i].writer, NULL);
+        for (int j = 0; j < RING_SLOTS; j++) free(shards[i].ring->slots[j].buf);
+        free(shards[i].ring);
+        close(shards[i].sockfd);
+    }
+    printf("[DEBUG] Server stopped.\n");
+    free(threads);
+    free(shards);
     return 0;
 }
-